@@ -0,0 +1,103 @@
+//
+// backpressure.hpp
+// outbound byte limits for session write queues
+//
+
+#ifndef __BACKPRESSURE_HPP__
+#define __BACKPRESSURE_HPP__
+#include <atomic>
+#include <cstddef>
+
+namespace asio {
+
+	// what a write queue does with output above its high watermark
+	enum class BackpressurePolicy
+	{
+		None,  // no limit, the queue grows
+		Block, // keep queueing, producers wait on AsyncWaitWritable()
+		Drop,  // evict lower priority unsent output, else drop the new message
+		Close, // close the session
+	};
+
+	// result of offering a message to a limited queue
+	enum class Admission
+	{
+		Queued,
+		Dropped,
+		Close,
+	};
+
+	// watermark crossed by the last queue change
+	enum class Watermark
+	{
+		None,
+		High, // went up through the high watermark
+		Low,  // went down through the low watermark
+	};
+
+	// Per session limits in queued bytes. high = 0 disables the limit,
+	// low = 0 picks high / 2.
+	struct WatermarkOptions
+	{
+		std::size_t high = 0;
+		std::size_t low  = 0;
+		BackpressurePolicy policy = BackpressurePolicy::None;
+	};
+
+	// OutboundBudget
+	// Process wide count of bytes sitting in write queues. With a limit set,
+	// every session with a policy treats an exhausted budget like its own
+	// high watermark, so many moderately slow sessions cannot add up to an
+	// out of memory either.
+	class OutboundBudget
+	{
+	public:
+		// 0 means unlimited
+		static void SetLimit(std::size_t bytes)
+		{
+			limit().store(bytes, std::memory_order_relaxed);
+		}
+
+		static std::size_t Limit()
+		{
+			return limit().load(std::memory_order_relaxed);
+		}
+
+		static std::size_t Bytes()
+		{
+			return total().load(std::memory_order_relaxed);
+		}
+
+		static bool Exceeded(std::size_t extra = 0)
+		{
+			const std::size_t cap = Limit();
+			return cap > 0 && Bytes() + extra > cap;
+		}
+
+		static void Add(std::size_t bytes)
+		{
+			total().fetch_add(bytes, std::memory_order_relaxed);
+		}
+
+		static void Sub(std::size_t bytes)
+		{
+			total().fetch_sub(bytes, std::memory_order_relaxed);
+		}
+
+	private:
+		static std::atomic<std::size_t>& total()
+		{
+			static std::atomic<std::size_t> bytes = { 0 };
+			return bytes;
+		}
+
+		static std::atomic<std::size_t>& limit()
+		{
+			static std::atomic<std::size_t> bytes = { 0 };
+			return bytes;
+		}
+	};
+
+}
+
+#endif // __BACKPRESSURE_HPP__
@@ -0,0 +1,166 @@
+//
+// broadcast.hpp
+// one to many message delivery grouped by io_context
+//
+
+#ifndef __BROADCAST_HPP__
+#define __BROADCAST_HPP__
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <asio/io_context.hpp>
+#include <asio/post.hpp>
+#include <asio/extend/compress.hpp>
+#include <asio/extend/object.hpp>
+#include <asio/extend/session_table.hpp>
+#include <asio/msgdef/payload.hpp>
+
+namespace asio {
+
+	// what to do with a session whose output queue is over the limit
+	enum class SlowConsumerPolicy
+	{
+		Skip,       // leave it out of this broadcast
+		DropOldest, // drop its oldest unsent output, then queue
+		Disconnect, // close the session
+	};
+
+	struct BroadcastOptions
+	{
+		SlowConsumerPolicy policy = SlowConsumerPolicy::Skip;
+		std::size_t max_pending_bytes = 4 * 1024 * 1024;
+	};
+
+	// Broadcaster
+	// The message is encoded once into a shared Payload. Targets are grouped
+	// by the io_context their socket runs on and each group gets a single
+	// posted handler, which queues the payload on every session of the group
+	// from that session's own thread. The caller never touches a session
+	// lock, and a 5k room costs one post per I/O thread, not one per player.
+	// Sessions that report no io_context are served inline.
+	class Broadcaster
+	{
+	public:
+		typedef std::shared_ptr<NetObject> NetObjectPtr;
+
+		explicit Broadcaster(const BroadcastOptions& options = BroadcastOptions())
+			: options_(options)
+		{
+		}
+
+		void SetOptions(const BroadcastOptions& options)
+		{
+			this->options_ = options;
+		}
+
+		const BroadcastOptions& Options() const
+		{
+			return this->options_;
+		}
+
+		// every session of a SessionTable snapshot, msg encoded once
+		// through MsgCompression
+		void Deliver(const Message& msg, const SessionTable::SnapshotList& views)
+		{
+			this->Deliver(MsgCompression::Encode(msg), views);
+		}
+
+		// every session of a SessionTable snapshot
+		void Deliver(const PayloadPtr& payload, const SessionTable::SnapshotList& views)
+		{
+			Batches batches;
+			for (const auto& view : views)
+			{
+				for (const auto& obj : *view)
+				{
+					this->add(batches, obj, payload);
+				}
+			}
+			this->dispatch(batches, payload);
+		}
+
+		// any range of NetObjectPtr
+		template <typename ObjRange>
+		void DeliverTo(const PayloadPtr& payload, const ObjRange& objs)
+		{
+			Batches batches;
+			for (const auto& obj : objs)
+			{
+				this->add(batches, obj, payload);
+			}
+			this->dispatch(batches, payload);
+		}
+
+		// queue payload on one session, applying the slow consumer policy
+		static void Send(const NetObjectPtr& obj, const PayloadPtr& payload, const BroadcastOptions& options)
+		{
+			if (options.max_pending_bytes > 0 && obj->PendingBytes() > options.max_pending_bytes)
+			{
+				switch (options.policy)
+				{
+				case SlowConsumerPolicy::Skip:
+					return;
+				case SlowConsumerPolicy::DropOldest:
+					obj->DropPending(options.max_pending_bytes);
+					break;
+				case SlowConsumerPolicy::Disconnect:
+					obj->Close();
+					return;
+				}
+			}
+			obj->PostShared(payload);
+		}
+
+	private:
+		struct Batch
+		{
+			asio::io_context* context;
+			std::vector<NetObjectPtr> objs;
+		};
+		typedef std::vector<Batch> Batches;
+
+		// I/O threads are few, a linear scan beats hashing here
+		void add(Batches& batches, const NetObjectPtr& obj, const PayloadPtr& payload)
+		{
+			if (!obj)
+				return;
+			asio::io_context* context = obj->Context();
+			if (!context)
+			{
+				Send(obj, payload, this->options_);
+				return;
+			}
+			for (auto& batch : batches)
+			{
+				if (batch.context == context)
+				{
+					batch.objs.push_back(obj);
+					return;
+				}
+			}
+			batches.push_back(Batch{ context, { obj } });
+		}
+
+		void dispatch(Batches& batches, const PayloadPtr& payload)
+		{
+			for (auto& batch : batches)
+			{
+				asio::post(*batch.context,
+					[objs = std::move(batch.objs), payload, options = this->options_]()
+					{
+						for (const auto& obj : objs)
+						{
+							Send(obj, payload, options);
+						}
+					});
+			}
+		}
+
+	private:
+		BroadcastOptions options_;
+	};
+
+}
+
+#endif // __BROADCAST_HPP__
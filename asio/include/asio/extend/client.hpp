@@ -1,5 +1,6 @@
 #ifndef __TCP_CLIENT_HPP__
 #define __TCP_CLIENT_HPP__
+#include <atomic>
 #include <deque>
 #include <mutex>
 #include <asio.hpp>
@@ -7,6 +8,14 @@
 #include <asio/msgdef/state.hpp>
 #include <asio/extend/object.hpp>
 #include <asio/extend/typedef.hpp>
+#include <asio/extend/write_queue.hpp>
+#include <asio/extend/compress.hpp>
+#include <asio/extend/write_waiters.hpp>
+#include <asio/extend/frame_reader.hpp>
+#include <asio/extend/metrics.hpp>
+#include <asio/extend/reconnect.hpp>
+#include <asio/extend/rpc.hpp>
+#include <asio/extend/submit_queue.hpp>
 #include <asio/extend/worker.hpp>
 
 namespace asio {
@@ -23,18 +32,22 @@ namespace asio {
         TcpClient(asio::io_context& io_context, NetEvent* event, const std::string &ip, const std::string &port) noexcept
             : io_context_(io_context)
             , socket_(io_context)
+            , resolver_(io_context)
+            , retry_timer_(io_context)
+            , connect_timer_(io_context)
+            , rpc_(io_context.get_executor())
             , auto_reconnect_(false)
             , connect_state_(ConnectState::ST_STOPPED)
             , net_event_(event)
         {
             this->SetConnect(false);
             this->connect_state_ = ConnectState::ST_STARTING;
-            tcp::resolver resolver(io_context);
-            auto endpoints = resolver.resolve(ip, port);
-            this->endpoints_ = endpoints;
+            // an unresolved host fails the first connect, the retries resolve again
+            std::error_code ec;
+            this->endpoints_ = this->resolver_.resolve(ip, port, ec);
             this->host_ = ip;
             this->port_ = port;
-            this->do_connect(endpoints);
+            this->do_connect(this->endpoints_);
         }
 
         virtual ~TcpClient()
@@ -52,6 +65,91 @@ namespace asio {
             this->write(msg);
         }
 
+        // shared payload, queued by reference
+        void PostShared(const PayloadPtr& payload) override
+        {
+            this->write(payload);
+        }
+
+        // shared payload with a priority for BackpressurePolicy::Drop
+        void PostPriority(const PayloadPtr& payload, uint8 priority) override
+        {
+            this->write(payload, priority);
+        }
+
+        void SetWatermarks(const WatermarkOptions& options) override
+        {
+            asio::post(io_context_, [this, options]()
+                {
+                    this->write_msgs_.set_watermarks(options);
+                });
+        }
+
+        bool Writable() override
+        {
+            return this->writable_.load(std::memory_order_relaxed);
+        }
+
+        // completes once the output queue is back under its low watermark,
+        // with operation_aborted when the connection drops first
+        template <typename WaitToken>
+        auto AsyncWaitWritable(WaitToken&& token)
+        {
+            return asio::async_initiate<WaitToken, void(std::error_code)>(
+                [this](auto handler)
+                {
+                    asio::post(io_context_, [this, handler = std::move(handler)]() mutable
+                        {
+                            if (this->write_msgs_.writable())
+                            {
+                                asio::post(io_context_, asio::append(std::move(handler), std::error_code()));
+                                return;
+                            }
+                            this->waiters_.add(std::move(handler));
+                        });
+                }, token);
+        }
+
+        // caps for one gathered send
+        void SetWriteLimits(std::size_t maxBytes, std::size_t maxBuffers)
+        {
+            asio::post(io_context_, [this, maxBytes, maxBuffers]()
+                {
+                    this->write_msgs_.set_gather_limits(maxBytes, maxBuffers);
+                });
+        }
+
+        // request / response over this link, completes with
+        // (error_code, Message), see RpcChannel::async_call
+        template <typename CallToken>
+        auto AsyncCall(const Message& request, std::chrono::milliseconds timeout, CallToken&& token)
+        {
+            return this->rpc_.async_call(request, timeout,
+                [this](const Message& frame)
+                {
+                    if (!this->IsConnect())
+                    {
+                        return false;
+                    }
+                    this->write(frame);
+                    return true;
+                }, std::forward<CallToken>(token));
+        }
+
+        // answers a request the server sent, Rpc::IsRequest(request)
+        void Reply(const Message& request, const Message& response)
+        {
+            Message frame;
+            Rpc::Frame(response, Rpc::eResponse, Rpc::CallId(request), frame);
+            this->write(frame);
+        }
+
+        // calls in flight at once, before the first AsyncCall
+        void SetRpcCapacity(uint32 capacity)
+        {
+            this->rpc_.set_capacity(capacity);
+        }
+
         // warning error 10009 scope NetObject and socket
         std::string Ip()   override
         {
@@ -73,6 +171,22 @@ namespace asio {
         {
             this->auto_reconnect_ = bAutoReconnect;
         }
+
+        // framing to offer the server on every connect, see FramingHandshake;
+        // set it before the io_context runs
+        void SetFraming(Framing framing)
+        {
+            this->framing_ = framing;
+        }
+
+        // backoff and connect timeout, applies from the next attempt on
+        void SetReconnectOptions(const ReconnectOptions& options)
+        {
+            asio::post(io_context_, [this, options]()
+                {
+                    this->backoff_.set_options(options);
+                });
+        }
     public:
 		void Close() override
 		{
@@ -80,7 +194,10 @@ namespace asio {
             this->connect_state_ = ConnectState::ST_STOPPING;
             asio::post(io_context_, [this]() 
                 {
+                    this->cancel_timers();
                     this->socket_.close();
+                    this->rpc_.cancel(asio::error::operation_aborted);
+                    this->SetConnect(false);
                     this->connect_state_ = ConnectState::ST_STOPPED;
                 });
 		}
@@ -95,29 +212,79 @@ namespace asio {
 	private:
         void clear()
         {
-            std::lock_guard lock(this->mutex_);
+            this->submit_.drain([](PayloadSlice&&) {});
+            WriteWaitList::complete(this->waiters_.take(), io_context_.get_executor(), asio::error::operation_aborted);
             this->write_msgs_.clear();
+            this->writable_ = true;
+        }
+        void write(const Message& msg)
+        {
+            this->write(MsgCompression::Encode(msg));
         }
-        void write(const Message& msg) // async write keep sequence with lock
+        // any thread; only the send that finds submit_ empty posts a flush
+        void write(const PayloadPtr& payload, uint8 priority = 0)
         {
-            std::lock_guard lock(this->mutex_);
             if (!this->IsConnect()) {
                 return;
             }
-            asio::post(io_context_,
-                [this, msg]() {
-                bool write_in_progress = !write_msgs_.empty();
-                this->write_msgs_.push_back(msg);
-                // cache msg
-                if (!this->IsMsgQueueRunning())
-                {
-                    return;
-                }
-                if (!write_in_progress && this->IsConnect())
+            if (this->submit_.push(PayloadSlice(payload, priority)))
+            {
+                asio::post(io_context_, [this]() { this->flush(); });
+            }
+        }
+
+        // runs on the I/O thread, moves every submitted slice into write_msgs_
+        void flush()
+        {
+            if (!this->IsConnect())
+            {
+                // sent while the link went down, reset() drops the rest
+                this->submit_.drain([](PayloadSlice&&) {});
+                return;
+            }
+            bool write_in_progress = !write_msgs_.empty();
+            bool close = false;
+            const std::size_t count = this->submit_.drain([this, &close](PayloadSlice&& slice)
                 {
-                    this->do_write();
-                }
+                    if (!close && this->write_msgs_.offer(std::move(slice)) == Admission::Close)
+                    {
+                        close = true;
+                    }
                 });
+            if (close)
+            {
+                // the read side reports the close and resets the link
+                this->socket_.close();
+                return;
+            }
+            Metrics::Add(Metric::MsgsOut, count);
+            Metrics::Record(Histogram::WriteQueueBytes, this->write_msgs_.bytes());
+            this->notify(this->write_msgs_.watermark());
+            // cache msg
+            if (!this->IsMsgQueueRunning())
+            {
+                return;
+            }
+            if (!write_in_progress && !write_msgs_.empty())
+            {
+                this->do_write();
+            }
+        }
+
+        // runs on the I/O thread
+        void notify(Watermark mark)
+        {
+            if (mark == Watermark::High)
+            {
+                this->writable_ = false;
+                this->net_event_->HighWatermark(this->shared_from_this());
+            }
+            else if (mark == Watermark::Low)
+            {
+                this->writable_ = true;
+                WriteWaitList::complete(this->waiters_.take(), io_context_.get_executor(), std::error_code());
+                this->net_event_->LowWatermark(this->shared_from_this());
+            }
         }
 
 		void disconnect()
@@ -125,6 +292,7 @@ namespace asio {
             this->SetAutoReconnect(false);
 			this->connect_state_ = ConnectState::ST_STOPPING;
 			asio::post(io_context_, [this]() {
+                this->cancel_timers();
 				this->socket_.close();
 			    this->io_context_.stop();
 			    this->clear();
@@ -144,6 +312,7 @@ namespace asio {
             asio::post(io_context_, [this]() {
                 this->socket_.close();
                 this->clear();
+                this->rpc_.cancel();
                 this->SetConnect(false);
                 this->connect_state_ = ConnectState::ST_STOPPED;
                 this->reconnect();
@@ -151,35 +320,88 @@ namespace asio {
         }
 
     public:
+        // Schedules the next attempt after the backoff delay, runs on the I/O
+        // thread and never blocks it. A read and a write failing together
+        // schedule one attempt.
         void reconnect()
         {
-            if (!auto_reconnect_)
+            if (!auto_reconnect_ || this->reconnecting_)
             {
                 return;
             }
-            std::cout << this->GetConnectName() <<":"<<"reconnecting" << std::endl;
-            std::this_thread::sleep_for(std::chrono::seconds(10));
-            if (!this->IsConnect())
-            {
-                this->net_event_->Reconnect(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
-                this->do_connect(endpoints_);
-            }
+            this->reconnecting_ = true;
+            const std::chrono::milliseconds delay = this->backoff_.next();
+            std::cout << this->GetConnectName() << ":" << "reconnecting in " << delay.count() << "ms" << std::endl;
+            this->retry_timer_.expires_after(delay);
+            this->retry_timer_.async_wait([this](std::error_code ec)
+                {
+                    this->reconnecting_ = false;
+                    if (ec || !this->auto_reconnect_ || this->IsConnect())
+                    {
+                        return;
+                    }
+                    this->net_event_->Reconnect(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
+                    if (this->endpoints_.empty() || this->backoff_.should_resolve())
+                    {
+                        this->do_resolve();
+                        return;
+                    }
+                    this->do_connect(this->endpoints_);
+                });
         }
     private:
+        // refresh the cached endpoints, the old ones stay when the lookup fails
+        void do_resolve()
+        {
+            this->connect_state_ = ConnectState::ST_STARTING;
+            this->resolver_.async_resolve(this->host_, this->port_,
+                [this](std::error_code ec, tcp::resolver::results_type results)
+                {
+                    if (ec == asio::error::operation_aborted)
+                    {
+                        return;
+                    }
+                    if (!ec && !results.empty())
+                    {
+                        this->endpoints_ = results;
+                    }
+                    this->do_connect(this->endpoints_);
+                });
+        }
+
         void do_connect(const tcp::resolver::results_type& endpoints)
         {
             this->connect_state_ = ConnectState::ST_STARTED;
+            const std::chrono::milliseconds timeout = this->backoff_.options().connect_timeout;
+            if (timeout.count() > 0)
+            {
+                // closing the socket fails the pending connect with operation_aborted
+                this->connect_timer_.expires_after(timeout);
+                this->connect_timer_.async_wait([this](std::error_code ec)
+                    {
+                        if (!ec && this->connect_state_ == ConnectState::ST_CONNECTING)
+                        {
+                            std::cout << this->GetConnectName() << ":" << "connection timed out." << std::endl;
+                            this->socket_.close();
+                        }
+                    });
+            }
             asio::async_connect(socket_, endpoints,
                 [this](std::error_code ec, tcp::endpoint)
                 {
+                    this->connect_timer_.cancel();
                     if (!ec)
                     {
+                        this->backoff_.reset();
                         this->connect_state_ = ConnectState::ST_CONNECTED;
                         this->SetConnect(true);
+                        Metrics::Add(Metric::Connects);
                         std::cout << this->GetConnectName() << ":" << "connection succeeded." << std::endl;
                         this->net_event_->Connect(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
                         this->read_msg_.setNetObject(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
-                        this->do_read_header();
+                        this->reader_.clear();
+                        this->offer_framing();
+                        this->do_read();
                     }
                     else {
                         this->SetConnect(false);
@@ -192,57 +414,106 @@ namespace asio {
             this->connect_state_ = ConnectState::ST_CONNECTING;
         }
 
-        void do_read_header()
+        // read what the socket has and dispatch every complete frame in it
+        void do_read()
         {
-            asio::async_read(socket_,
-                asio::buffer(read_msg_.data(), Message::header_length),
-                [this](std::error_code ec, std::size_t /*length*/)
+            this->socket_.async_read_some(this->reader_.prepare(),
+                [this](std::error_code ec, std::size_t length)
                 {
-                    if (!ec && read_msg_.decode_header())
-                    {
-                        this->do_read_body();
-                    }
-                    else
+                    if (!ec)
                     {
-                        this->net_event_->Error(0);
-                        this->net_event_->Disconnect(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
-                        this->reset();
+                        Metrics::Add(Metric::BytesIn, length);
+                        this->reader_.commit(length);
+                        const bool valid = this->reader_.parse(this->read_msg_,
+                            [this](Message& msg)
+                            {
+                                if (FramingHandshake::Is(msg))
+                                {
+                                    this->handshake(msg);
+                                    return;
+                                }
+                                if (Rpc::IsResponse(msg))
+                                {
+                                    this->rpc_.complete(msg);
+                                    return;
+                                }
+                                Metrics::Add(Metric::MsgsIn);
+                                HandlerTimer timer(((MsgHeader*)msg.data())->msgId);
+                                this->net_event_->HandleMessage(this->shared_from_this(), msg);
+                            });
+                        if (valid)
+                        {
+                            this->do_read();
+                            return;
+                        }
                     }
+                    Metrics::AddReadEnd(ec);
+                    this->net_event_->Error(0);
+                    this->net_event_->Disconnect(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
+                    this->reset();
                 });
         }
 
-        void do_read_body()
+        void cancel_timers()
         {
-            asio::async_read(socket_,
-                asio::buffer(read_msg_.body(), read_msg_.body_length()),
-                [this](std::error_code ec, std::size_t /*length*/)
-                {
-                    if (!ec)
-                    {
-                        this->net_event_->HandleMessage(this->shared_from_this(), read_msg_);
-                        this->do_read_header();
-                    }
-                    else
-                    {
-                        this->net_event_->Error(0);
-                        this->net_event_->Disconnect(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
-                        this->reset();
-                    }
-                });
+            this->retry_timer_.cancel();
+            this->connect_timer_.cancel();
+            this->resolver_.cancel();
+        }
+
+        // a new connection starts standard, then asks for framing_
+        void offer_framing()
+        {
+            this->reader_.set_framing(Framing::Standard);
+            this->write_msgs_.set_framing(Framing::Standard);
+            if (this->framing_ != Framing::Standard)
+            {
+                this->write_control(FramingHandshake::Make(FramingHandshake::eOffer, this->framing_));
+            }
         }
 
+        // the server answered the offer, called from parse()
+        void handshake(const Message& msg)
+        {
+            FramingHandshake::Op op;
+            Framing framing;
+            if (!FramingHandshake::Parse(msg, op, framing) || op != FramingHandshake::eAccept)
+            {
+                return;
+            }
+            // the server writes the answered framing from here on
+            this->reader_.set_framing(framing);
+            if (framing != Framing::Standard)
+            {
+                // and so do we once the switch is queued
+                this->write_control(FramingHandshake::Make(FramingHandshake::eSwitch, framing));
+                this->write_msgs_.set_framing(framing);
+            }
+        }
+
+        // queue a handshake frame ahead of anything posted later
+        void write_control(const PayloadPtr& payload)
+        {
+            bool write_in_progress = !write_msgs_.empty();
+            this->write_msgs_.push(payload);
+            if (!write_in_progress && this->IsMsgQueueRunning())
+            {
+                this->do_write();
+            }
+        }
+
+        // one gathered send for as much of the queue as the limits allow
         void do_write()
         {
-            asio::async_write(socket_,
-                asio::buffer(write_msgs_.front().data(),
-                    write_msgs_.front().length()),
-                [this](std::error_code ec, std::size_t /*length*/)
+            this->socket_.async_write_some(this->write_msgs_.gather(),
+                [this](std::error_code ec, std::size_t length)
                 {
                     if (!ec)
                     {
-                        if (!write_msgs_.empty()) {
-                            this->write_msgs_.pop_front();
-                        }
+                        Metrics::Add(Metric::BytesOut, length);
+                        Metrics::Record(Histogram::WriteBytes, length);
+                        this->write_msgs_.consume(length);
+                        this->notify(this->write_msgs_.watermark());
 
                         if (!write_msgs_.empty()) {
                             this->do_write();
@@ -250,6 +521,7 @@ namespace asio {
                     }
                     else
                     {
+                        Metrics::Add(Metric::DisconnectWrite);
                         this->net_event_->Error(0);
                         this->net_event_->Disconnect(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
                         this->reset();
@@ -260,12 +532,22 @@ namespace asio {
     private:
         asio::io_context& io_context_;
         tcp::socket socket_;
+        tcp::resolver resolver_;
+        asio::steady_timer retry_timer_;
+        asio::steady_timer connect_timer_;
+        ReconnectBackoff backoff_;
+        bool reconnecting_ = { false };
+        RpcChannel rpc_;
         Message read_msg_;
-        MessageQueue write_msgs_;
+        FrameReader reader_;
+        SubmitQueue submit_;
+        WriteQueue write_msgs_;
+        WriteWaitList waiters_;
+        std::atomic<bool> writable_ = { true };
+        Framing framing_ = { Framing::Standard };
         tcp::resolver::results_type endpoints_;
         bool auto_reconnect_;
         ConnectState connect_state_;
-		std::mutex mutex_;
         NetEvent* net_event_;
         std::string host_;
         std::string port_;
@@ -295,6 +577,11 @@ namespace asio {
             this->host_ = host;
             this->port_ = port;
         }
+        // framing offered to the server, Framing::Compact for mobile links
+        void SetFraming(Framing framing)
+        {
+            this->framing_ = framing;
+        }
     public:
         void Post(const asio::Message& msg) override
         {
@@ -359,6 +646,7 @@ namespace asio {
                 this->tc_ = tc;
                 tc->SetConnectName(this->name_);
                 tc->SetAutoReconnect(false);
+                tc->SetFraming(this->framing_);
                 io_context.run();
                 this->tc_ = nullptr;
                 std::this_thread::sleep_for(std::chrono::seconds(2));
@@ -366,6 +654,7 @@ namespace asio {
         }
     private:
         bool auto_reconnect_ = { false };
+        Framing framing_ = { Framing::Standard };
         TcpClientPtr tc_;
         std::string name_;
         std::string host_;
@@ -10,25 +10,60 @@
 #include <asio/msgdef/state.hpp>
 #include <asio/extend/object.hpp>
 #include <asio/extend/typedef.hpp>
+#include <asio/extend/write_queue.hpp>
+#include <asio/extend/compress.hpp>
+#include <asio/extend/frame_reader.hpp>
+#include <asio/extend/random.hpp>
+#include <asio/extend/reconnect.hpp>
+#include <asio/extend/submit_queue.hpp>
 
 namespace asio {
 
 	using asio::ip::tcp;
-	class NetClientEvent;
+	//--------------------------------------------------------------
+	// NetClientEvent
+	class NetClientEvent
+	{
+	public:
+		NetClientEvent() = default;
+		virtual ~NetClientEvent() {}
+		virtual void Connect(NetObject* pNetObj)    = 0;
+		virtual void Disconnect(NetObject* pNetObj) = 0;
+		virtual void HandleMessage(NetObject* pNetObj, const Message& msg) = 0;
+		virtual void PostMsg(const Message& msg) = 0;
+		virtual void Init() {}
+		virtual void Exit() {}
+	};
+
+	// LinkHealth
+	// Snapshot of one pooled backend link, readable from any thread.
+	struct LinkHealth
+	{
+		bool connected          = { false };
+		int64 outstanding_bytes = { 0 }; // handed to Send() and not written yet
+		uint64 sent             = { 0 }; // messages accepted by Send()
+		uint64 received         = { 0 }; // messages read
+		uint64 failures         = { 0 }; // failed connects and dropped links
+		uint64 reconnects       = { 0 }; // connect attempts after a failure
+		int64 write_latency_us  = { 0 }; // moving average of one gathered send
+	};
+
 	class NetTcpClient : public Worker, public NetObject
 	{
 	public:
 		explicit NetTcpClient(NetClientEvent* event, const std::string& address, const int port) ASIO_NOEXCEPT
 			: Worker(),
 			handle_event_(event),
-			is_connect_(false), is_close_(false), connect_state_(ConnectState::ST_STOPPED), socket_(nullptr)
+			is_connect_(false), is_close_(false), connect_state_(ConnectState::ST_STOPPED), socket_(nullptr),
+			resolver_(io_context_), retry_timer_(io_context_), connect_timer_(io_context_),
+			host_(address), port_(std::to_string(port))
 		{
-			tcp::resolver resolver(io_context_);
-			auto endpoints = resolver.resolve(address, std::to_string(port));
-			this->endpoints_ = endpoints;
+			// an unresolved host fails the first connect, the retries resolve again
+			std::error_code ec;
+			this->endpoints_ = this->resolver_.resolve(this->host_, this->port_, ec);
 			this->connect_state_ = ConnectState::ST_STARTING;
 			this->socket_ = new tcp::socket(this->io_context_);
-			do_connect(endpoints);
+			do_connect(this->endpoints_);
 		}
 		~NetTcpClient()
 		{
@@ -57,9 +92,12 @@ namespace asio {
 			is_close_ = true;
 			this->connect_state_ = ConnectState::ST_STOPPING;
 			asio::post(io_context_, [this]() {
+				this->retry_timer_.cancel();
+				this->connect_timer_.cancel();
+				this->resolver_.cancel();
 				this->socket_->close();
 				this->io_context_.stop();
-				this->write_msgs_.clear();
+				this->clear();
 				this->is_connect_ = false;
 				this->connect_state_ = ConnectState::ST_STOPPED;
 				});
@@ -78,62 +116,164 @@ namespace asio {
 		{
 			this->write(msg);
 		}
-		void Post(const Message& mgs) override
+		void Post(const Message& msg) override
 		{
 			this->write(msg);
 		}
+		// shared payload, queued by reference
+		void PostShared(const PayloadPtr& payload) override
+		{
+			this->write(payload);
+		}
+		// caps for one gathered send
+		void SetWriteLimits(std::size_t maxBytes, std::size_t maxBuffers)
+		{
+			asio::post(io_context_, [this, maxBytes, maxBuffers]()
+				{
+					this->write_msgs_.set_gather_limits(maxBytes, maxBuffers);
+				});
+		}
+		bool Connected() const
+		{
+			return this->is_connect_;
+		}
+		// bytes sent and not written to the socket yet, the pool load
+		int64 Outstanding() const
+		{
+			return this->submitted_bytes_.load(std::memory_order_relaxed)
+				+ this->queued_bytes_.load(std::memory_order_relaxed);
+		}
+		LinkHealth Health() const
+		{
+			LinkHealth health;
+			health.connected = this->is_connect_;
+			health.outstanding_bytes = this->Outstanding();
+			health.sent = this->sent_.load(std::memory_order_relaxed);
+			health.received = this->received_.load(std::memory_order_relaxed);
+			health.failures = this->failures_.load(std::memory_order_relaxed);
+			health.reconnects = this->reconnects_.load(std::memory_order_relaxed);
+			health.write_latency_us = this->write_latency_us_.load(std::memory_order_relaxed);
+			return health;
+		}
+		// backoff and connect timeout, applies from the next attempt on
+		void SetReconnectOptions(const ReconnectOptions& options)
+		{
+			asio::post(io_context_, [this, options]()
+				{
+					this->backoff_.set_options(options);
+				});
+		}
 	protected:
 		void handle_message(NetObject* pObject, const Message& msg) {
 			this->handle_event_->HandleMessage(this, msg);
 		}
 
-		void Run() override
+		void Init() override
+		{
+
+		}
+
+		void Exec() override
 		{
 			this->io_context_.run();
 		}
 
+		void Exit() override
+		{
+
+		}
+
 		void reset()
 		{
 			this->connect_state_ = ConnectState::ST_STOPPING;
 			asio::post(io_context_, [this]() {
 				socket_->close();
 				this->handle_event_->Disconnect(this);
-				this->write_msgs_.clear();
+				this->failures_.fetch_add(1, std::memory_order_relaxed);
+				this->clear();
 				this->is_connect_ = false;
 				this->connect_state_ = ConnectState::ST_STOPPED;
 				this->reconnect();
 				});
 		}
 
+		// next attempt after the backoff delay, on the I/O thread
 		void reconnect()
 		{
-			if (is_close_) {
+			if (is_close_ || this->reconnecting_) {
 				return;
 			}
-			std::this_thread::sleep_for(std::chrono::seconds(1));
-			std::cout << "reconnecting" << std::endl;
-			std::this_thread::sleep_for(std::chrono::seconds(10));
-			if (!this->is_connect_)
-			{
-				do_connect(endpoints_);
-			}
+			this->reconnecting_ = true;
+			const std::chrono::milliseconds delay = this->backoff_.next();
+			std::cout << "reconnecting in " << delay.count() << "ms" << std::endl;
+			this->retry_timer_.expires_after(delay);
+			this->retry_timer_.async_wait([this](std::error_code ec)
+				{
+					this->reconnecting_ = false;
+					if (ec || is_close_ || this->is_connect_)
+					{
+						return;
+					}
+					this->reconnects_.fetch_add(1, std::memory_order_relaxed);
+					if (this->endpoints_.empty() || this->backoff_.should_resolve())
+					{
+						do_resolve();
+						return;
+					}
+					do_connect(endpoints_);
+				});
+		}
+
+		// refresh the cached endpoints, the old ones stay when the lookup fails
+		void do_resolve()
+		{
+			this->connect_state_ = ConnectState::ST_STARTING;
+			this->resolver_.async_resolve(this->host_, this->port_,
+				[this](std::error_code ec, tcp::resolver::results_type results)
+				{
+					if (ec == asio::error::operation_aborted)
+					{
+						return;
+					}
+					if (!ec && !results.empty())
+					{
+						this->endpoints_ = results;
+					}
+					do_connect(this->endpoints_);
+				});
 		}
 
 		void do_connect(const tcp::resolver::results_type& endpoints)
 		{
 			this->connect_state_ = ConnectState::ST_STARTED;
+			const std::chrono::milliseconds timeout = this->backoff_.options().connect_timeout;
+			if (timeout.count() > 0)
+			{
+				this->connect_timer_.expires_after(timeout);
+				this->connect_timer_.async_wait([this](std::error_code ec)
+					{
+						if (!ec && this->connect_state_ == ConnectState::ST_CONNECTING)
+						{
+							std::cout << "connection timed out." << std::endl;
+							socket_->close();
+						}
+					});
+			}
 			asio::async_connect(*socket_, endpoints,
 				[this](std::error_code ec, tcp::endpoint)
 				{
 					static std::mutex mtx;
 					std::lock_guard lock(mtx);
+					this->connect_timer_.cancel();
 					if (!ec)
 					{
+						this->backoff_.reset();
 						this->connect_state_ = ConnectState::ST_CONNECTED;
 						this->is_connect_ = true;
 						std::cout << "connection succeeded. " << socket_->native_handle() << std::endl;
 						this->handle_event_->Connect(this);
-						do_read_header();
+						reader_.clear();
+						do_read();
 					}
 					else {
 						is_connect_ = false;
@@ -144,54 +284,47 @@ namespace asio {
 			this->connect_state_ = ConnectState::ST_CONNECTING;
 		}
 
-		void do_read_header()
+		// read what the socket has and dispatch every complete frame in it
+		void do_read()
 		{
-			asio::async_read(*socket_,
-				asio::buffer(read_msg_.data(), Message::header_length),
-				[this](std::error_code ec, std::size_t /*length*/)
-				{
-					if (!ec && read_msg_.decode_header())
-					{
-						do_read_body();
-					}
-					else
-					{
-						this->reset();
-					}
-				});
-		}
-
-		void do_read_body()
-		{
-			asio::async_read(*socket_,
-				asio::buffer(read_msg_.body(), read_msg_.body_length()),
-				[this](std::error_code ec, std::size_t /*length*/)
+			socket_->async_read_some(reader_.prepare(),
+				[this](std::error_code ec, std::size_t length)
 				{
 					if (!ec)
 					{
-						this->handle_message(this, read_msg_);
-						do_read_header();
-					}
-					else
-					{
-						this->reset();
+						reader_.commit(length);
+						const bool valid = reader_.parse(read_msg_,
+							[this](Message& msg)
+							{
+								this->received_.fetch_add(1, std::memory_order_relaxed);
+								this->handle_message(this, msg);
+							});
+						if (valid)
+						{
+							do_read();
+							return;
+						}
 					}
+					this->reset();
 				});
 		}
 
+		// one gathered send for as much of the queue as the limits allow
 		void do_write()
 		{
-			asio::async_write(*socket_,
-				asio::buffer(write_msgs_.front().data(),
-					write_msgs_.front().length()),
-				[this](std::error_code ec, std::size_t /*length*/)
+			this->write_start_ = std::chrono::steady_clock::now();
+			socket_->async_write_some(write_msgs_.gather(),
+				[this](std::error_code ec, std::size_t length)
 				{
 					if (!ec)
 					{
-						if (!write_msgs_.empty())
-						{
-							write_msgs_.pop_front();
-						}
+						write_msgs_.consume(length);
+						this->queued_bytes_.store(static_cast<int64>(write_msgs_.bytes()), std::memory_order_relaxed);
+						// 1/8 weight for the newest sample
+						const int64 sample = std::chrono::duration_cast<std::chrono::microseconds>(
+							std::chrono::steady_clock::now() - this->write_start_).count();
+						const int64 average = this->write_latency_us_.load(std::memory_order_relaxed);
+						this->write_latency_us_.store(average + (sample - average) / 8, std::memory_order_relaxed);
 
 						if (!write_msgs_.empty())
 						{
@@ -207,41 +340,99 @@ namespace asio {
 
 		void clear()
 		{
-			std::lock_guard lock(this->mutex_);
+			this->submit_.drain([this](PayloadSlice&& slice)
+				{
+					this->submitted_bytes_.fetch_sub(slice.length(), std::memory_order_relaxed);
+				});
 			this->write_msgs_.clear();
+			this->queued_bytes_.store(0, std::memory_order_relaxed);
 		}
 
 		void write(const Message& msg)
 		{
-			std::lock_guard lock(this->mutex_);
+			this->write(MsgCompression::Encode(msg));
+		}
+
+		// any thread; only the send that finds submit_ empty posts a flush
+		void write(const PayloadPtr& payload)
+		{
 			if (!this->is_connect_) {
 				return;
 			}
-			asio::post(io_context_,
-				[this, msg]()
+			this->sent_.fetch_add(1, std::memory_order_relaxed);
+			this->submitted_bytes_.fetch_add(payload->length(), std::memory_order_relaxed);
+			if (this->submit_.push(PayloadSlice(payload)))
+			{
+				asio::post(io_context_, [this]() { this->flush(); });
+			}
+		}
+
+		// runs on the I/O thread, moves every submitted slice into write_msgs_
+		void flush()
+		{
+			if (!is_connect_)
+			{
+				// sent while the link went down, reset() drops the rest
+				this->clear();
+				return;
+			}
+			bool write_in_progress = !write_msgs_.empty();
+			this->submit_.drain([this](PayloadSlice&& slice)
 				{
-					bool write_in_progress = !write_msgs_.empty();
-					this->write_msgs_.push_back(msg);
-					if (!write_in_progress && is_connect_)
-					{
-						this->do_write();
-					}
+					this->submitted_bytes_.fetch_sub(slice.length(), std::memory_order_relaxed);
+					this->write_msgs_.push(std::move(slice));
 				});
+			this->queued_bytes_.store(static_cast<int64>(write_msgs_.bytes()), std::memory_order_relaxed);
+			if (!write_in_progress && !write_msgs_.empty())
+			{
+				this->do_write();
+			}
 		}
 	private:
 		asio::io_context io_context_;
 		tcp::socket* socket_;
 		Message read_msg_;
-		MessageQueue write_msgs_;
+		FrameReader reader_;
+		SubmitQueue submit_;
+		WriteQueue write_msgs_;
 		tcp::resolver::results_type endpoints_;
 		std::atomic<bool> is_connect_;
 		std::atomic<bool> is_close_;
 		ConnectState connect_state_;
 		NetClientEvent* handle_event_;
-		std::mutex mutex_;
+		tcp::resolver resolver_;
+		asio::steady_timer retry_timer_;
+		asio::steady_timer connect_timer_;
+		ReconnectBackoff backoff_;
+		bool reconnecting_ = { false };
+		std::string host_;
+		std::string port_;
+		// health, written on the I/O thread or by Send()
+		std::atomic<int64> submitted_bytes_ = { 0 };
+		std::atomic<int64> queued_bytes_ = { 0 };
+		std::atomic<uint64> sent_ = { 0 };
+		std::atomic<uint64> received_ = { 0 };
+		std::atomic<uint64> failures_ = { 0 };
+		std::atomic<uint64> reconnects_ = { 0 };
+		std::atomic<int64> write_latency_us_ = { 0 };
+		std::chrono::steady_clock::time_point write_start_;
 	};
 
 
+	// how NetClientWorkGroup picks a link for a message
+	enum class LinkSelect : uint8
+	{
+		PowerOfTwo,       // the less loaded of two random links
+		LeastOutstanding, // the least loaded of all links
+		Random,           // any connected link
+	};
+
+	// NetClientWorkGroup
+	// Pool of backend links. PostMsg() only picks connected links and weighs
+	// them by Outstanding(), the bytes each has not written yet. In sticky
+	// mode a message with a session id always takes the same link while it
+	// is up; when it is down its sessions move to the next connected link
+	// and only theirs do. Randomness comes from FastRandom, per thread.
 	class NetClientWorkGroup : public NetClientEvent
 	{
 	public:
@@ -279,15 +470,109 @@ namespace asio {
 			return nullptr;
 		}
 
+		// call before Startup()
+		void SetSelect(LinkSelect select)
+		{
+			this->select_ = select;
+		}
+
+		// route messages with a MsgHeader::sId by session, call before Startup()
+		void SetSticky(bool bSticky)
+		{
+			this->sticky_ = bSticky;
+		}
+
+		// link for the next message, null when none is connected
+		NetTcpClient* Select(const uint64 sessionId = 0)
+		{
+			const uint32 count = static_cast<uint32>(net_clients_.size());
+			if (count == 0)
+			{
+				return nullptr;
+			}
+			if (this->sticky_ && sessionId != 0)
+			{
+				// Fibonacci hashing spreads sequential ids
+				return this->connected_from(static_cast<uint32>(((sessionId * 0x9E3779B97F4A7C15ull) >> 32) % count));
+			}
+			switch (this->select_)
+			{
+			case LinkSelect::PowerOfTwo:
+			{
+				if (count == 1)
+				{
+					return this->connected_from(0);
+				}
+				const uint32 first = FastRandom::below(count);
+				uint32 second = FastRandom::below(count - 1);
+				if (second >= first)
+				{
+					++second;
+				}
+				NetTcpClient* a = net_clients_[first];
+				NetTcpClient* b = net_clients_[second];
+				if (a->Connected() && b->Connected())
+				{
+					return b->Outstanding() < a->Outstanding() ? b : a;
+				}
+				if (a->Connected())
+				{
+					return a;
+				}
+				if (b->Connected())
+				{
+					return b;
+				}
+				return this->connected_from(first);
+			}
+			case LinkSelect::LeastOutstanding:
+			{
+				// random start so ties do not all land on the first link
+				const uint32 start = FastRandom::below(count);
+				NetTcpClient* best = nullptr;
+				int64 least = 0;
+				for (uint32 i = 0; i < count; ++i)
+				{
+					NetTcpClient* client = net_clients_[(start + i) % count];
+					if (!client->Connected())
+					{
+						continue;
+					}
+					const int64 outstanding = client->Outstanding();
+					if (!best || outstanding < least)
+					{
+						best = client;
+						least = outstanding;
+					}
+				}
+				return best;
+			}
+			default:
+				return this->connected_from(FastRandom::below(count));
+			}
+		}
+
 		void PostMsg(const Message& msg) override
 		{
-			NetTcpClient* pClient = net_clients_[std::rand() % net_clients_.size()];
+			const MsgHeader* header = reinterpret_cast<const MsgHeader*>(msg.data());
+			NetTcpClient* pClient = this->Select(header->sId);
 			if (pClient)
 			{
 				pClient->Send(msg);
 			}
 		}
 
+		// one entry per link, in Startup() order
+		std::vector<LinkHealth> Health() const
+		{
+			std::vector<LinkHealth> health;
+			health.reserve(net_clients_.size());
+			for (const auto it : net_clients_) {
+				health.push_back(it->Health());
+			}
+			return health;
+		}
+
 		void Init() override
 		{
 
@@ -301,8 +586,25 @@ namespace asio {
 	private:
 		NetClientWorkGroup(const NetClientWorkGroup&) = delete;
 		NetClientWorkGroup operator = (const NetClientWorkGroup&) = delete;
+
+		// first connected link at or after index
+		NetTcpClient* connected_from(uint32 index) const
+		{
+			const std::size_t count = net_clients_.size();
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				NetTcpClient* client = net_clients_[(index + i) % count];
+				if (client->Connected())
+				{
+					return client;
+				}
+			}
+			return nullptr;
+		}
 	private:
 		std::vector<NetTcpClient*> net_clients_;
+		LinkSelect select_ = { LinkSelect::PowerOfTwo };
+		bool sticky_ = { false };
 	};
 
 	using NetClientGroup = NetClientWorkGroup;
@@ -0,0 +1,203 @@
+//
+// co_session.hpp
+// coroutine sessions: co_await read_message() / write()
+//
+
+#ifndef __CO_SESSION_HPP__
+#define __CO_SESSION_HPP__
+#include <asio/detail/config.hpp>
+
+#if defined(ASIO_HAS_CO_AWAIT)
+#include <cstddef>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <asio/awaitable.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/connect.hpp>
+#include <asio/detached.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/redirect_error.hpp>
+#include <asio/use_awaitable.hpp>
+#include <asio/extend/compress.hpp>
+#include <asio/extend/frame_reader.hpp>
+#include <asio/extend/write_queue.hpp>
+#include <asio/msgdef/message.hpp>
+#include <asio/msgdef/payload.hpp>
+
+namespace asio {
+
+	using asio::ip::tcp;
+
+	// CoSession
+	// One connection driven by a coroutine instead of a callback chain. The
+	// session is a plain object in the coroutine frame, Run() and Accept()
+	// spawn that coroutine, so nothing on the hot path copies a shared_ptr
+	// or casts: each step is one co_await on the socket. Coroutine frames
+	// come from asio's per thread recycling allocator (awaitable_frame_tag),
+	// so a steady read / write loop does not touch the heap either.
+	// Frames go through the same FrameReader and WriteQueue as TcpSession,
+	// with FrameCrc and MsgCompression applied the same way. Errors,
+	// end of stream included, are thrown as std::system_error.
+	// A session is used from the coroutines of its executor only.
+	class CoSession
+	{
+	public:
+		explicit CoSession(tcp::socket socket)
+			: socket_(std::move(socket))
+		{
+		}
+
+		explicit CoSession(const tcp::socket::executor_type& ex)
+			: socket_(ex)
+		{
+		}
+
+		CoSession(const CoSession&) = delete;
+		CoSession& operator=(const CoSession&) = delete;
+
+		// Runs handler(CoSession&) -> awaitable<void> on its own coroutine
+		// that owns the session until handler returns or throws.
+		template <typename Handler>
+		static void Run(tcp::socket socket, Handler handler)
+		{
+			auto ex = socket.get_executor();
+			asio::co_spawn(ex,
+				[socket = std::move(socket), handler = std::move(handler)]() mutable -> asio::awaitable<void>
+				{
+					CoSession session(std::move(socket));
+					try
+					{
+						co_await handler(session);
+					}
+					catch (const std::system_error&)
+					{
+						// the peer went away, the session closes below
+					}
+					session.Close();
+				}, asio::detached);
+		}
+
+		// Accepts until the acceptor is closed or cancelled, one Run() per
+		// connection. A failed accept, a peer that reset early or a process
+		// out of descriptors, is skipped like in TcpSocketServer.
+		template <typename Handler>
+		static asio::awaitable<void> Accept(tcp::acceptor& acceptor, Handler handler)
+		{
+			for (;;)
+			{
+				std::error_code ec;
+				tcp::socket socket = co_await acceptor.async_accept(asio::redirect_error(asio::use_awaitable, ec));
+				if (!ec)
+				{
+					// no_delay is a latency hint, the session works without it
+					socket.set_option(tcp::no_delay(true), ec);
+					Run(std::move(socket), handler);
+				}
+				else if (ec == asio::error::operation_aborted || !acceptor.is_open())
+				{
+					co_return;
+				}
+			}
+		}
+
+		asio::awaitable<void> connect(const std::string& host, const std::string& port)
+		{
+			tcp::resolver resolver(this->socket_.get_executor());
+			auto endpoints = co_await resolver.async_resolve(host, port, asio::use_awaitable);
+			co_await asio::async_connect(this->socket_, endpoints, asio::use_awaitable);
+			std::error_code ec;
+			this->socket_.set_option(tcp::no_delay(true), ec);
+		}
+
+		// next frame, the body block moves to the caller
+		asio::awaitable<Message> read_message()
+		{
+			Message msg;
+			co_await this->read_message(msg);
+			co_return msg;
+		}
+
+		// next frame into msg, reusing its block
+		asio::awaitable<void> read_message(Message& msg)
+		{
+			for (;;)
+			{
+				const int result = this->reader_.next(msg);
+				if (result > 0)
+				{
+					co_return;
+				}
+				if (result < 0)
+				{
+					throw std::system_error(std::make_error_code(std::errc::bad_message));
+				}
+				const std::size_t length = co_await this->socket_.async_read_some(this->reader_.prepare(), asio::use_awaitable);
+				this->reader_.commit(length);
+			}
+		}
+
+		// Resumes once msg is on the socket, or queued behind a write another
+		// coroutine of this session has in progress; that one sends it along
+		// in the same gathered write.
+		asio::awaitable<void> write(const Message& msg)
+		{
+			// encoded now, msg need not outlive the co_await
+			return this->write(MsgCompression::Encode(msg));
+		}
+
+		asio::awaitable<void> write(PayloadPtr payload)
+		{
+			this->write_msgs_.push(std::move(payload));
+			if (this->writing_)
+			{
+				co_return;
+			}
+			this->writing_ = true;
+			try
+			{
+				while (!this->write_msgs_.empty())
+				{
+					const std::size_t length = co_await this->socket_.async_write_some(this->write_msgs_.gather(), asio::use_awaitable);
+					this->write_msgs_.consume(length);
+				}
+			}
+			catch (...)
+			{
+				this->writing_ = false;
+				this->write_msgs_.clear();
+				throw;
+			}
+			this->writing_ = false;
+		}
+
+		void Close()
+		{
+			std::error_code ec;
+			this->socket_.shutdown(tcp::socket::shutdown_both, ec);
+			this->socket_.close(ec);
+		}
+
+		tcp::socket& Socket()
+		{
+			return this->socket_;
+		}
+
+		// caps for one gathered send
+		void SetWriteLimits(std::size_t maxBytes, std::size_t maxBuffers)
+		{
+			this->write_msgs_.set_gather_limits(maxBytes, maxBuffers);
+		}
+
+	private:
+		tcp::socket socket_;
+		FrameReader reader_;
+		WriteQueue write_msgs_;
+		bool writing_ = { false };
+	};
+
+}
+
+#endif // defined(ASIO_HAS_CO_AWAIT)
+
+#endif // __CO_SESSION_HPP__
@@ -0,0 +1,423 @@
+//
+// compress.hpp
+// per message body compression flagged in MsgHeader::crypto
+//
+
+#ifndef __COMPRESS_HPP__
+#define __COMPRESS_HPP__
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <asio/extend/base.hpp>
+#include <asio/extend/frame_crc.hpp>
+#include <asio/msgdef/message.hpp>
+#include <asio/msgdef/payload.hpp>
+
+namespace asio {
+
+	// MsgCodec
+	// One compression algorithm. Implementations must be stateless or
+	// thread safe, any I/O or worker thread may call them at once.
+	class MsgCodec
+	{
+	public:
+		virtual ~MsgCodec() {}
+		// worst case output size for length input bytes
+		virtual int Bound(int length) const = 0;
+		// bytes written, 0 when the output does not fit in capacity
+		virtual int Compress(const char* src, int length, char* dst, int capacity) const = 0;
+		// bytes written, -1 on corrupt input or when it does not fit
+		virtual int Decompress(const char* src, int length, char* dst, int capacity) const = 0;
+	};
+
+	// LzCodec
+	// Greedy single pass LZ77 written in the LZ4 block format: a token with
+	// literal and match lengths, the literals, a 16 bit offset. A 4096 entry
+	// hash of 4 byte sequences finds matches; runs without matches are
+	// skipped faster and faster so incompressible bodies cost little.
+	class LzCodec : public MsgCodec
+	{
+	public:
+		int Bound(int length) const override
+		{
+			return length + length / 255 + 16;
+		}
+
+		int Compress(const char* src, int length, char* dst, int capacity) const override
+		{
+			const uint8* in = reinterpret_cast<const uint8*>(src);
+			uint8* out = reinterpret_cast<uint8*>(dst);
+			uint8* const out_end = out + capacity;
+			int anchor = 0;
+			if (length >= mf_limit + 1)
+			{
+				uint32 table[1 << hash_log];
+				std::memset(table, 0, sizeof(table));
+				const int limit = length - mf_limit;
+				const int match_limit = length - last_literals;
+				int ip = 1;
+				unsigned attempts = 1 << skip_trigger;
+				while (ip < limit)
+				{
+					const uint32 sequence = read32(in + ip);
+					const uint32 hash = (sequence * 2654435761u) >> (32 - hash_log);
+					// positions are stored + 1, 0 means empty
+					const int candidate = static_cast<int>(table[hash]) - 1;
+					table[hash] = static_cast<uint32>(ip + 1);
+					if (candidate < 0 || ip - candidate > max_offset || read32(in + candidate) != sequence)
+					{
+						ip += static_cast<int>(attempts++ >> skip_trigger);
+						continue;
+					}
+					attempts = 1 << skip_trigger;
+					int match = candidate;
+					while (ip > anchor && match > 0 && in[ip - 1] == in[match - 1])
+					{
+						--ip;
+						--match;
+					}
+					int match_length = min_match;
+					while (ip + match_length < match_limit && in[match + match_length] == in[ip + match_length])
+					{
+						++match_length;
+					}
+					out = sequence_out(out, out_end, in + anchor, ip - anchor, ip - match, match_length);
+					if (!out)
+						return 0;
+					ip += match_length;
+					anchor = ip;
+				}
+			}
+			out = sequence_out(out, out_end, in + anchor, length - anchor, 0, 0);
+			if (!out)
+				return 0;
+			return static_cast<int>(out - reinterpret_cast<uint8*>(dst));
+		}
+
+		int Decompress(const char* src, int length, char* dst, int capacity) const override
+		{
+			const uint8* in = reinterpret_cast<const uint8*>(src);
+			const uint8* const in_end = in + length;
+			uint8* const out_begin = reinterpret_cast<uint8*>(dst);
+			uint8* out = out_begin;
+			uint8* const out_end = out + capacity;
+			while (in < in_end)
+			{
+				const uint8 token = *in++;
+				std::size_t literals = token >> 4;
+				if (literals == 15 && !read_length(in, in_end, literals))
+					return -1;
+				if (static_cast<std::size_t>(in_end - in) < literals || static_cast<std::size_t>(out_end - out) < literals)
+					return -1;
+				std::memcpy(out, in, literals);
+				in += literals;
+				out += literals;
+				if (in == in_end)
+					break; // the last sequence has no match
+				if (in_end - in < 2)
+					return -1;
+				const std::size_t offset = static_cast<std::size_t>(in[0]) | (static_cast<std::size_t>(in[1]) << 8);
+				in += 2;
+				if (offset == 0 || offset > static_cast<std::size_t>(out - out_begin))
+					return -1;
+				std::size_t match_length = token & 15;
+				if (match_length == 15 && !read_length(in, in_end, match_length))
+					return -1;
+				match_length += min_match;
+				if (static_cast<std::size_t>(out_end - out) < match_length)
+					return -1;
+				const uint8* from = out - offset;
+				if (offset >= match_length)
+				{
+					std::memcpy(out, from, match_length);
+					out += match_length;
+				}
+				else
+				{
+					// overlapping copy repeats the last offset bytes
+					while (match_length--)
+						*out++ = *from++;
+				}
+			}
+			return static_cast<int>(out - out_begin);
+		}
+
+	private:
+		static constexpr int hash_log      = 12;
+		static constexpr int min_match     = 4;
+		static constexpr int last_literals = 5;  // the block ends with literals
+		static constexpr int mf_limit      = 12; // no match starts this close to the end
+		static constexpr int max_offset    = 65535;
+		static constexpr int skip_trigger  = 6;
+
+		static uint32 read32(const uint8* p)
+		{
+			uint32 value;
+			std::memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		static uint8* length_out(uint8* out, uint8* out_end, std::size_t length)
+		{
+			while (length >= 255)
+			{
+				if (out == out_end)
+					return nullptr;
+				*out++ = 255;
+				length -= 255;
+			}
+			if (out == out_end)
+				return nullptr;
+			*out++ = static_cast<uint8>(length);
+			return out;
+		}
+
+		static bool read_length(const uint8*& in, const uint8* in_end, std::size_t& length)
+		{
+			uint8 byte;
+			do
+			{
+				if (in == in_end)
+					return false;
+				byte = *in++;
+				length += byte;
+			} while (byte == 255);
+			return true;
+		}
+
+		// literals, then a match unless match_length is 0
+		static uint8* sequence_out(uint8* out, uint8* out_end, const uint8* literals, int literal_length, int offset, int match_length)
+		{
+			if (out == out_end)
+				return nullptr;
+			uint8* token = out++;
+			const std::size_t lit = static_cast<std::size_t>(literal_length);
+			*token = static_cast<uint8>((lit >= 15 ? 15 : lit) << 4);
+			if (lit >= 15 && !(out = length_out(out, out_end, lit - 15)))
+				return nullptr;
+			if (static_cast<std::size_t>(out_end - out) < lit)
+				return nullptr;
+			std::memcpy(out, literals, lit);
+			out += lit;
+			if (match_length == 0)
+				return out;
+			if (out_end - out < 2)
+				return nullptr;
+			*out++ = static_cast<uint8>(offset);
+			*out++ = static_cast<uint8>(offset >> 8);
+			const std::size_t extra = static_cast<std::size_t>(match_length - min_match);
+			*token |= static_cast<uint8>(extra >= 15 ? 15 : extra);
+			if (extra >= 15 && !(out = length_out(out, out_end, extra - 15)))
+				return nullptr;
+			return out;
+		}
+	};
+
+	// MsgCompression
+	// Process wide codec stage. The high nibble of MsgHeader::crypto names
+	// the codec of a body, 0 for none, and a compressed body starts with the
+	// original length as 4 little endian bytes. Encode() compresses bodies
+	// of at least the threshold with the enabled codec when that makes them
+	// smaller and seals them with FrameCrc; the session Send paths and
+	// broadcasts go through it, frames built with Payload::Create stay
+	// plain and unsealed. Receiving is a separate opt-in, EnableReceive():
+	// until then the crypto byte reaches handlers untouched, as it always
+	// did. Once on, FrameReader and the websocket sessions inflate flagged
+	// bodies into the pooled message block before the handler runs, so
+	// handlers only see plain bodies. Compression runs before FrameCrc, the
+	// checksum covers the bytes on the wire. Peers must know every codec
+	// they may receive.
+	class MsgCompression
+	{
+	public:
+		static constexpr uint8 codec_mask   = 0xF0;
+		static constexpr int codec_shift    = 4;
+		static constexpr int prefix_length  = 4;
+		static constexpr uint8 lz_codec     = 1; // built in LzCodec
+		static constexpr uint8 max_codec    = 15;
+		static constexpr int default_threshold = 1024;
+
+		// id in [1, 15], call before any traffic; the built in id 1 may be
+		// replaced too
+		static bool Register(uint8 id, std::shared_ptr<MsgCodec> codec)
+		{
+			if (id == 0 || id > max_codec || !codec)
+				return false;
+			codecs()[id].store(codec.get(), std::memory_order_release);
+			owned()[id] = std::move(codec);
+			return true;
+		}
+
+		static const MsgCodec* Codec(uint8 id)
+		{
+			if (id == 0 || id > max_codec)
+				return nullptr;
+			return codecs()[id].load(std::memory_order_acquire);
+		}
+
+		// compress outgoing bodies of at least threshold bytes with codec id,
+		// 0 turns compression off
+		static void Enable(uint8 id, int threshold = default_threshold)
+		{
+			threshold_().store(threshold > 0 ? threshold : 1, std::memory_order_relaxed);
+			enabled_().store(id <= max_codec ? id : 0, std::memory_order_relaxed);
+		}
+
+		static uint8 Enabled()
+		{
+			return enabled_().load(std::memory_order_relaxed);
+		}
+
+		// inflate flagged bodies on the way in, off by default
+		static void EnableReceive(bool on)
+		{
+			receive_().store(on, std::memory_order_relaxed);
+		}
+
+		static bool Receiving()
+		{
+			return receive_().load(std::memory_order_relaxed);
+		}
+
+		// codec for msg on the way out, null when it stays as is
+		static const MsgCodec* Select(const Message& msg, uint8& id)
+		{
+			id = Enabled();
+			if (id == 0 || msg.body_length() < threshold_().load(std::memory_order_relaxed))
+				return nullptr;
+			if (reinterpret_cast<const MsgHeader*>(msg.data())->crypto & codec_mask)
+				return nullptr;
+			return Codec(id);
+		}
+
+		// Header, length prefix and compressed body of msg into out, which
+		// holds header_length + prefix_length + codec.Bound(body) bytes.
+		// Returns the frame length, 0 when compressing does not pay.
+		static int Pack(const MsgCodec& codec, uint8 id, const Message& msg, char* out)
+		{
+			const int body = msg.body_length();
+			char* dst = out + Message::header_length + prefix_length;
+			const int packed = codec.Compress(msg.body(), body, dst, codec.Bound(body));
+			if (packed <= 0 || packed + prefix_length >= body)
+				return 0;
+			MsgHeader header;
+			std::memcpy(&header, msg.data(), Message::header_length);
+			header.body_len = packed + prefix_length;
+			header.crypto = static_cast<uint8>((header.crypto & ~codec_mask) | (id << codec_shift));
+			std::memcpy(out, &header, Message::header_length);
+			const uint32 raw = static_cast<uint32>(body);
+			for (int i = 0; i < prefix_length; ++i)
+				out[Message::header_length + i] = static_cast<char>(raw >> (8 * i));
+			return Message::header_length + prefix_length + packed;
+		}
+
+		// one frame out of msg like Payload::Create, compressed when that
+		// pays, then sealed by FrameCrc
+		static PayloadPtr Encode(const Message& msg)
+		{
+			uint8 id = 0;
+			const MsgCodec* codec = Select(msg, id);
+			if (!codec)
+			{
+				PayloadPtr ptr = Payload::Create(msg);
+				FrameCrc::Seal(const_cast<char*>(ptr->data()));
+				return ptr;
+			}
+			// the bound covers the plain frame too, so a body that does not
+			// shrink is copied into the same block
+			PayloadPtr ptr = Payload::Allocate(Message::header_length + prefix_length + codec->Bound(msg.body_length()));
+			Payload* payload = const_cast<Payload*>(ptr.get());
+			char* data = const_cast<char*>(payload->data());
+			const int packed = Pack(*codec, id, msg, data);
+			if (packed > 0)
+			{
+				payload->shrink(packed);
+			}
+			else
+			{
+				std::memcpy(data, msg.data(), msg.length());
+				payload->shrink(msg.length());
+			}
+			FrameCrc::Seal(data);
+			return ptr;
+		}
+
+		static bool Compressed(const MsgHeader& header)
+		{
+			return (header.crypto & codec_mask) != 0;
+		}
+
+		// whether a receiver inflates the body of header with Unpack()
+		static bool ShouldUnpack(const MsgHeader& header)
+		{
+			return Compressed(header) && Receiving();
+		}
+
+		// Inflates the length body bytes of a flagged frame into msg, whose
+		// header is already decoded. Clears the codec and crc flags since
+		// they describe the wire bytes. False on an unknown codec or a
+		// corrupt body.
+		static bool Unpack(Message& msg, const char* body, int length)
+		{
+			MsgHeader* header = reinterpret_cast<MsgHeader*>(msg.data());
+			const MsgCodec* codec = Codec(static_cast<uint8>(header->crypto >> codec_shift));
+			if (!codec || length < prefix_length)
+				return false;
+			uint32 raw = 0;
+			for (int i = 0; i < prefix_length; ++i)
+				raw |= static_cast<uint32>(static_cast<uint8>(body[i])) << (8 * i);
+			if (raw > static_cast<uint32>(Message::max_body_length))
+				return false;
+			msg.body_length(static_cast<int>(raw));
+			header = reinterpret_cast<MsgHeader*>(msg.data());
+			const int inflated = codec->Decompress(body + prefix_length, length - prefix_length, msg.body(), static_cast<int>(raw));
+			if (inflated != static_cast<int>(raw))
+				return false;
+			header->body_len = static_cast<int>(raw);
+			header->crypto = static_cast<uint8>(header->crypto & ~(codec_mask | eCryptoCrc));
+			header->crc = 0;
+			return true;
+		}
+
+	private:
+		static std::atomic<const MsgCodec*>* codecs()
+		{
+			static std::atomic<const MsgCodec*> table[max_codec + 1] = {};
+			static const bool builtin = [] {
+				static LzCodec lz;
+				table[lz_codec].store(&lz, std::memory_order_release);
+				return true;
+			}();
+			(void)builtin;
+			return table;
+		}
+
+		static std::shared_ptr<MsgCodec>* owned()
+		{
+			static std::shared_ptr<MsgCodec> table[max_codec + 1];
+			return table;
+		}
+
+		static std::atomic<uint8>& enabled_()
+		{
+			static std::atomic<uint8> id = { 0 };
+			return id;
+		}
+
+		static std::atomic<int>& threshold_()
+		{
+			static std::atomic<int> bytes = { default_threshold };
+			return bytes;
+		}
+
+		static std::atomic<bool>& receive_()
+		{
+			static std::atomic<bool> on = { false };
+			return on;
+		}
+	};
+
+}
+
+#endif // __COMPRESS_HPP__
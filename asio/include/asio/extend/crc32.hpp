@@ -2,10 +2,25 @@
 #define __CRC32_H__
 #include <stdio.h>
 #include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CRC32_HAS_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CRC32_TARGET(features)
+#else
+#include <cpuid.h>
+#define CRC32_TARGET(features) __attribute__((target(features)))
+#endif
+#endif
 
 namespace Crypto
 {
-    static uint32_t crcTable[256] = {
+    inline uint32_t crcTable[256] = {
         0x0, 0x77073096, 0xee0e612c, 0x990951ba, 0x76dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
         0xedb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988, 0x9b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
         0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
@@ -40,25 +55,400 @@ namespace Crypto
         0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
     };
 
-    static uint32_t CRC32(char* c, int len)
+    // CRC kernels, from the byte table loop up to the hardware ones
+    enum class CrcKernel
+    {
+        Table,   // one byte per step
+        Slice8,  // eight bytes per step, eight tables
+        Slice16, // sixteen bytes per step, sixteen tables
+        Pclmul,  // carry-less multiply folding, CRC-32 only
+        Sse42,   // crc32 instruction, CRC-32C only
+    };
+
+    namespace detail
     {
-        uint32_t crc;
-        char *e = c + len;
+        // t[k][b] is the CRC of byte b followed by k zero bytes
+        template<uint32_t Poly, int N>
+        struct CrcTables
+        {
+            uint32_t t[N][256];
+
+            constexpr CrcTables() : t()
+            {
+                for (uint32_t b = 0; b < 256; ++b)
+                {
+                    uint32_t crc = b;
+                    for (int i = 0; i < 8; ++i)
+                        crc = (crc >> 1) ^ ((crc & 1) ? Poly : 0);
+                    t[0][b] = crc;
+                }
+                for (int k = 1; k < N; ++k)
+                {
+                    for (uint32_t b = 0; b < 256; ++b)
+                        t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xFF];
+                }
+            }
+        };
+
+        constexpr uint32_t kCrc32Poly = 0xEDB88320;  // IEEE 802.3, zlib
+        constexpr uint32_t kCrc32cPoly = 0x82F63B78; // Castagnoli, iSCSI
+
+        template<uint32_t Poly>
+        inline constexpr CrcTables<Poly, 16> kCrcTables{};
+
+        // kernels take and return the inverted running state
+
+        template<uint32_t Poly>
+        inline uint32_t CrcTable(uint32_t crc, const unsigned char* p, size_t len)
+        {
+            const auto& t = kCrcTables<Poly>.t;
+            while (len--)
+                crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+            return crc;
+        }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        // the slicing kernels read little endian words
+        template<uint32_t Poly>
+        inline uint32_t CrcSlice8(uint32_t crc, const unsigned char* p, size_t len)
+        {
+            return CrcTable<Poly>(crc, p, len);
+        }
+
+        template<uint32_t Poly>
+        inline uint32_t CrcSlice16(uint32_t crc, const unsigned char* p, size_t len)
+        {
+            return CrcTable<Poly>(crc, p, len);
+        }
+#else
+        template<uint32_t Poly>
+        inline uint32_t CrcSlice8(uint32_t crc, const unsigned char* p, size_t len)
+        {
+            const auto& t = kCrcTables<Poly>.t;
+            while (len >= 8)
+            {
+                uint32_t lo, hi;
+                std::memcpy(&lo, p, 4);
+                std::memcpy(&hi, p + 4, 4);
+                lo ^= crc;
+                crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+                    ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+                p += 8;
+                len -= 8;
+            }
+            return CrcTable<Poly>(crc, p, len);
+        }
+
+        template<uint32_t Poly>
+        inline uint32_t CrcSlice16(uint32_t crc, const unsigned char* p, size_t len)
+        {
+            const auto& t = kCrcTables<Poly>.t;
+            while (len >= 16)
+            {
+                uint32_t w[4];
+                std::memcpy(w, p, 16);
+                w[0] ^= crc;
+                crc = t[15][w[0] & 0xFF] ^ t[14][(w[0] >> 8) & 0xFF] ^ t[13][(w[0] >> 16) & 0xFF] ^ t[12][w[0] >> 24]
+                    ^ t[11][w[1] & 0xFF] ^ t[10][(w[1] >> 8) & 0xFF] ^ t[9][(w[1] >> 16) & 0xFF] ^ t[8][w[1] >> 24]
+                    ^ t[7][w[2] & 0xFF] ^ t[6][(w[2] >> 8) & 0xFF] ^ t[5][(w[2] >> 16) & 0xFF] ^ t[4][w[2] >> 24]
+                    ^ t[3][w[3] & 0xFF] ^ t[2][(w[3] >> 8) & 0xFF] ^ t[1][(w[3] >> 16) & 0xFF] ^ t[0][w[3] >> 24];
+                p += 16;
+                len -= 16;
+            }
+            return CrcSlice8<Poly>(crc, p, len);
+        }
+#endif
+
+#if defined(CRC32_HAS_X86)
+        struct CpuFeatures
+        {
+            bool sse42 = false;
+            bool pclmul = false; // with sse4.1 for the final extract
+
+            CpuFeatures()
+            {
+                unsigned int ecx = 0;
+#if defined(_MSC_VER)
+                int info[4] = {};
+                __cpuid(info, 1);
+                ecx = static_cast<unsigned int>(info[2]);
+#else
+                unsigned int eax = 0, ebx = 0, edx = 0;
+                if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+                    return;
+#endif
+                sse42 = (ecx & (1u << 20)) != 0;
+                pclmul = (ecx & (1u << 1)) != 0 && (ecx & (1u << 19)) != 0;
+            }
+        };
+
+        inline const CpuFeatures& Cpu()
+        {
+            static const CpuFeatures features;
+            return features;
+        }
+
+        CRC32_TARGET("sse4.2")
+        inline uint32_t Crc32cSse42(uint32_t crc, const unsigned char* p, size_t len)
+        {
+            uint64_t crc64 = crc;
+            while (len >= 8)
+            {
+                uint64_t word;
+                std::memcpy(&word, p, 8);
+                crc64 = _mm_crc32_u64(crc64, word);
+                p += 8;
+                len -= 8;
+            }
+            crc = static_cast<uint32_t>(crc64);
+            while (len--)
+                crc = _mm_crc32_u8(crc, *p++);
+            return crc;
+        }
+
+        // Folds 64 bytes per step with carry-less multiplies and ends with a
+        // Barrett reduction ("Fast CRC Computation for Generic Polynomials
+        // Using PCLMULQDQ", Intel). Takes whole 16 byte blocks, at least 64.
+        CRC32_TARGET("pclmul,sse4.1")
+        inline uint32_t Crc32PclmulBlocks(uint32_t crc, const unsigned char* p, size_t len)
+        {
+            alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+            alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+            alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+            alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+            __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+            x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x00));
+            x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x10));
+            x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x20));
+            x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x30));
+            x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+            x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+            p += 64;
+            len -= 64;
+
+            // four lanes of 16 bytes folded in parallel
+            while (len >= 64)
+            {
+                x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+                x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+                x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+                x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+                x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+                x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+                x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+                x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+                x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x00)));
+                x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x10)));
+                x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x20)));
+                x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x30)));
+                p += 64;
+                len -= 64;
+            }
+
+            // the four lanes into one
+            x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+            x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+            x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+            x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+            // remaining 16 byte blocks
+            while (len >= 16)
+            {
+                x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+                x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+                x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+                p += 16;
+                len -= 16;
+            }
+
+            // 128 bits down to 64
+            x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+            x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+            x1 = _mm_srli_si128(x1, 8);
+            x1 = _mm_xor_si128(x1, x2);
+            x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+            x2 = _mm_srli_si128(x1, 4);
+            x1 = _mm_and_si128(x1, x3);
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x1 = _mm_xor_si128(x1, x2);
+
+            // Barrett reduction to 32 bits
+            x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+            x2 = _mm_and_si128(x1, x3);
+            x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+            x2 = _mm_and_si128(x2, x3);
+            x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+            x1 = _mm_xor_si128(x1, x2);
+            return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+        }
+
+        inline uint32_t Crc32Pclmul(uint32_t crc, const unsigned char* p, size_t len)
+        {
+            if (len >= 64)
+            {
+                const size_t blocks = len & ~static_cast<size_t>(15);
+                crc = Crc32PclmulBlocks(crc, p, blocks);
+                p += blocks;
+                len -= blocks;
+            }
+            return CrcSlice16<kCrc32Poly>(crc, p, len);
+        }
+#endif
+
+        typedef uint32_t (*CrcFn)(uint32_t, const unsigned char*, size_t);
 
-        crc = 0xFFFFFFFF;
-        while (c < e)
+        inline CrcFn Crc32Best()
         {
-            crc = ((crc >> 8) & 0x00FFFFFF) ^ crcTable[(crc^ *c) & 0xFF];
-            ++c;
+#if defined(CRC32_HAS_X86)
+            if (Cpu().pclmul)
+                return &Crc32Pclmul;
+#endif
+            return &CrcSlice16<kCrc32Poly>;
         }
-        return (crc ^ 0xFFFFFFFF);
+
+        inline CrcFn Crc32cBest()
+        {
+#if defined(CRC32_HAS_X86)
+            if (Cpu().sse42)
+                return &Crc32cSse42;
+#endif
+            return &CrcSlice8<kCrc32cPoly>;
+        }
+    }
+
+    // true when the kernel runs on this CPU for that CRC
+    inline bool HasCrc32Kernel(CrcKernel kernel)
+    {
+        switch (kernel)
+        {
+        case CrcKernel::Table:
+        case CrcKernel::Slice8:
+        case CrcKernel::Slice16:
+            return true;
+#if defined(CRC32_HAS_X86)
+        case CrcKernel::Pclmul:
+            return detail::Cpu().pclmul;
+#endif
+        default:
+            return false;
+        }
+    }
+
+    inline bool HasCrc32cKernel(CrcKernel kernel)
+    {
+        switch (kernel)
+        {
+        case CrcKernel::Table:
+        case CrcKernel::Slice8:
+        case CrcKernel::Slice16:
+            return true;
+#if defined(CRC32_HAS_X86)
+        case CrcKernel::Sse42:
+            return detail::Cpu().sse42;
+#endif
+        default:
+            return false;
+        }
+    }
+
+    // CRC-32 (zlib) of data continuing from crc, 0 to start; the fastest
+    // kernel of this CPU is picked on first use
+    inline uint32_t Crc32(const void* data, size_t len, uint32_t crc = 0)
+    {
+        static const detail::CrcFn fn = detail::Crc32Best();
+        return ~fn(~crc, static_cast<const unsigned char*>(data), len);
+    }
+
+    // CRC-32C (Castagnoli), same calling convention
+    inline uint32_t Crc32c(const void* data, size_t len, uint32_t crc = 0)
+    {
+        static const detail::CrcFn fn = detail::Crc32cBest();
+        return ~fn(~crc, static_cast<const unsigned char*>(data), len);
+    }
+
+    // one given kernel, for tests and benchmarks; check Has*Kernel first
+    inline uint32_t Crc32With(CrcKernel kernel, const void* data, size_t len, uint32_t crc = 0)
+    {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        switch (kernel)
+        {
+        case CrcKernel::Slice8:
+            return ~detail::CrcSlice8<detail::kCrc32Poly>(~crc, p, len);
+        case CrcKernel::Slice16:
+            return ~detail::CrcSlice16<detail::kCrc32Poly>(~crc, p, len);
+#if defined(CRC32_HAS_X86)
+        case CrcKernel::Pclmul:
+            return ~detail::Crc32Pclmul(~crc, p, len);
+#endif
+        default:
+            return ~detail::CrcTable<detail::kCrc32Poly>(~crc, p, len);
+        }
+    }
+
+    inline uint32_t Crc32cWith(CrcKernel kernel, const void* data, size_t len, uint32_t crc = 0)
+    {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        switch (kernel)
+        {
+        case CrcKernel::Slice8:
+            return ~detail::CrcSlice8<detail::kCrc32cPoly>(~crc, p, len);
+        case CrcKernel::Slice16:
+            return ~detail::CrcSlice16<detail::kCrc32cPoly>(~crc, p, len);
+#if defined(CRC32_HAS_X86)
+        case CrcKernel::Sse42:
+            return ~detail::Crc32cSse42(~crc, p, len);
+#endif
+        default:
+            return ~detail::CrcTable<detail::kCrc32cPoly>(~crc, p, len);
+        }
+    }
+
+    // incremental CRC over data arriving in pieces
+    template<uint32_t (*Fn)(const void*, size_t, uint32_t)>
+    class CrcStream
+    {
+    public:
+        void update(const void* data, size_t len)
+        {
+            crc_ = Fn(data, len, crc_);
+        }
+
+        uint32_t value() const
+        {
+            return crc_;
+        }
+
+        void reset()
+        {
+            crc_ = 0;
+        }
+
+    private:
+        uint32_t crc_ = 0;
+    };
+
+    typedef CrcStream<&Crc32> Crc32Stream;
+    typedef CrcStream<&Crc32c> Crc32cStream;
+
+    inline uint32_t CRC32(char* c, int len)
+    {
+        return Crc32(c, static_cast<size_t>(len));
     }
 
-    static uint32_t CRC32(const std::string& str)
+    inline uint32_t CRC32(const std::string& str)
     {
-        return CRC32((char*)str.data(), (int)str.length());
+        return Crc32(str.data(), str.length());
     }
 
 } // !Crypto
 
-#endif // __CRC32_H__
+#endif // __CRC32_H__
\ No newline at end of file
@@ -0,0 +1,88 @@
+//
+// frame_crc.hpp
+// opt-in CRC-32 of message bodies in MsgHeader::crc
+//
+
+#ifndef __FRAME_CRC_HPP__
+#define __FRAME_CRC_HPP__
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <asio/extend/crc32.hpp>
+#include <asio/msgdef/message.hpp>
+
+namespace asio {
+
+	// bits of MsgHeader::crypto
+	enum MsgCryptoFlag
+	{
+		eCryptoCrc = 0x08 // crc holds the CRC-32 of the body
+	};
+
+	enum class FrameCrcMode
+	{
+		Off,     // crc is neither filled nor checked
+		Sign,    // fill it on send, check flagged frames on receive
+		Require, // as Sign, and reject frames without the flag
+	};
+
+	// FrameCrc
+	// Process wide opt-in body checksum in MsgHeader::crc. The session Send
+	// paths seal outgoing frames through MsgCompression::Encode and
+	// FrameReader checks incoming ones, so every TcpSession and TcpClient
+	// follows the mode. Frames built with Payload::Create stay as they are.
+	// Only the body is covered, a gateway may still rewrite sId and gateId
+	// on the way.
+	class FrameCrc
+	{
+	public:
+		static void SetMode(FrameCrcMode mode)
+		{
+			mode_().store(mode, std::memory_order_relaxed);
+		}
+
+		static FrameCrcMode Mode()
+		{
+			return mode_().load(std::memory_order_relaxed);
+		}
+
+		// frame holds the header and body_len bytes of body
+		static void Seal(char* frame)
+		{
+			if (Mode() == FrameCrcMode::Off)
+				return;
+			MsgHeader* header = reinterpret_cast<MsgHeader*>(frame);
+			header->crc = static_cast<int>(Crypto::Crc32(frame + sizeof(MsgHeader), static_cast<std::size_t>(header->body_len)));
+			header->crypto |= eCryptoCrc;
+		}
+
+		// false when the frame must be rejected
+		static bool Check(const char* frame)
+		{
+			return Check(*reinterpret_cast<const MsgHeader*>(frame), frame + sizeof(MsgHeader));
+		}
+
+		// same with the body apart from the header, as a reader sees a
+		// compact or compressed frame
+		static bool Check(const MsgHeader& header, const char* body)
+		{
+			const FrameCrcMode mode = Mode();
+			if (mode == FrameCrcMode::Off)
+				return true;
+			if (!(header.crypto & eCryptoCrc))
+				return mode != FrameCrcMode::Require;
+			return static_cast<uint32_t>(header.crc)
+				== Crypto::Crc32(body, static_cast<std::size_t>(header.body_len));
+		}
+
+	private:
+		static std::atomic<FrameCrcMode>& mode_()
+		{
+			static std::atomic<FrameCrcMode> mode = { FrameCrcMode::Off };
+			return mode;
+		}
+	};
+
+}
+
+#endif // __FRAME_CRC_HPP__
@@ -0,0 +1,223 @@
+//
+// frame_reader.hpp
+// per session receive buffer that splits a byte stream into messages
+//
+
+#ifndef __FRAME_READER_HPP__
+#define __FRAME_READER_HPP__
+#include <cstddef>
+#include <cstring>
+#include <utility>
+#include <asio/buffer.hpp>
+#include <asio/extend/compress.hpp>
+#include <asio/extend/frame_crc.hpp>
+#include <asio/extend/framing.hpp>
+#include <asio/msgdef/buffer_pool.hpp>
+#include <asio/msgdef/message.hpp>
+
+namespace asio {
+
+	// FrameReader
+	// The session reads whatever the socket has into one linear buffer with
+	// async_read_some, then parse() hands out every complete MsgHeader + body
+	// frame found in it. A partial frame stays at the front of the buffer and
+	// is completed by the following reads. The buffer grows to fit one large
+	// frame and drops back to its default size once that frame is consumed.
+	// With Framing::Compact the headers are CompactHeader and are expanded
+	// into msg, so handlers always see a standard MsgHeader. The framing may
+	// change from inside a handler and applies from the next frame on.
+	class FrameReader
+	{
+	public:
+		static constexpr std::size_t default_buffer_size = 4096;
+
+		explicit FrameReader(std::size_t size = default_buffer_size)
+			: default_size_(size < Message::header_length ? Message::header_length : size)
+		{
+			this->data_ = BufferPool::Allocate(this->default_size_, this->capacity_);
+		}
+
+		~FrameReader()
+		{
+			BufferPool::Deallocate(this->data_, this->capacity_);
+		}
+
+		FrameReader(const FrameReader&) = delete;
+		FrameReader& operator=(const FrameReader&) = delete;
+
+		// free space at the tail for the next read
+		asio::mutable_buffer prepare()
+		{
+			if (this->begin_ > 0 && this->capacity_ - this->end_ < Message::header_length)
+			{
+				this->compact();
+			}
+			return asio::buffer(this->data_ + this->end_, this->capacity_ - this->end_);
+		}
+
+		void commit(std::size_t length)
+		{
+			this->end_ += length;
+		}
+
+		// Calls handler(Message&) for every complete frame, msg is reused for
+		// each of them. Compressed bodies are inflated into msg first when
+		// MsgCompression::Receiving(), else handed out as they are. Returns
+		// false when a header fails to decode, a body fails FrameCrc::Check()
+		// or does not decompress.
+		template <typename Handler>
+		bool parse(Message& msg, Handler&& handler)
+		{
+			int result;
+			while ((result = this->next(msg)) > 0)
+			{
+				handler(msg);
+			}
+			return result == 0;
+		}
+
+		// One frame into msg: 1 when msg holds it, 0 when more bytes are
+		// needed, -1 when the stream is corrupt. parse() is a loop over it.
+		int next(Message& msg)
+		{
+			if (this->end_ > this->begin_)
+			{
+				const char* frame = this->data_ + this->begin_;
+				const std::size_t available = this->end_ - this->begin_;
+				std::size_t header_length = Message::header_length;
+				if (this->framing_ == Framing::Compact)
+				{
+					MsgHeader header;
+					const int used = CompactHeader::Decode(frame, available, header);
+					if (used < 0)
+					{
+						return -1;
+					}
+					if (used == 0)
+					{
+						return 0;
+					}
+					header_length = static_cast<std::size_t>(used);
+					msg.encode_header(header);
+				}
+				else
+				{
+					if (available < header_length)
+					{
+						return 0;
+					}
+					std::memcpy(msg.data(), frame, Message::header_length);
+				}
+				if (!msg.decode_header())
+				{
+					return -1;
+				}
+				const std::size_t frame_length = header_length + static_cast<std::size_t>(msg.body_length());
+				if (available < frame_length)
+				{
+					this->reserve(frame_length);
+					return 0;
+				}
+				const char* body = frame + header_length;
+				const MsgHeader& header = *reinterpret_cast<const MsgHeader*>(msg.data());
+				if (!FrameCrc::Check(header, body))
+				{
+					return -1;
+				}
+				if (MsgCompression::ShouldUnpack(header))
+				{
+					if (!MsgCompression::Unpack(msg, body, msg.body_length()))
+					{
+						return -1;
+					}
+				}
+				else
+				{
+					std::memcpy(msg.body(), body, msg.body_length());
+				}
+				this->begin_ += frame_length;
+				return 1;
+			}
+			// everything parsed, drop back to the default buffer
+			this->begin_ = this->end_ = 0;
+			if (this->capacity_ > BufferPool::Capacity(this->default_size_))
+			{
+				this->resize(this->default_size_);
+			}
+			return 0;
+		}
+
+		// bytes received but not parsed yet
+		std::size_t pending() const
+		{
+			return this->end_ - this->begin_;
+		}
+
+		void clear()
+		{
+			this->begin_ = this->end_ = 0;
+		}
+
+		void set_framing(Framing framing)
+		{
+			this->framing_ = framing;
+		}
+
+		Framing framing() const
+		{
+			return this->framing_;
+		}
+
+	private:
+		// make sure one frame of length bytes fits from the current frame start
+		void reserve(std::size_t length)
+		{
+			if (this->capacity_ - this->begin_ >= length)
+				return;
+			if (this->capacity_ >= length)
+			{
+				this->compact();
+				return;
+			}
+			this->resize(length);
+		}
+
+		void compact()
+		{
+			const std::size_t size = this->end_ - this->begin_;
+			if (size > 0)
+			{
+				std::memmove(this->data_, this->data_ + this->begin_, size);
+			}
+			this->begin_ = 0;
+			this->end_ = size;
+		}
+
+		void resize(std::size_t length)
+		{
+			const std::size_t size = this->end_ - this->begin_;
+			std::size_t capacity = 0;
+			char* data = BufferPool::Allocate(length, capacity);
+			if (size > 0)
+			{
+				std::memcpy(data, this->data_ + this->begin_, size);
+			}
+			BufferPool::Deallocate(this->data_, this->capacity_);
+			this->data_ = data;
+			this->capacity_ = capacity;
+			this->begin_ = 0;
+			this->end_ = size;
+		}
+
+	private:
+		char* data_ = { nullptr };
+		std::size_t capacity_ = { 0 };
+		std::size_t begin_ = { 0 };
+		std::size_t end_ = { 0 };
+		std::size_t default_size_;
+		Framing framing_ = { Framing::Standard };
+	};
+
+}
+
+#endif // __FRAME_READER_HPP__
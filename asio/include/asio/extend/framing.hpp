@@ -0,0 +1,262 @@
+//
+// framing.hpp
+// standard and compact wire headers, negotiated per connection
+//
+
+#ifndef __FRAMING_HPP__
+#define __FRAMING_HPP__
+#include <cstddef>
+#include <cstring>
+#include <asio/extend/base.hpp>
+#include <asio/extend/frame_crc.hpp>
+#include <asio/msgdef/message.hpp>
+#include <asio/msgdef/payload.hpp>
+
+namespace asio {
+
+	// wire layout of the frame headers on one direction of a connection
+	enum class Framing : uint8
+	{
+		Standard = 0, // MsgHeader as is, 24 bytes
+		Compact  = 1, // CompactHeader, 3 bytes for a small client message
+	};
+
+	// CompactHeader
+	// A flags byte, varint body_len, varint msgId, then only the MsgHeader
+	// fields that are not zero, in flag order: sId as a varint, crc as four
+	// little endian bytes, then format, gateId, crypto and appId as one byte
+	// each. Decoding rebuilds a full MsgHeader, so a Message looks the same
+	// whichever framing it arrived in.
+	struct CompactHeader
+	{
+		enum Flag : uint8
+		{
+			eSessionId = 0x01,
+			eCrc       = 0x02,
+			eFormat    = 0x04,
+			eGateId    = 0x08,
+			eCrypto    = 0x10,
+			eAppId     = 0x20,
+			eReserved  = 0xC0, // must be zero
+		};
+
+		static constexpr int max_length = 1 + 5 + 5 + 10 + 4 + 4;
+
+		static int Size(const MsgHeader& header)
+		{
+			int size = 1 + varint_size(static_cast<uint32>(header.body_len))
+				+ varint_size(static_cast<uint32>(header.msgId));
+			if (header.sId != 0) size += varint_size(header.sId);
+			if (header.crc != 0) size += 4;
+			if (header.format != 0) size += 1;
+			if (header.gateId != 0) size += 1;
+			if (header.crypto != 0) size += 1;
+			if (header.appId != 0) size += 1;
+			return size;
+		}
+
+		// writes Size(header) bytes to out
+		static int Encode(const MsgHeader& header, char* out)
+		{
+			uint8* p = reinterpret_cast<uint8*>(out);
+			uint8* flags = p++;
+			*flags = 0;
+			p = put_varint(p, static_cast<uint32>(header.body_len));
+			p = put_varint(p, static_cast<uint32>(header.msgId));
+			if (header.sId != 0)
+			{
+				*flags |= eSessionId;
+				p = put_varint(p, header.sId);
+			}
+			if (header.crc != 0)
+			{
+				*flags |= eCrc;
+				const uint32 crc = static_cast<uint32>(header.crc);
+				for (int i = 0; i < 4; ++i)
+					*p++ = static_cast<uint8>(crc >> (8 * i));
+			}
+			if (header.format != 0) { *flags |= eFormat; *p++ = header.format; }
+			if (header.gateId != 0) { *flags |= eGateId; *p++ = header.gateId; }
+			if (header.crypto != 0) { *flags |= eCrypto; *p++ = header.crypto; }
+			if (header.appId != 0)  { *flags |= eAppId;  *p++ = header.appId; }
+			return static_cast<int>(p - reinterpret_cast<uint8*>(out));
+		}
+
+		// Header bytes consumed, 0 when more bytes are needed, -1 when the
+		// bytes can not be a compact header.
+		static int Decode(const char* data, std::size_t length, MsgHeader& header)
+		{
+			const uint8* p = reinterpret_cast<const uint8*>(data);
+			const uint8* end = p + length;
+			if (p == end)
+				return 0;
+			const uint8 flags = *p++;
+			if (flags & eReserved)
+				return -1;
+			header = MsgHeader();
+			uint64 value = 0;
+			int used = get_varint(p, end, value, 5);
+			if (used <= 0)
+				return used;
+			header.body_len = static_cast<int>(static_cast<uint32>(value));
+			p += used;
+			used = get_varint(p, end, value, 5);
+			if (used <= 0)
+				return used;
+			header.msgId = static_cast<int>(static_cast<uint32>(value));
+			p += used;
+			if (flags & eSessionId)
+			{
+				used = get_varint(p, end, value, 10);
+				if (used <= 0)
+					return used;
+				header.sId = value;
+				p += used;
+			}
+			const int bytes = ((flags & eCrc) ? 4 : 0) + ((flags & eFormat) ? 1 : 0) + ((flags & eGateId) ? 1 : 0)
+				+ ((flags & eCrypto) ? 1 : 0) + ((flags & eAppId) ? 1 : 0);
+			if (end - p < bytes)
+				return 0;
+			if (flags & eCrc)
+			{
+				uint32 crc = 0;
+				for (int i = 0; i < 4; ++i)
+					crc |= static_cast<uint32>(*p++) << (8 * i);
+				header.crc = static_cast<int>(crc);
+			}
+			if (flags & eFormat) header.format = *p++;
+			if (flags & eGateId) header.gateId = *p++;
+			if (flags & eCrypto) header.crypto = *p++;
+			if (flags & eAppId)  header.appId = *p++;
+			return static_cast<int>(p - reinterpret_cast<const uint8*>(data));
+		}
+
+		// Standard frames, back to back, re-encoded with compact headers
+		// into a new payload. A truncated frame at the end is left out.
+		static PayloadPtr FromStandard(const char* data, int length)
+		{
+			int out = 0;
+			for (int pos = 0; pos + Message::header_length <= length;)
+			{
+				MsgHeader header;
+				std::memcpy(&header, data + pos, Message::header_length);
+				const int frame = Message::header_length + header.body_len;
+				if (header.body_len < 0 || frame > length - pos)
+					break;
+				out += Size(header) + header.body_len;
+				pos += frame;
+			}
+			PayloadPtr payload = Payload::Allocate(out);
+			char* p = const_cast<char*>(payload->data());
+			for (int pos = 0; out > 0;)
+			{
+				MsgHeader header;
+				std::memcpy(&header, data + pos, Message::header_length);
+				const int written = Encode(header, p);
+				std::memcpy(p + written, data + pos + Message::header_length, header.body_len);
+				p += written + header.body_len;
+				out -= written + header.body_len;
+				pos += Message::header_length + header.body_len;
+			}
+			return payload;
+		}
+
+	private:
+		static int varint_size(uint64 value)
+		{
+			int size = 1;
+			while (value >= 0x80)
+			{
+				value >>= 7;
+				++size;
+			}
+			return size;
+		}
+
+		static uint8* put_varint(uint8* p, uint64 value)
+		{
+			while (value >= 0x80)
+			{
+				*p++ = static_cast<uint8>(value | 0x80);
+				value >>= 7;
+			}
+			*p++ = static_cast<uint8>(value);
+			return p;
+		}
+
+		// bytes used, 0 when incomplete, -1 past max_bytes
+		static int get_varint(const uint8* p, const uint8* end, uint64& value, int max_bytes)
+		{
+			value = 0;
+			for (int i = 0; i < max_bytes; ++i)
+			{
+				if (p + i == end)
+					return 0;
+				value |= static_cast<uint64>(p[i] & 0x7F) << (7 * i);
+				if (!(p[i] & 0x80))
+					return i + 1;
+			}
+			return -1;
+		}
+	};
+
+	// FramingHandshake
+	// Control frames that switch a connection to another framing, always
+	// sent with the standard header. Their msgId is reserved and the body
+	// is two bytes, the op and the framing. Each side changes one direction
+	// right after a frame it sends or receives, so no frame is ever read
+	// with the wrong header:
+	//   client  Offer(f)  ->              nothing changes yet
+	//   server            <- Accept(f')   server -> client uses f' after it
+	//   client  Switch(f') ->             client -> server uses f' after it
+	// A server that does not allow f answers Accept(Standard). A peer that
+	// predates this sees an unknown msgId and the link stays standard.
+	struct FramingHandshake
+	{
+		static constexpr int msg_id = -0x46524D; // "FRM"
+
+		enum Op : uint8
+		{
+			eOffer  = 1,
+			eAccept = 2,
+			eSwitch = 3,
+		};
+
+		static bool Is(const Message& msg)
+		{
+			return reinterpret_cast<const MsgHeader*>(msg.data())->msgId == msg_id;
+		}
+
+		static PayloadPtr Make(Op op, Framing framing)
+		{
+			Message msg;
+			MsgHeader header;
+			header.msgId = msg_id;
+			header.body_len = 2;
+			msg.body_length(2);
+			msg.encode_header(header);
+			msg.body()[0] = static_cast<char>(op);
+			msg.body()[1] = static_cast<char>(framing);
+			PayloadPtr ptr = Payload::Create(msg);
+			FrameCrc::Seal(const_cast<char*>(ptr->data()));
+			return ptr;
+		}
+
+		// false when the body is not a handshake we understand
+		static bool Parse(const Message& msg, Op& op, Framing& framing)
+		{
+			if (!Is(msg) || msg.body_length() < 2)
+				return false;
+			const uint8 code = static_cast<uint8>(msg.body()[0]);
+			const uint8 layout = static_cast<uint8>(msg.body()[1]);
+			if (code < eOffer || code > eSwitch || layout > static_cast<uint8>(Framing::Compact))
+				return false;
+			op = static_cast<Op>(code);
+			framing = static_cast<Framing>(layout);
+			return true;
+		}
+	};
+
+}
+
+#endif // __FRAMING_HPP__
@@ -0,0 +1,522 @@
+//
+// metrics.hpp
+// per thread counters and latency histograms for servers and clients
+//
+
+#ifndef __METRICS_HPP__
+#define __METRICS_HPP__
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <system_error>
+#include <asio/error.hpp>
+#include <asio/extend/base.hpp>
+
+namespace asio {
+
+	// counters, summed over all threads in a snapshot
+	enum class Metric : int
+	{
+		BytesIn,
+		BytesOut,
+		MsgsIn,
+		MsgsOut,
+		Accepts,            // server sessions started
+		Connects,           // client links up
+		DisconnectEof,      // the peer closed
+		DisconnectError,    // read failed
+		DisconnectClosed,   // closed from this side, idle closes included
+		DisconnectProtocol, // corrupt frame
+		DisconnectWrite,    // write failed
+		IdleCloses,
+		Count
+	};
+
+	enum class Histogram : int
+	{
+		HandlerNs,       // in HandleMessage, sampled
+		QueueWaitNs,     // a session lane ready until a worker takes it
+		WriteQueueBytes, // outbound queue depth after each enqueue, per flush on clients
+		WriteBytes,      // bytes per completed socket write
+		Count
+	};
+
+	// one histogram summed over threads; bucket 0 holds 0, bucket i holds
+	// [2^(i-1), 2^i)
+	struct HistogramSnapshot
+	{
+		static constexpr int buckets = 64;
+
+		uint64 count = { 0 };
+		uint64 sum = { 0 };
+		uint64 max = { 0 };
+		uint64 bucket[buckets] = {};
+
+		double Mean() const
+		{
+			return this->count ? static_cast<double>(this->sum) / static_cast<double>(this->count) : 0.0;
+		}
+
+		// upper bound of the bucket holding the q-th quantile, q in [0, 1]
+		uint64 Percentile(double q) const
+		{
+			if (this->count == 0)
+				return 0;
+			const uint64 rank = static_cast<uint64>(q * static_cast<double>(this->count - 1)) + 1;
+			uint64 seen = 0;
+			for (int i = 0; i < buckets; ++i)
+			{
+				seen += this->bucket[i];
+				if (seen >= rank)
+				{
+					const uint64 bound = i == 0 ? 0 : (uint64(1) << i) - 1;
+					return bound < this->max ? bound : this->max;
+				}
+			}
+			return this->max;
+		}
+	};
+
+	struct HandlerSnapshot
+	{
+		int msgId = { 0 };
+		uint64 count = { 0 };
+		uint64 total_ns = { 0 };
+		uint64 max_ns = { 0 };
+	};
+
+	struct MetricsSnapshot
+	{
+		uint64 counters[static_cast<int>(Metric::Count)] = {};
+		HistogramSnapshot histograms[static_cast<int>(Histogram::Count)];
+		// sampled handler time by msgId, ids past the table share one entry
+		std::vector<HandlerSnapshot> handlers;
+
+		uint64 operator[](Metric m) const
+		{
+			return this->counters[static_cast<int>(m)];
+		}
+
+		const HistogramSnapshot& operator[](Histogram h) const
+		{
+			return this->histograms[static_cast<int>(h)];
+		}
+
+		std::string ToText() const
+		{
+			std::string out;
+			char line[256];
+			for (int i = 0; i < static_cast<int>(Metric::Count); ++i)
+			{
+				std::snprintf(line, sizeof(line), "%s %llu\n", MetricName(i), static_cast<unsigned long long>(this->counters[i]));
+				out += line;
+			}
+			for (int i = 0; i < static_cast<int>(Histogram::Count); ++i)
+			{
+				const HistogramSnapshot& h = this->histograms[i];
+				std::snprintf(line, sizeof(line), "%s count=%llu mean=%.0f p50=%llu p99=%llu p999=%llu max=%llu\n",
+					HistogramName(i), static_cast<unsigned long long>(h.count), h.Mean(),
+					static_cast<unsigned long long>(h.Percentile(0.50)), static_cast<unsigned long long>(h.Percentile(0.99)),
+					static_cast<unsigned long long>(h.Percentile(0.999)), static_cast<unsigned long long>(h.max));
+				out += line;
+			}
+			for (const auto& handler : this->handlers)
+			{
+				std::snprintf(line, sizeof(line), "handler msgId=%d count=%llu mean_ns=%llu max_ns=%llu\n",
+					handler.msgId, static_cast<unsigned long long>(handler.count),
+					static_cast<unsigned long long>(handler.count ? handler.total_ns / handler.count : 0),
+					static_cast<unsigned long long>(handler.max_ns));
+				out += line;
+			}
+			return out;
+		}
+
+		std::string ToJson() const
+		{
+			std::string out = "{\"counters\":{";
+			char field[256];
+			for (int i = 0; i < static_cast<int>(Metric::Count); ++i)
+			{
+				std::snprintf(field, sizeof(field), "%s\"%s\":%llu", i ? "," : "", MetricName(i), static_cast<unsigned long long>(this->counters[i]));
+				out += field;
+			}
+			out += "},\"histograms\":{";
+			for (int i = 0; i < static_cast<int>(Histogram::Count); ++i)
+			{
+				const HistogramSnapshot& h = this->histograms[i];
+				std::snprintf(field, sizeof(field), "%s\"%s\":{\"count\":%llu,\"sum\":%llu,\"max\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"buckets\":[",
+					i ? "," : "", HistogramName(i), static_cast<unsigned long long>(h.count), static_cast<unsigned long long>(h.sum),
+					static_cast<unsigned long long>(h.max), static_cast<unsigned long long>(h.Percentile(0.50)),
+					static_cast<unsigned long long>(h.Percentile(0.99)), static_cast<unsigned long long>(h.Percentile(0.999)));
+				out += field;
+				// trailing empty buckets left out
+				int last = HistogramSnapshot::buckets;
+				while (last > 0 && h.bucket[last - 1] == 0)
+					--last;
+				for (int b = 0; b < last; ++b)
+				{
+					std::snprintf(field, sizeof(field), "%s%llu", b ? "," : "", static_cast<unsigned long long>(h.bucket[b]));
+					out += field;
+				}
+				out += "]}";
+			}
+			out += "},\"handlers\":[";
+			for (std::size_t i = 0; i < this->handlers.size(); ++i)
+			{
+				const HandlerSnapshot& handler = this->handlers[i];
+				std::snprintf(field, sizeof(field), "%s{\"msgId\":%d,\"count\":%llu,\"total_ns\":%llu,\"max_ns\":%llu}",
+					i ? "," : "", handler.msgId, static_cast<unsigned long long>(handler.count),
+					static_cast<unsigned long long>(handler.total_ns), static_cast<unsigned long long>(handler.max_ns));
+				out += field;
+			}
+			out += "]}";
+			return out;
+		}
+
+		static const char* MetricName(int i)
+		{
+			static const char* const names[] = {
+				"bytes_in", "bytes_out", "msgs_in", "msgs_out", "accepts", "connects",
+				"disconnect_eof", "disconnect_error", "disconnect_closed", "disconnect_protocol",
+				"disconnect_write", "idle_closes" };
+			static_assert(sizeof(names) / sizeof(names[0]) == static_cast<std::size_t>(Metric::Count), "metric names");
+			return names[i];
+		}
+
+		static const char* HistogramName(int i)
+		{
+			static const char* const names[] = { "handler_ns", "queue_wait_ns", "write_queue_bytes", "write_bytes" };
+			static_assert(sizeof(names) / sizeof(names[0]) == static_cast<std::size_t>(Histogram::Count), "histogram names");
+			return names[i];
+		}
+	};
+
+	// Metrics
+	// Every thread writes its own shard with plain relaxed stores, no
+	// read-modify-write and no shared cache line, and Snapshot() sums the
+	// shards. A thread that exits leaves its shard to the next new thread,
+	// so totals stay cumulative and the shard count stays at the peak
+	// thread count. Handler times are sampled, one message in
+	// SetSampling() per thread is timed.
+	class Metrics
+	{
+	public:
+		static constexpr int handler_slots = 1024;
+		static constexpr uint32 default_sampling = 16;
+
+		static void Add(Metric m, uint64 value = 1)
+		{
+			bump(shard().counters[static_cast<int>(m)], value);
+		}
+
+		// a read loop ended with ec, no error means a corrupt frame
+		static void AddReadEnd(const std::error_code& ec)
+		{
+			Add(!ec ? Metric::DisconnectProtocol
+				: ec == asio::error::eof ? Metric::DisconnectEof
+				: ec == asio::error::operation_aborted ? Metric::DisconnectClosed
+				: Metric::DisconnectError);
+		}
+
+		static void Record(Histogram h, uint64 value)
+		{
+			Cells& cells = shard().histograms[static_cast<int>(h)];
+			bump(cells.sum, value);
+			bump(cells.bucket[bucket(value)], 1);
+			if (value > cells.max.load(std::memory_order_relaxed))
+				cells.max.store(value, std::memory_order_relaxed);
+		}
+
+		// one handler run of msgId, also counted in Histogram::HandlerNs
+		static void RecordHandler(int msgId, uint64 ns)
+		{
+			Record(Histogram::HandlerNs, ns);
+			Handler& handler = shard().find(msgId);
+			bump(handler.count, 1);
+			bump(handler.total_ns, ns);
+			if (ns > handler.max_ns.load(std::memory_order_relaxed))
+				handler.max_ns.store(ns, std::memory_order_relaxed);
+		}
+
+		// true for the messages to time on this thread
+		static bool Sample()
+		{
+			const uint32 every = sampling().load(std::memory_order_relaxed);
+			if (every == 0)
+				return false;
+			Shard& s = shard();
+			if (++s.tick < every)
+				return false;
+			s.tick = 0;
+			return true;
+		}
+
+		// time one message in every, 1 times all of them, 0 none
+		static void SetSampling(uint32 every)
+		{
+			sampling().store(every, std::memory_order_relaxed);
+		}
+
+		// false once timing is off, for waits taken once per batch
+		static bool Timing()
+		{
+			return sampling().load(std::memory_order_relaxed) != 0;
+		}
+
+		static uint64 Now()
+		{
+			return static_cast<uint64>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+
+		static MetricsSnapshot Snapshot()
+		{
+			MetricsSnapshot snapshot;
+			Registry& registry = Metrics::registry();
+			std::lock_guard lock(registry.mutex);
+			std::vector<HandlerSnapshot> handlers;
+			for (const auto& s : registry.shards)
+			{
+				for (int i = 0; i < static_cast<int>(Metric::Count); ++i)
+				{
+					snapshot.counters[i] += s->counters[i].load(std::memory_order_relaxed);
+				}
+				for (int i = 0; i < static_cast<int>(Histogram::Count); ++i)
+				{
+					const Cells& cells = s->histograms[i];
+					HistogramSnapshot& h = snapshot.histograms[i];
+					h.sum += cells.sum.load(std::memory_order_relaxed);
+					const uint64 max = cells.max.load(std::memory_order_relaxed);
+					if (max > h.max)
+						h.max = max;
+					for (int b = 0; b < HistogramSnapshot::buckets; ++b)
+					{
+						const uint64 n = cells.bucket[b].load(std::memory_order_relaxed);
+						h.bucket[b] += n;
+						h.count += n;
+					}
+				}
+				for (int i = 0; i < handler_slots + 1; ++i)
+				{
+					const Handler& handler = s->handlers[i];
+					if (i < handler_slots && !handler.used.load(std::memory_order_acquire))
+						continue;
+					const uint64 count = handler.count.load(std::memory_order_relaxed);
+					if (count == 0)
+						continue;
+					const int msgId = i == handler_slots ? overflow_id : handler.msgId.load(std::memory_order_relaxed);
+					HandlerSnapshot* merged = nullptr;
+					for (auto& h : handlers)
+					{
+						if (h.msgId == msgId)
+						{
+							merged = &h;
+							break;
+						}
+					}
+					if (!merged)
+					{
+						handlers.push_back(HandlerSnapshot());
+						merged = &handlers.back();
+						merged->msgId = msgId;
+					}
+					merged->count += count;
+					merged->total_ns += handler.total_ns.load(std::memory_order_relaxed);
+					const uint64 max = handler.max_ns.load(std::memory_order_relaxed);
+					if (max > merged->max_ns)
+						merged->max_ns = max;
+				}
+			}
+			snapshot.handlers = std::move(handlers);
+			return snapshot;
+		}
+
+		static std::string Text()
+		{
+			return Snapshot().ToText();
+		}
+
+		static std::string Json()
+		{
+			return Snapshot().ToJson();
+		}
+
+		// msgId reported for handlers past the per thread table
+		static constexpr int overflow_id = -2147483647 - 1;
+
+	private:
+		// the count is the sum of the buckets
+		struct Cells
+		{
+			std::atomic<uint64> sum = { 0 };
+			std::atomic<uint64> max = { 0 };
+			std::atomic<uint64> bucket[HistogramSnapshot::buckets] = {};
+		};
+
+		struct Handler
+		{
+			std::atomic<int> msgId = { 0 };
+			std::atomic<bool> used = { false };
+			std::atomic<uint64> count = { 0 };
+			std::atomic<uint64> total_ns = { 0 };
+			std::atomic<uint64> max_ns = { 0 };
+		};
+
+		struct alignas(64) Shard
+		{
+			std::atomic<uint64> counters[static_cast<int>(Metric::Count)] = {};
+			Cells histograms[static_cast<int>(Histogram::Count)];
+			// open addressing by msgId, the last one takes what does not fit
+			Handler handlers[handler_slots + 1];
+			uint32 tick = { 0 };
+			bool owned = { false };
+
+			Handler& find(int msgId)
+			{
+				uint32 index = (static_cast<uint32>(msgId) * 0x9E3779B1u) >> (32 - 10);
+				for (int probe = 0; probe < 16; ++probe)
+				{
+					Handler& handler = this->handlers[index];
+					if (!handler.used.load(std::memory_order_relaxed))
+					{
+						handler.msgId.store(msgId, std::memory_order_relaxed);
+						handler.used.store(true, std::memory_order_release);
+						return handler;
+					}
+					if (handler.msgId.load(std::memory_order_relaxed) == msgId)
+						return handler;
+					index = (index + 1) & (handler_slots - 1);
+				}
+				return this->handlers[handler_slots];
+			}
+		};
+		static_assert(handler_slots == 1 << 10, "find() hashes to 10 bits");
+
+		struct Registry
+		{
+			std::mutex mutex;
+			std::vector<std::unique_ptr<Shard>> shards;
+		};
+
+		// hands the shard back when its thread exits
+		struct Owner
+		{
+			Shard* shard = { nullptr };
+
+			~Owner()
+			{
+				if (this->shard)
+				{
+					std::lock_guard lock(registry().mutex);
+					this->shard->owned = false;
+				}
+			}
+		};
+
+		static Registry& registry()
+		{
+			static Registry* registry = new Registry(); // outlives exiting threads
+			return *registry;
+		}
+
+		static std::atomic<uint32>& sampling()
+		{
+			static std::atomic<uint32> every = { default_sampling };
+			return every;
+		}
+
+		// a plain pointer first, it needs no thread_local init guard
+		static Shard& shard()
+		{
+			static thread_local Shard* cached = nullptr;
+			if (cached)
+				return *cached;
+			cached = &attach();
+			return *cached;
+		}
+
+		static Shard& attach()
+		{
+			static thread_local Owner owner;
+			if (owner.shard)
+				return *owner.shard;
+			Registry& registry = Metrics::registry();
+			std::lock_guard lock(registry.mutex);
+			for (const auto& s : registry.shards)
+			{
+				if (!s->owned)
+				{
+					owner.shard = s.get();
+					break;
+				}
+			}
+			if (!owner.shard)
+			{
+				registry.shards.push_back(std::make_unique<Shard>());
+				owner.shard = registry.shards.back().get();
+			}
+			owner.shard->owned = true;
+			return *owner.shard;
+		}
+
+		// single writer per shard, a load and a store is enough
+		static void bump(std::atomic<uint64>& cell, uint64 value)
+		{
+			cell.store(cell.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		}
+
+		// bit length of value, capped at the last bucket
+		static int bucket(uint64 value)
+		{
+			if (value == 0)
+				return 0;
+#if defined(__GNUC__) || defined(__clang__)
+			const int b = 64 - __builtin_clzll(value);
+#else
+			int b = 0;
+			while (value)
+			{
+				value >>= 1;
+				++b;
+			}
+#endif
+			return b < HistogramSnapshot::buckets ? b : HistogramSnapshot::buckets - 1;
+		}
+	};
+
+	// HandlerTimer
+	// Times the scope for msgId when this message is sampled.
+	class HandlerTimer
+	{
+	public:
+		explicit HandlerTimer(int msgId)
+			: msgId_(msgId)
+			, start_(Metrics::Sample() ? Metrics::Now() : 0)
+		{
+		}
+
+		~HandlerTimer()
+		{
+			if (this->start_)
+			{
+				Metrics::RecordHandler(this->msgId_, Metrics::Now() - this->start_);
+			}
+		}
+
+		HandlerTimer(const HandlerTimer&) = delete;
+		HandlerTimer& operator=(const HandlerTimer&) = delete;
+
+	private:
+		int msgId_;
+		uint64 start_;
+	};
+
+}
+
+#endif // __METRICS_HPP__
@@ -0,0 +1,394 @@
+//
+// msg_dispatch.hpp
+// flat msgId -> handler table with typed payload views
+//
+
+#ifndef __MSG_DISPATCH_HPP__
+#define __MSG_DISPATCH_HPP__
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <asio/extend/base.hpp>
+#include <asio/msgdef/message.hpp>
+
+namespace asio {
+
+	class NetObject;
+
+	// MsgView read only view of one received frame
+	struct MsgView
+	{
+		const MsgHeader* header = { nullptr };
+		const char* body = { nullptr };
+		int length = { 0 }; // body bytes
+
+		MsgView() = default;
+		explicit MsgView(const Message& msg)
+			: header(reinterpret_cast<const MsgHeader*>(msg.data()))
+			, body(msg.body())
+			, length(msg.body_length())
+		{
+		}
+
+		int msgId() const { return header->msgId; }
+	};
+
+	// MsgDecoder<T>
+	// Turns a body into a T for typed handlers. Trivially copyable structs
+	// are taken as is when the size matches; specialise it for protobuf or
+	// any other encoding.
+	template <typename T, typename = void>
+	struct MsgDecoder
+	{
+		static bool decode(const MsgView& view, T& out)
+		{
+			static_assert(std::is_trivially_copyable<T>::value,
+				"specialise asio::MsgDecoder<T> for non trivially copyable bodies");
+			if (view.length != static_cast<int>(sizeof(T)))
+				return false;
+			std::memcpy(&out, view.body, sizeof(T));
+			return true;
+		}
+	};
+
+	namespace detail_msg {
+
+		template <typename F> struct handler_traits;
+
+		// void (*)(NetObject*, const MsgView&)
+		template <>
+		struct handler_traits<void (*)(NetObject*, const MsgView&)>
+		{
+			typedef void class_type;
+			template <auto F>
+			static bool call(void*, NetObject* obj, const MsgView& view) { F(obj, view); return true; }
+		};
+
+		// void (*)(NetObject*, const T&)
+		template <typename T>
+		struct handler_traits<void (*)(NetObject*, const T&)>
+		{
+			typedef void class_type;
+			template <auto F>
+			static bool call(void*, NetObject* obj, const MsgView& view)
+			{
+				T body;
+				if (!MsgDecoder<T>::decode(view, body))
+					return false;
+				F(obj, body);
+				return true;
+			}
+		};
+
+		// void (C::*)(NetObject*, const MsgView&)
+		template <typename C>
+		struct handler_traits<void (C::*)(NetObject*, const MsgView&)>
+		{
+			typedef C class_type;
+			template <auto F>
+			static bool call(void* ctx, NetObject* obj, const MsgView& view)
+			{
+				(static_cast<C*>(ctx)->*F)(obj, view);
+				return true;
+			}
+		};
+
+		// void (C::*)(NetObject*, const T&)
+		template <typename C, typename T>
+		struct handler_traits<void (C::*)(NetObject*, const T&)>
+		{
+			typedef C class_type;
+			template <auto F>
+			static bool call(void* ctx, NetObject* obj, const MsgView& view)
+			{
+				T body;
+				if (!MsgDecoder<T>::decode(view, body))
+					return false;
+				(static_cast<C*>(ctx)->*F)(obj, body);
+				return true;
+			}
+		};
+
+	}
+
+	// MsgDelegate
+	// Non owning handler: a context pointer and a trampoline, two words,
+	// never allocates and is copied by value. Returns false when the body
+	// does not decode.
+	class MsgDelegate
+	{
+	public:
+		typedef bool (*Trampoline)(void*, NetObject*, const MsgView&);
+
+		MsgDelegate() = default;
+		MsgDelegate(void* ctx, Trampoline fn) : ctx_(ctx), fn_(fn) {}
+
+		// free function, plain or typed
+		template <auto F>
+		static MsgDelegate Bind()
+		{
+			return MsgDelegate(nullptr, &detail_msg::handler_traits<decltype(F)>::template call<F>);
+		}
+
+		// member function of obj, which must outlive the table
+		template <auto F, typename C>
+		static MsgDelegate Bind(C* obj)
+		{
+			typedef typename detail_msg::handler_traits<decltype(F)>::class_type Class;
+			static_assert(std::is_base_of<Class, C>::value, "handler is not a member of this object");
+			return MsgDelegate(static_cast<Class*>(obj), &detail_msg::handler_traits<decltype(F)>::template call<F>);
+		}
+
+		bool operator()(NetObject* obj, const MsgView& view) const
+		{
+			return this->fn_(this->ctx_, obj, view);
+		}
+
+		explicit operator bool() const
+		{
+			return this->fn_ != nullptr;
+		}
+
+	private:
+		void* ctx_ = { nullptr };
+		Trampoline fn_ = { nullptr };
+	};
+
+	// MsgRoute<Id, F> one compile time entry for StaticMsgTable
+	template <int Id, auto F>
+	struct MsgRoute
+	{
+		static constexpr int id = Id;
+		static bool call(NetObject* obj, const MsgView& view)
+		{
+			return detail_msg::handler_traits<decltype(F)>::template call<F>(nullptr, obj, view);
+		}
+	};
+
+	// StaticMsgTable
+	// Free function routes known at build time, laid out as a constant
+	// array over [MinId, MaxId]; Dispatch is one bounds check and one
+	// indirect call.
+	template <int MinId, int MaxId, typename... Routes>
+	class StaticMsgTable
+	{
+	public:
+		typedef bool (*Fn)(NetObject*, const MsgView&);
+		static constexpr int min_id = MinId;
+		static constexpr int max_id = MaxId;
+
+		static_assert(MinId <= MaxId, "empty id range");
+		static_assert(((Routes::id >= MinId && Routes::id <= MaxId) && ...), "route id out of range");
+
+		static bool Dispatch(NetObject* obj, const MsgView& view)
+		{
+			const int id = view.msgId();
+			if (id < MinId || id > MaxId)
+				return false;
+			const Fn fn = table[static_cast<std::size_t>(id - MinId)];
+			return fn ? fn(obj, view) : false;
+		}
+
+		// f(int id, MsgDelegate) for every route
+		template <typename Function>
+		static void ForEach(Function&& f)
+		{
+			(f(Routes::id, MsgDelegate(nullptr, &route_thunk<Routes>)), ...);
+		}
+
+	private:
+		static constexpr std::array<Fn, MaxId - MinId + 1> make()
+		{
+			std::array<Fn, MaxId - MinId + 1> fns = {};
+			((fns[static_cast<std::size_t>(Routes::id - MinId)] = &Routes::call), ...);
+			return fns;
+		}
+
+		template <typename Route>
+		static bool route_thunk(void*, NetObject* obj, const MsgView& view)
+		{
+			return Route::call(obj, view);
+		}
+
+		static constexpr std::array<Fn, MaxId - MinId + 1> table = make();
+	};
+
+	// per id counters, updated with relaxed atomics by any worker
+	struct MsgStats
+	{
+		std::atomic<uint64> calls = { 0 };
+		std::atomic<uint64> failures = { 0 }; // body did not decode
+		std::atomic<uint64> total_ns = { 0 };
+		std::atomic<uint64> max_ns = { 0 };
+	};
+
+	// MsgDispatcher
+	// Ids in [0, dense_limit) index a vector directly; the rare ids outside
+	// it live in a sorted vector searched by bisection. Bind everything
+	// during Init, before the first Dispatch; dispatching itself is lock
+	// free and safe from any number of workers.
+	class MsgDispatcher
+	{
+	public:
+		static constexpr int dense_limit = 1 << 16;
+
+		MsgDispatcher() = default;
+		MsgDispatcher(const MsgDispatcher&) = delete;
+		MsgDispatcher& operator=(const MsgDispatcher&) = delete;
+
+		// false when msgId is already bound
+		bool Bind(const int msgId, MsgDelegate handler)
+		{
+			if (!handler)
+				return false;
+			Entry* entry = this->entry(msgId);
+			if (entry && entry->handler)
+				return false;
+			if (!entry)
+				entry = this->insert(msgId);
+			if (!entry->stats)
+				entry->stats.reset(new MsgStats);
+			entry->handler = handler;
+			return true;
+		}
+
+		template <auto F>
+		bool Bind(const int msgId)
+		{
+			return this->Bind(msgId, MsgDelegate::Bind<F>());
+		}
+
+		template <auto F, typename C>
+		bool Bind(const int msgId, C* obj)
+		{
+			return this->Bind(msgId, MsgDelegate::Bind<F>(obj));
+		}
+
+		// every route of a StaticMsgTable, stats included
+		template <typename Table>
+		void BindTable()
+		{
+			Table::ForEach([this](int id, MsgDelegate handler) { this->Bind(id, handler); });
+		}
+
+		// false when nothing is bound to the id or the body did not decode
+		bool Dispatch(NetObject* obj, const Message& msg)
+		{
+			return this->Dispatch(obj, MsgView(msg));
+		}
+
+		bool Dispatch(NetObject* obj, const MsgView& view)
+		{
+			Entry* entry = this->entry(view.msgId());
+			if (!entry || !entry->handler)
+				return false;
+			if (!this->profile_)
+				return entry->handler(obj, view);
+			const auto start = std::chrono::steady_clock::now();
+			const bool ok = entry->handler(obj, view);
+			const uint64 ns = static_cast<uint64>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start).count());
+			MsgStats& stats = *entry->stats;
+			stats.calls.fetch_add(1, std::memory_order_relaxed);
+			if (!ok)
+				stats.failures.fetch_add(1, std::memory_order_relaxed);
+			stats.total_ns.fetch_add(ns, std::memory_order_relaxed);
+			uint64 seen = stats.max_ns.load(std::memory_order_relaxed);
+			while (ns > seen && !stats.max_ns.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+			{
+			}
+			return ok;
+		}
+
+		bool Contains(const int msgId) const
+		{
+			const Entry* entry = this->entry(msgId);
+			return entry && entry->handler;
+		}
+
+		// timing costs two clock reads per message, on by default
+		void SetProfiling(bool enable)
+		{
+			this->profile_ = enable;
+		}
+
+		const MsgStats* Stats(const int msgId) const
+		{
+			const Entry* entry = this->entry(msgId);
+			return entry && entry->handler ? entry->stats.get() : nullptr;
+		}
+
+		// f(int msgId, const MsgStats&) for every bound id
+		template <typename Function>
+		void ForEachStats(Function&& f) const
+		{
+			for (std::size_t i = 0; i < this->dense_.size(); ++i)
+			{
+				if (this->dense_[i].handler)
+					f(static_cast<int>(i), *this->dense_[i].stats);
+			}
+			for (const auto& it : this->sparse_)
+			{
+				f(it.first, *it.second.stats);
+			}
+		}
+
+	private:
+		struct Entry
+		{
+			MsgDelegate handler;
+			std::unique_ptr<MsgStats> stats;
+		};
+
+		const Entry* entry(const int msgId) const
+		{
+			if (msgId >= 0 && msgId < dense_limit)
+			{
+				const std::size_t index = static_cast<std::size_t>(msgId);
+				return index < this->dense_.size() ? &this->dense_[index] : nullptr;
+			}
+			auto it = std::lower_bound(this->sparse_.begin(), this->sparse_.end(), msgId,
+				[](const std::pair<int, Entry>& item, int id) { return item.first < id; });
+			return (it != this->sparse_.end() && it->first == msgId) ? &it->second : nullptr;
+		}
+
+		Entry* entry(const int msgId)
+		{
+			return const_cast<Entry*>(static_cast<const MsgDispatcher*>(this)->entry(msgId));
+		}
+
+		Entry* insert(const int msgId)
+		{
+			Entry* entry;
+			if (msgId >= 0 && msgId < dense_limit)
+			{
+				const std::size_t index = static_cast<std::size_t>(msgId);
+				if (index >= this->dense_.size())
+					this->dense_.resize(index + 1);
+				entry = &this->dense_[index];
+			}
+			else
+			{
+				auto it = std::lower_bound(this->sparse_.begin(), this->sparse_.end(), msgId,
+					[](const std::pair<int, Entry>& item, int id) { return item.first < id; });
+				entry = &this->sparse_.emplace(it, msgId, Entry())->second;
+			}
+			return entry;
+		}
+
+	private:
+		std::vector<Entry> dense_;
+		std::vector<std::pair<int, Entry>> sparse_;
+		bool profile_ = { true };
+	};
+
+}
+
+#endif // __MSG_DISPATCH_HPP__
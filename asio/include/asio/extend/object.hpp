@@ -1,10 +1,13 @@
 #ifndef __OBJECT_HPP__
 #define __OBJECT_HPP__
 #include <asio/msgdef/message.hpp>
+#include <asio/msgdef/payload.hpp>
 #include <asio/extend/base.hpp>
+#include <asio/extend/backpressure.hpp>
+#include <asio/extend/framing.hpp>
 #include <asio/extend/snowflake.hpp>
 #include <mutex>
-using SnowFlake = snowflake<1534832906275L, std::mutex>;
+using SnowFlake = snowflake_atomic<1534832906275L>;
 #include <functional>
 #include <unordered_map>
 #include <memory>
@@ -12,9 +15,12 @@ using SnowFlake = snowflake<1534832906275L, std::mutex>;
 #include <map>
 #include <cassert>
 #include <optional>
+#include <chrono>
 
 namespace asio {
 
+	class io_context;
+
 	// NetGroup interface
 	//--------------------------------------------------------------
 	// NetObject
@@ -41,6 +47,44 @@ namespace asio {
 		}
 		virtual void Send(const Message& msg) { assert(!"virtual function."); }
 		virtual void Post(const Message& msg) { assert(!"virtual function."); }
+		// queue an already encoded payload without copying it; sessions
+		// without a shared write queue fall back to a private copy of every
+		// frame the payload holds
+		virtual void PostShared(const PayloadPtr& payload)
+		{
+			const char* data = payload->data();
+			int left = payload->length();
+			while (left >= Message::header_length)
+			{
+				Message msg;
+				std::memcpy(msg.data(), data, Message::header_length);
+				if (!msg.decode_header() || msg.length() > left)
+				{
+					break;
+				}
+				std::memcpy(msg.body(), data + Message::header_length, msg.body_length());
+				this->Post(msg);
+				data += msg.length();
+				left -= msg.length();
+			}
+		}
+		// shared payload with a drop priority for BackpressurePolicy::Drop
+		virtual void PostPriority(const PayloadPtr& payload, uint8 priority)
+		{
+			this->PostShared(payload);
+		}
+		// outbound byte watermarks and the policy above the high one
+		virtual void SetWatermarks(const WatermarkOptions& options) {}
+		// false while the output queue is above its high watermark
+		virtual bool Writable() { return true; }
+		virtual uint64 SocketId() { return 0; }
+		// io_context the session runs on, null when unknown
+		virtual asio::io_context* Context() { return nullptr; }
+		// queued output bytes not written yet
+		virtual std::size_t PendingBytes() { return 0; }
+		// drop the oldest unsent output until at most keepBytes remain,
+		// returns the bytes dropped
+		virtual std::size_t DropPending(std::size_t keepBytes) { return 0; }
 		virtual std::string Ip()   { return ""; }
 		virtual std::string Port() { return ""; }
 		// disconnect
@@ -171,6 +215,9 @@ namespace asio {
 		virtual void HandleMessage(NetObjectPtr pNetObj, const Message& msg)= 0;
 		virtual void Reconnect(NetObjectPtr pNetObj) {}
 		virtual void Error(int error) {}
+		// output queue crossed its high / low watermark
+		virtual void HighWatermark(NetObjectPtr pNetObj) {}
+		virtual void LowWatermark(NetObjectPtr pNetObj) {}
 	};
 
 	//--------------------------------------------------------------
@@ -184,7 +231,49 @@ namespace asio {
 		virtual void Disconnect(NetObjectPtr pNetObj) = 0;
 		virtual void HandleMessage(NetObjectPtr pNetObj, const Message& msg)= 0;
 		virtual void Error(int error)                 = 0;
+		// hand a received message over to worker threads, runs it inline by default
+		virtual void PostMsg(const Message& msg)
+		{
+			this->HandleMessage(msg.getNetObject().lock(), msg);
+		}
+		// same with the message block handed over, sessionId keys the order
+		virtual void PostMsg(const uint64 sessionId, Message&& msg)
+		{
+			this->PostMsg(msg);
+		}
+		// a session output queue crossed its high / low watermark, called
+		// from the writer or the I/O thread so game logic can throttle it
+		virtual void HighWatermark(NetObjectPtr pNetObj) {}
+		virtual void LowWatermark(NetObjectPtr pNetObj) {}
 	public:
+		// watermarks given to every new session
+		void SetWatermarks(const WatermarkOptions& options)
+		{
+			this->watermarks_ = options;
+		}
+		const WatermarkOptions& Watermarks() const
+		{
+			return this->watermarks_;
+		}
+		// close sessions that receive nothing for this long, 0 never;
+		// applies to sessions started afterwards
+		void SetIdleTimeout(std::chrono::milliseconds timeout)
+		{
+			this->idle_timeout_ = timeout;
+		}
+		std::chrono::milliseconds IdleTimeout() const
+		{
+			return this->idle_timeout_;
+		}
+		// best framing a client may switch its connection to
+		void SetFraming(Framing framing)
+		{
+			this->framing_ = framing;
+		}
+		Framing AllowedFraming() const
+		{
+			return this->framing_;
+		}
 		// Server ID card
 		const int MainId() const
 		{
@@ -231,13 +320,18 @@ namespace asio {
 		int main_id_; // app id
 		int sub_id_;
 		bool is_pack_session_id_;
+		WatermarkOptions watermarks_;
+		Framing framing_ = { Framing::Standard };
+		std::chrono::milliseconds idle_timeout_ = { std::chrono::milliseconds(0) };
 	private:
-		// guid snowflake
+		// guid snowflake, one CAS per id
 		SnowFlake uuid_;
 	};
 
 	//--------------------------------------------------------------
 	// Dispatcher
+	// std::function table kept for existing callers, MsgDispatcher in
+	// msg_dispatch.hpp is the allocation free replacement
 	class Dispatcher
 	{
 	public:
@@ -262,14 +356,16 @@ namespace asio {
 			return m_taskList;
 		}
 
-		Task FindCallback(const int &key)
+		// by reference, an empty Task when nothing is bound
+		const Task& FindCallback(const int &key) const
 		{
+			static const Task none;
 			auto it = m_taskList.find(key);
 			if (it != m_taskList.end())
 			{
 				return it->second;
 			}
-			return nullptr;
+			return none;
 		}
 	private:
 		TaskMap m_taskList;
@@ -1,6 +1,9 @@
 #ifndef RANDOM_HPP
 #define RANDOM_HPP
  
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <random>
  
 namespace details
@@ -69,6 +72,41 @@ private:
     Random(const Random&) = delete;
     Random& operator = (const Random&) = delete;
 };
+
+/// Per thread splitmix64 for hot paths such as load balancing and jitter.
+/// Not for anything that must be unpredictable.
+class FastRandom
+{
+public:
+    static uint64_t next()
+    {
+        thread_local uint64_t state = seed();
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    /// uniform in [0, bound), bound > 0
+    static uint32_t below(uint32_t bound)
+    {
+        return static_cast<uint32_t>(((next() >> 32) * bound) >> 32);
+    }
+
+    /// uniform in [0, 1)
+    static double unit()
+    {
+        return static_cast<double>(next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+    static uint64_t seed()
+    {
+        static std::atomic<uint64_t> counter{ 0 };
+        return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count())
+            ^ (counter.fetch_add(1, std::memory_order_relaxed) * 0xD1B54A32D192ED03ull);
+    }
+};
  
 #endif // RANDOM_HPP
 
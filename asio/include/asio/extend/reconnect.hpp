@@ -0,0 +1,94 @@
+//
+// reconnect.hpp
+// backoff schedule for client links that reconnect on their own
+//
+
+#ifndef __RECONNECT_HPP__
+#define __RECONNECT_HPP__
+#include <chrono>
+#include <cstdint>
+#include <asio/extend/base.hpp>
+#include <asio/extend/random.hpp>
+
+namespace asio {
+
+	struct ReconnectOptions
+	{
+		std::chrono::milliseconds initial_delay   = std::chrono::milliseconds(500);
+		std::chrono::milliseconds max_delay       = std::chrono::seconds(30);
+		double multiplier                         = 2.0;
+		double jitter                             = 0.2; // each delay moves by up to this share either way
+		std::chrono::milliseconds connect_timeout = std::chrono::seconds(10); // 0 leaves it to the OS
+		int resolve_after                         = 3;   // failed attempts between fresh resolves, 0 never
+	};
+
+	// ReconnectBackoff
+	// Exponential delays between connect attempts. The jitter keeps dozens
+	// of links that lost the same backend from coming back in lock step.
+	// Used from one I/O thread.
+	class ReconnectBackoff
+	{
+	public:
+		explicit ReconnectBackoff(const ReconnectOptions& options = ReconnectOptions())
+			: options_(options)
+		{
+		}
+
+		void set_options(const ReconnectOptions& options)
+		{
+			this->options_ = options;
+		}
+
+		const ReconnectOptions& options() const
+		{
+			return this->options_;
+		}
+
+		// delay before the next attempt, longer with every call until reset()
+		std::chrono::milliseconds next()
+		{
+			const double initial = static_cast<double>(this->options_.initial_delay.count());
+			const double ceiling = static_cast<double>(this->options_.max_delay.count());
+			double delay = this->attempts_ == 0 ? initial : this->delay_ * this->options_.multiplier;
+			if (delay > ceiling)
+				delay = ceiling;
+			if (delay < 1.0)
+				delay = 1.0;
+			this->delay_ = delay;
+			++this->attempts_;
+			double jittered = delay * (1.0 + this->options_.jitter * (2.0 * FastRandom::unit() - 1.0));
+			if (jittered > ceiling)
+				jittered = ceiling;
+			if (jittered < 1.0)
+				jittered = 1.0;
+			return std::chrono::milliseconds(static_cast<int64_t>(jittered));
+		}
+
+		// the link is up again
+		void reset()
+		{
+			this->attempts_ = 0;
+			this->delay_ = 0.0;
+		}
+
+		int attempts() const
+		{
+			return this->attempts_;
+		}
+
+		// true when the cached endpoints have failed resolve_after times in a row
+		bool should_resolve() const
+		{
+			return this->options_.resolve_after > 0 && this->attempts_ > 0
+				&& this->attempts_ % this->options_.resolve_after == 0;
+		}
+
+	private:
+		ReconnectOptions options_;
+		int attempts_ = { 0 };
+		double delay_ = { 0.0 };
+	};
+
+}
+
+#endif // __RECONNECT_HPP__
@@ -0,0 +1,594 @@
+//
+// rpc.hpp
+// pipelined request / response calls over one connection
+//
+
+#ifndef __RPC_HPP__
+#define __RPC_HPP__
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <asio/any_io_executor.hpp>
+#include <asio/append.hpp>
+#include <asio/associated_executor.hpp>
+#include <asio/async_result.hpp>
+#include <asio/dispatch.hpp>
+#include <asio/error.hpp>
+#include <asio/post.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/extend/base.hpp>
+#include <asio/msgdef/message.hpp>
+
+namespace asio {
+
+	// Rpc
+	// A call is an ordinary frame with eRequest or eResponse set in the high
+	// bits of MsgHeader::format, next to its ProtoFormat, and a body that
+	// starts with the 4 byte little endian call id the response echoes.
+	// msgId, sId and the rest of the header stay the application's, so
+	// gateways, compact framing, compression and FrameCrc all pass calls
+	// through unchanged.
+	struct Rpc
+	{
+		enum Kind : uint8
+		{
+			eRequest  = 0x40,
+			eResponse = 0x80,
+			eKindMask = 0xC0,
+		};
+
+		static constexpr int prefix_length = 4;
+
+		static bool IsRequest(const Message& msg)
+		{
+			return (header(msg).format & eKindMask) == eRequest && msg.body_length() >= prefix_length;
+		}
+
+		static bool IsResponse(const Message& msg)
+		{
+			return (header(msg).format & eKindMask) == eResponse && msg.body_length() >= prefix_length;
+		}
+
+		static uint32 CallId(const Message& msg)
+		{
+			uint32 id = 0;
+			for (int i = 0; i < prefix_length; ++i)
+				id |= static_cast<uint32>(static_cast<uint8>(msg.body()[i])) << (8 * i);
+			return id;
+		}
+
+		// the application body of a request, after the call id
+		static const char* Body(const Message& msg)
+		{
+			return msg.body() + prefix_length;
+		}
+
+		static int BodyLength(const Message& msg)
+		{
+			return msg.body_length() - prefix_length;
+		}
+
+		// msg as a call frame of kind carrying id, in out
+		static void Frame(const Message& msg, Kind kind, uint32 id, Message& out)
+		{
+			const int body = msg.body_length();
+			out.body_length(body + prefix_length);
+			MsgHeader head = header(msg);
+			head.body_len = body + prefix_length;
+			head.format = static_cast<uint8>((head.format & ~eKindMask) | kind);
+			out.encode_header(head);
+			SetCallId(out, id);
+			if (body > 0)
+			{
+				std::memcpy(out.body() + prefix_length, msg.body(), body);
+			}
+		}
+
+		static void SetCallId(Message& msg, uint32 id)
+		{
+			for (int i = 0; i < prefix_length; ++i)
+				msg.body()[i] = static_cast<char>(id >> (8 * i));
+		}
+
+		// back to the plain message the peer framed
+		static void Strip(Message& msg)
+		{
+			const int body = BodyLength(msg);
+			std::memmove(msg.body(), msg.body() + prefix_length, body);
+			MsgHeader* head = reinterpret_cast<MsgHeader*>(msg.data());
+			head->body_len = body;
+			head->format = static_cast<uint8>(head->format & ~eKindMask);
+			msg.body_length(body);
+		}
+
+	private:
+		static const MsgHeader& header(const Message& msg)
+		{
+			return *reinterpret_cast<const MsgHeader*>(msg.data());
+		}
+	};
+
+	// RpcHandler
+	// Type erased completion handler of one call, stored inline in its table
+	// slot when it fits. Completes on the handler's associated executor.
+	class RpcHandler
+	{
+	public:
+		static constexpr std::size_t inline_size = 64;
+
+		RpcHandler() noexcept = default;
+
+		template <class H, class = typename std::enable_if<
+			!std::is_same<typename std::decay<H>::type, RpcHandler>::value>::type>
+		explicit RpcHandler(H&& h)
+		{
+			using T = typename std::decay<H>::type;
+			if constexpr (fits<T>())
+			{
+				new (&this->buf_) T(std::forward<H>(h));
+				this->ops_ = &inline_ops<T>;
+			}
+			else
+			{
+				*reinterpret_cast<T**>(&this->buf_) = new T(std::forward<H>(h));
+				this->ops_ = &heap_ops<T>;
+			}
+		}
+
+		RpcHandler(RpcHandler&& other) noexcept
+		{
+			this->take(other);
+		}
+
+		RpcHandler& operator=(RpcHandler&& other) noexcept
+		{
+			if (this != &other)
+			{
+				this->reset();
+				this->take(other);
+			}
+			return *this;
+		}
+
+		RpcHandler(const RpcHandler&) = delete;
+		RpcHandler& operator=(const RpcHandler&) = delete;
+
+		~RpcHandler()
+		{
+			this->reset();
+		}
+
+		// consumes the handler, posts it when called from an initiating
+		// function so it never runs inside one
+		void complete(const asio::any_io_executor& ex, std::error_code ec, Message&& msg, bool defer = false)
+		{
+			const Ops* ops = this->ops_;
+			this->ops_ = nullptr;
+			ops->complete(&this->buf_, ex, ec, std::move(msg), defer);
+		}
+
+		explicit operator bool() const noexcept
+		{
+			return this->ops_ != nullptr;
+		}
+
+		void reset() noexcept
+		{
+			if (this->ops_)
+			{
+				this->ops_->destroy(&this->buf_);
+				this->ops_ = nullptr;
+			}
+		}
+
+	private:
+		struct Ops
+		{
+			// leaves the handler destroyed
+			void (*complete)(void*, const asio::any_io_executor&, std::error_code, Message&&, bool defer);
+			void (*move)(void* dst, void* src) noexcept;
+			void (*destroy)(void*) noexcept;
+		};
+
+		template <class T>
+		static constexpr bool fits()
+		{
+			return sizeof(T) <= inline_size && alignof(T) <= alignof(std::max_align_t)
+				&& std::is_nothrow_move_constructible<T>::value;
+		}
+
+		template <class T>
+		static void invoke(T&& h, const asio::any_io_executor& ex, std::error_code ec, Message&& msg, bool defer)
+		{
+			auto target = asio::get_associated_executor(h, ex);
+			if (defer)
+				asio::post(target, asio::append(std::move(h), ec, std::move(msg)));
+			else
+				asio::dispatch(target, asio::append(std::move(h), ec, std::move(msg)));
+		}
+
+		template <class T>
+		static constexpr Ops inline_ops = {
+			[](void* p, const asio::any_io_executor& ex, std::error_code ec, Message&& msg, bool defer) {
+				T h(std::move(*static_cast<T*>(p)));
+				static_cast<T*>(p)->~T();
+				invoke(std::move(h), ex, ec, std::move(msg), defer);
+			},
+			[](void* dst, void* src) noexcept {
+				new (dst) T(std::move(*static_cast<T*>(src)));
+				static_cast<T*>(src)->~T();
+			},
+			[](void* p) noexcept { static_cast<T*>(p)->~T(); },
+		};
+
+		template <class T>
+		static constexpr Ops heap_ops = {
+			[](void* p, const asio::any_io_executor& ex, std::error_code ec, Message&& msg, bool defer) {
+				std::unique_ptr<T> h(*static_cast<T**>(p));
+				invoke(std::move(*h), ex, ec, std::move(msg), defer);
+			},
+			[](void* dst, void* src) noexcept { *static_cast<T**>(dst) = *static_cast<T**>(src); },
+			[](void* p) noexcept { delete *static_cast<T**>(p); },
+		};
+
+		void take(RpcHandler& other) noexcept
+		{
+			if (other.ops_)
+			{
+				other.ops_->move(&this->buf_, &other.buf_);
+				this->ops_ = other.ops_;
+				other.ops_ = nullptr;
+			}
+		}
+
+		alignas(std::max_align_t) unsigned char buf_[inline_size];
+		const Ops* ops_ = nullptr;
+	};
+
+	// RpcChannel
+	// Pending calls of one connection. Calls live in a fixed table of slots
+	// allocated on the first call; a call id is the slot index in the low 16
+	// bits and the slot generation in the high 16, so a late response to a
+	// reused slot is recognised and dropped. Deadlines sit in one min heap
+	// behind one steady_timer armed for the earliest of them; completed
+	// calls leave their heap entry behind and it is skipped when it comes
+	// up. async_call may run on any thread, complete() and cancel() run on
+	// the I/O thread of the connection.
+	class RpcChannel
+	{
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		static constexpr uint32 default_capacity = 1024;
+		static constexpr uint32 max_capacity     = 65536;
+
+		explicit RpcChannel(const asio::any_io_executor& ex, uint32 capacity = default_capacity)
+			: executor_(ex)
+			, capacity_(std::min(std::max<uint32>(capacity, 1), max_capacity))
+		{
+		}
+
+		~RpcChannel()
+		{
+			if (Core* core = this->ready_.load(std::memory_order_acquire))
+			{
+				core->shutdown();
+			}
+		}
+
+		RpcChannel(const RpcChannel&) = delete;
+		RpcChannel& operator=(const RpcChannel&) = delete;
+
+		// calls in flight at once, before the first call
+		void set_capacity(uint32 capacity)
+		{
+			this->capacity_ = std::min(std::max<uint32>(capacity, 1), max_capacity);
+		}
+
+		// Frames request, hands the frame to send(const Message&), which
+		// returns false when the link is down, and completes token with
+		// (error_code, Message) once the response arrives. The response is
+		// stripped back to a plain message. Errors: timed_out after timeout
+		// (0 waits forever), not_connected, no_buffer_space when capacity
+		// calls are in flight, connection_aborted or operation_aborted.
+		template <typename Send, typename Token>
+		auto async_call(const Message& request, std::chrono::milliseconds timeout, Send&& send, Token&& token)
+		{
+			Message frame;
+			Rpc::Frame(request, Rpc::eRequest, 0, frame);
+			return asio::async_initiate<Token, void(std::error_code, Message)>(
+				[core = this->core(), timeout](auto handler, Message frame, auto send) mutable
+				{
+					uint32 id = 0;
+					if (!core->open(RpcHandler(std::move(handler)), timeout, id))
+					{
+						return;
+					}
+					Rpc::SetCallId(frame, id);
+					if (!send(static_cast<const Message&>(frame)))
+					{
+						core->finish(id, asio::error::not_connected);
+					}
+				}, token, std::move(frame), std::forward<Send>(send));
+		}
+
+		// routes a response to its call, consumes msg
+		void complete(Message& msg)
+		{
+			if (Core* core = this->ready_.load(std::memory_order_acquire))
+			{
+				core->complete(msg);
+			}
+		}
+
+		// fails every call in flight, the link went down
+		void cancel(std::error_code ec = asio::error::connection_aborted)
+		{
+			if (Core* core = this->ready_.load(std::memory_order_acquire))
+			{
+				core->cancel(ec);
+			}
+		}
+
+		// calls in flight
+		std::size_t pending() const
+		{
+			Core* core = this->ready_.load(std::memory_order_acquire);
+			return core ? core->pending() : 0;
+		}
+
+	private:
+		// shared with the timer and posted handlers, which may outlive the
+		// channel by a moment
+		class Core : public std::enable_shared_from_this<Core>
+		{
+		public:
+			Core(const asio::any_io_executor& ex, uint32 capacity)
+				: executor_(ex)
+				, timer_(ex)
+				, slots_(capacity)
+				, armed_(clock::time_point::max())
+			{
+				this->free_.reserve(capacity);
+				for (uint32 i = capacity; i > 0; --i)
+				{
+					this->free_.push_back(i - 1);
+				}
+				this->deadlines_.reserve(2 * static_cast<std::size_t>(capacity));
+			}
+
+			// false when the call completed at once with an error
+			bool open(RpcHandler&& handler, std::chrono::milliseconds timeout, uint32& id)
+			{
+				std::unique_lock lock(this->mutex_);
+				if (this->closed_ || this->free_.empty())
+				{
+					// decided under the lock, close() may run once it is released
+					const std::error_code ec = this->closed_ ? asio::error::operation_aborted : asio::error::no_buffer_space;
+					lock.unlock();
+					handler.complete(this->executor_, ec, Message(), true);
+					return false;
+				}
+				const uint32 index = this->free_.back();
+				this->free_.pop_back();
+				Slot& slot = this->slots_[index];
+				slot.handler = std::move(handler);
+				id = (static_cast<uint32>(slot.generation) << 16) | index;
+				++this->pending_;
+				if (timeout.count() > 0)
+				{
+					const clock::time_point at = clock::now() + timeout;
+					if (this->deadlines_.size() >= 2 * this->slots_.size())
+					{
+						this->purge();
+					}
+					this->deadlines_.push_back(Deadline{ at, id });
+					std::push_heap(this->deadlines_.begin(), this->deadlines_.end(), later);
+					if (at < this->armed_)
+					{
+						this->armed_ = at;
+						asio::post(this->executor_, [self = this->shared_from_this()]() { self->arm(); });
+					}
+				}
+				return true;
+			}
+
+			// from the initiating function, completes id with ec if it is still
+			// in flight
+			void finish(uint32 id, std::error_code ec)
+			{
+				RpcHandler handler;
+				{
+					std::lock_guard lock(this->mutex_);
+					if (!this->take(id, handler))
+						return;
+				}
+				handler.complete(this->executor_, ec, Message(), true);
+			}
+
+			void complete(Message& msg)
+			{
+				RpcHandler handler;
+				{
+					std::lock_guard lock(this->mutex_);
+					// a response after its deadline finds the slot moved on
+					if (!this->take(Rpc::CallId(msg), handler))
+						return;
+				}
+				Rpc::Strip(msg);
+				handler.complete(this->executor_, std::error_code(), std::move(msg));
+			}
+
+			void cancel(std::error_code ec)
+			{
+				for (uint32 index = 0; index < this->slots_.size(); ++index)
+				{
+					RpcHandler handler;
+					{
+						std::lock_guard lock(this->mutex_);
+						Slot& slot = this->slots_[index];
+						if (!slot.handler)
+							continue;
+						this->take((static_cast<uint32>(slot.generation) << 16) | index, handler);
+					}
+					handler.complete(this->executor_, ec, Message());
+				}
+			}
+
+			void shutdown()
+			{
+				{
+					std::lock_guard lock(this->mutex_);
+					this->closed_ = true;
+				}
+				this->cancel(asio::error::operation_aborted);
+				asio::post(this->executor_, [self = this->shared_from_this()]() { self->timer_.cancel(); });
+			}
+
+			std::size_t pending() const
+			{
+				std::lock_guard lock(this->mutex_);
+				return this->pending_;
+			}
+
+		private:
+			struct Slot
+			{
+				RpcHandler handler;
+				uint16 generation = { 1 };
+			};
+
+			struct Deadline
+			{
+				clock::time_point at;
+				uint32 id;
+			};
+
+			static bool later(const Deadline& a, const Deadline& b)
+			{
+				return a.at > b.at;
+			}
+
+			// under the lock, moves the handler of a live id out and frees its slot
+			bool take(uint32 id, RpcHandler& handler)
+			{
+				const uint32 index = id & 0xFFFF;
+				if (index >= this->slots_.size())
+					return false;
+				Slot& slot = this->slots_[index];
+				if (!slot.handler || slot.generation != static_cast<uint16>(id >> 16))
+					return false;
+				handler = std::move(slot.handler);
+				// 0 never names a live call
+				if (++slot.generation == 0)
+					slot.generation = 1;
+				this->free_.push_back(index);
+				--this->pending_;
+				return true;
+			}
+
+			bool live(uint32 id) const
+			{
+				const Slot& slot = this->slots_[id & 0xFFFF];
+				return slot.handler && slot.generation == static_cast<uint16>(id >> 16);
+			}
+
+			// under the lock, drops heap entries of completed calls
+			void purge()
+			{
+				auto end = std::remove_if(this->deadlines_.begin(), this->deadlines_.end(),
+					[this](const Deadline& d) { return !this->live(d.id); });
+				this->deadlines_.erase(end, this->deadlines_.end());
+				std::make_heap(this->deadlines_.begin(), this->deadlines_.end(), later);
+			}
+
+			// I/O thread, waits for the earliest deadline
+			void arm()
+			{
+				clock::time_point at;
+				{
+					std::lock_guard lock(this->mutex_);
+					if (this->closed_)
+						return;
+					at = this->deadlines_.empty() ? clock::time_point::max() : this->deadlines_.front().at;
+					this->armed_ = at;
+				}
+				if (at == clock::time_point::max())
+				{
+					this->timer_.cancel();
+					return;
+				}
+				this->timer_.expires_at(at);
+				this->timer_.async_wait([self = this->shared_from_this()](std::error_code ec)
+					{
+						if (ec != asio::error::operation_aborted)
+						{
+							self->expire();
+						}
+					});
+			}
+
+			void expire()
+			{
+				const clock::time_point now = clock::now();
+				for (;;)
+				{
+					RpcHandler handler;
+					{
+						std::lock_guard lock(this->mutex_);
+						if (this->deadlines_.empty() || this->deadlines_.front().at > now)
+							break;
+						const uint32 id = this->deadlines_.front().id;
+						std::pop_heap(this->deadlines_.begin(), this->deadlines_.end(), later);
+						this->deadlines_.pop_back();
+						if (!this->take(id, handler))
+							continue;
+					}
+					handler.complete(this->executor_, asio::error::timed_out, Message());
+				}
+				this->arm();
+			}
+
+		private:
+			asio::any_io_executor executor_;
+			asio::steady_timer timer_;
+			mutable std::mutex mutex_;
+			std::vector<Slot> slots_;
+			std::vector<uint32> free_;
+			std::vector<Deadline> deadlines_;
+			clock::time_point armed_;
+			std::size_t pending_ = { 0 };
+			bool closed_ = { false };
+		};
+
+		std::shared_ptr<Core> core()
+		{
+			std::call_once(this->once_, [this]() {
+				this->core_ = std::make_shared<Core>(this->executor_, this->capacity_);
+				this->ready_.store(this->core_.get(), std::memory_order_release);
+			});
+			return this->core_;
+		}
+
+	private:
+		asio::any_io_executor executor_;
+		uint32 capacity_;
+		// the table is allocated by the first call, sessions that never call
+		// pay for none of it
+		std::once_flag once_;
+		std::shared_ptr<Core> core_;
+		std::atomic<Core*> ready_ = { nullptr };
+	};
+
+}
+
+#endif // __RPC_HPP__
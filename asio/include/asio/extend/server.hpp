@@ -8,6 +8,13 @@
 #include <asio/extend/object.hpp>
 #include <asio/detail/socket_types.hpp>
 #include <asio/extend/typedef.hpp>
+#include <asio/extend/write_queue.hpp>
+#include <asio/extend/compress.hpp>
+#include <asio/extend/write_waiters.hpp>
+#include <asio/extend/frame_reader.hpp>
+#include <asio/extend/rpc.hpp>
+#include <asio/extend/timer_wheel.hpp>
+#include <asio/extend/metrics.hpp>
 #include <asio/extend/object.hpp>
 #include <asio/extend/worker.hpp>
 #include <asio/extend/users.hpp>
@@ -33,9 +40,11 @@ namespace asio {
         explicit TcpSession(tcp::socket socket, ServerUser& users, NetServer* server) noexcept
             : socket_(std::move(socket)),
             users_(users),
-            server_(server)
+            server_(server),
+            rpc_(socket_.get_executor())
         {
             // this->SetMsgQueueRun(false);
+            this->write_msgs_.set_watermarks(server->Watermarks());
         }
 
         virtual ~TcpSession() 
@@ -54,16 +63,32 @@ namespace asio {
         void Start()
         {
             // init snowflake generate session id
-            const uint64 sessionId = this->server_->GenerateUUId();
+            this->Start(this->server_->GenerateUUId());
+        }
+
+        // session id taken from the accepting shard
+        void Start(const uint64 sessionId)
+        {
             this->setSessionId(sessionId);
             // server room jion
             this->users_.Join(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
 			this->read_msg_.setNetObject(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
             // connect event
 			this->SetConnect(true);
+            Metrics::Add(Metric::Accepts);
             this->server_->Connect(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
+            // idle expiry on the shard's wheel, the read error path cleans up
+            if (this->server_->IdleTimeout().count() > 0)
+            {
+                this->idle_.start(TimerWheel::of(*this->Context()), this->server_->IdleTimeout(),
+                    [this]()
+                    {
+                        Metrics::Add(Metric::IdleCloses);
+                        this->Close();
+                    });
+            }
             // start receive stream data
-            do_read_header();
+            do_read();
         }
 
         void Deliver(const Message& msg)
@@ -81,6 +106,106 @@ namespace asio {
             this->write(msg);
         }
 
+        // shared payload, queued by reference
+        void PostShared(const PayloadPtr& payload) override
+        {
+            this->write(payload);
+        }
+
+        // shared payload with a priority for BackpressurePolicy::Drop
+        void PostPriority(const PayloadPtr& payload, uint8 priority) override
+        {
+            this->write(payload, priority);
+        }
+
+        void SetWatermarks(const WatermarkOptions& options) override
+        {
+            std::lock_guard lock(this->mutex_);
+            this->write_msgs_.set_watermarks(options);
+        }
+
+        bool Writable() override
+        {
+            std::lock_guard lock(this->mutex_);
+            return this->write_msgs_.writable();
+        }
+
+        // completes once the output queue is back under its low watermark,
+        // with operation_aborted when the session goes away first
+        template <typename WaitToken>
+        auto AsyncWaitWritable(WaitToken&& token)
+        {
+            return asio::async_initiate<WaitToken, void(std::error_code)>(
+                [self = this->shared_from_this()](auto handler)
+                {
+                    std::unique_lock lock(self->mutex_);
+                    if (self->write_msgs_.writable() || !self->IsConnect())
+                    {
+                        lock.unlock();
+                        const std::error_code ec = self->IsConnect() ? std::error_code() : asio::error::not_connected;
+                        asio::post(self->socket_.get_executor(), asio::append(std::move(handler), ec));
+                        return;
+                    }
+                    self->waiters_.add(std::move(handler));
+                }, token);
+        }
+
+        // sockets are always opened on an io_context here
+        asio::io_context* Context() override
+        {
+            return &static_cast<asio::io_context&>(asio::query(this->socket_.get_executor(), asio::execution::context));
+        }
+
+        std::size_t PendingBytes() override
+        {
+            std::lock_guard lock(this->mutex_);
+            return this->write_msgs_.bytes();
+        }
+
+        std::size_t DropPending(std::size_t keepBytes) override
+        {
+            std::lock_guard lock(this->mutex_);
+            return this->write_msgs_.drop_oldest(keepBytes);
+        }
+
+        // caps for one gathered send
+        void SetWriteLimits(std::size_t maxBytes, std::size_t maxBuffers)
+        {
+            std::lock_guard lock(this->mutex_);
+            this->write_msgs_.set_gather_limits(maxBytes, maxBuffers);
+        }
+
+        // request / response to the client, completes with
+        // (error_code, Message), see RpcChannel::async_call
+        template <typename CallToken>
+        auto AsyncCall(const Message& request, std::chrono::milliseconds timeout, CallToken&& token)
+        {
+            return this->rpc_.async_call(request, timeout,
+                [self = this->shared_from_this()](const Message& frame)
+                {
+                    if (!self->IsConnect())
+                    {
+                        return false;
+                    }
+                    self->write(frame);
+                    return true;
+                }, std::forward<CallToken>(token));
+        }
+
+        // answers a request from the client, Rpc::IsRequest(request)
+        void Reply(const Message& request, const Message& response)
+        {
+            Message frame;
+            Rpc::Frame(response, Rpc::eResponse, Rpc::CallId(request), frame);
+            this->write(frame);
+        }
+
+        // calls in flight at once, before the first AsyncCall
+        void SetRpcCapacity(uint32 capacity)
+        {
+            this->rpc_.set_capacity(capacity);
+        }
+
 		// warning error 10009 scope NetObject and socket
         std::string Ip() override
         {
@@ -100,90 +225,186 @@ namespace asio {
         }
         void write(const Message& msg)
         {
-            std::lock_guard lock(this->mutex_);
-            bool write_in_progress = !write_msgs_.empty();
-            this->write_msgs_.push_back(msg);
-            // cache msg
-            if (!this->IsMsgQueueRunning())
+            this->write(MsgCompression::Encode(msg));
+        }
+        void write(const PayloadPtr& payload, uint8 priority = 0)
+        {
+            Watermark mark = Watermark::None;
+            {
+                std::lock_guard lock(this->mutex_);
+                bool write_in_progress = !write_msgs_.empty();
+                const Admission admission = this->write_msgs_.offer(PayloadSlice(payload, priority));
+                if (admission != Admission::Queued)
+                {
+                    if (admission == Admission::Close)
+                    {
+                        this->close_later();
+                    }
+                    return;
+                }
+                mark = this->write_msgs_.watermark();
+                Metrics::Add(Metric::MsgsOut);
+                Metrics::Record(Histogram::WriteQueueBytes, this->write_msgs_.bytes());
+                // cache msg while the queue is paused
+                if (this->IsMsgQueueRunning() && !write_in_progress)
+                {
+                    this->do_write();
+                }
+            }
+            this->notify(mark);
+        }
+
+        // the client asks for another framing, see FramingHandshake
+        void handshake(const Message& msg)
+        {
+            FramingHandshake::Op op;
+            Framing framing;
+            if (!FramingHandshake::Parse(msg, op, framing))
+            {
+                return;
+            }
+            if (op == FramingHandshake::eSwitch)
+            {
+                // called from parse(), applies from the next frame
+                this->reader_.set_framing(framing);
+                return;
+            }
+            if (op != FramingHandshake::eOffer)
             {
                 return;
             }
-            if (!write_in_progress)
+            const Framing chosen = framing == Framing::Compact && this->server_->AllowedFraming() == Framing::Compact
+                ? Framing::Compact : Framing::Standard;
+            std::lock_guard lock(this->mutex_);
+            bool write_in_progress = !write_msgs_.empty();
+            // the answer still goes out in the old framing, what follows it in the new one
+            this->write_msgs_.push(FramingHandshake::Make(FramingHandshake::eAccept, chosen));
+            this->write_msgs_.set_framing(chosen);
+            if (this->IsMsgQueueRunning() && !write_in_progress)
             {
                 this->do_write();
             }
         }
-    private:
-        void do_read_header()
+
+        // close on the I/O thread, producers may run anywhere
+        void close_later()
         {
             auto self(this->shared_from_this());
-            asio::async_read(socket_,
-                asio::buffer(read_msg_.data(), Message::header_length),
-                [this, self](std::error_code ec, std::size_t /*length*/)
-                {
-                    if (!ec && read_msg_.decode_header())
-                    {
-                        if (this->server_->IsPackSessionId())
-                        {
-                            MsgHeader* header = (MsgHeader*)(this->read_msg_.data());
-                            header->sId = this->getSessionId();
-                        }
-                        do_read_body();
-                    }
-                    else
-                    {
-                        this->server_->Error(0);
-						this->server_->Disconnect(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
-                        this->users_.Leave(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
-                        this->SetConnect(false);
-                    }
-                });
+            asio::post(this->socket_.get_executor(), [self]() { self->Close(); });
         }
 
-        void do_read_body()
+        void notify(Watermark mark)
+        {
+            if (mark == Watermark::High)
+            {
+                this->server_->HighWatermark(this->shared_from_this());
+            }
+            else if (mark == Watermark::Low)
+            {
+                this->server_->LowWatermark(this->shared_from_this());
+            }
+        }
+
+        void cancel_waiters()
+        {
+            WriteWaitList::List waiters;
+            {
+                std::lock_guard lock(this->mutex_);
+                waiters = this->waiters_.take();
+            }
+            WriteWaitList::complete(std::move(waiters), this->socket_.get_executor(), asio::error::operation_aborted);
+        }
+    private:
+        // read what the socket has and dispatch every complete frame in it
+        void do_read()
         {
             auto self(this->shared_from_this());
-            asio::async_read(socket_,
-                asio::buffer(read_msg_.body(), read_msg_.body_length()),
-                [this, self](std::error_code ec, std::size_t /*length*/)
+            this->socket_.async_read_some(this->reader_.prepare(),
+                [this, self](std::error_code ec, std::size_t length)
                 {
                     if (!ec)
                     {
-                        this->server_->HandleMessage(this->shared_from_this(), read_msg_);
-                        do_read_header();
-                    }
-                    else
-                    {
-                        this->server_->Error(0);
-						this->server_->Disconnect(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
-                        this->users_.Leave(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
-                        this->SetConnect(false);
+                        this->idle_.touch();
+                        Metrics::Add(Metric::BytesIn, length);
+                        this->reader_.commit(length);
+                        const bool valid = this->reader_.parse(this->read_msg_,
+                            [this](Message& msg)
+                            {
+                                if (FramingHandshake::Is(msg))
+                                {
+                                    this->handshake(msg);
+                                    return;
+                                }
+                                if (Rpc::IsResponse(msg))
+                                {
+                                    this->rpc_.complete(msg);
+                                    return;
+                                }
+                                MsgHeader* header = (MsgHeader*)(msg.data());
+                                if (this->server_->IsPackSessionId())
+                                {
+                                    header->sId = this->getSessionId();
+                                }
+                                Metrics::Add(Metric::MsgsIn);
+                                HandlerTimer timer(header->msgId);
+                                this->server_->HandleMessage(this->shared_from_this(), msg);
+                            });
+                        if (valid)
+                        {
+                            do_read();
+                            return;
+                        }
                     }
+                    Metrics::AddReadEnd(ec);
+                    this->server_->Error(0);
+                    this->server_->Disconnect(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
+                    this->users_.Leave(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
+                    this->SetConnect(false);
+                    this->cancel_waiters();
+                    this->rpc_.cancel();
+                    this->idle_.cancel();
                 });
         }
 
+        // one gathered send for as much of the queue as the limits allow
         void do_write()
         {
             auto self(this->shared_from_this());
-            asio::async_write(socket_,
-                asio::buffer(write_msgs_.front().data(),
-                    write_msgs_.front().length()),
-                [this, self](std::error_code ec, std::size_t /*length*/)
+            this->socket_.async_write_some(this->write_msgs_.gather(),
+                [this, self](std::error_code ec, std::size_t length)
                 {
                     if (!ec)
                     {
-                        this->write_msgs_.pop_front();
-                        if (!write_msgs_.empty())
+                        Metrics::Add(Metric::BytesOut, length);
+                        Metrics::Record(Histogram::WriteBytes, length);
+                        Watermark mark = Watermark::None;
+                        WriteWaitList::List waiters;
                         {
-                            do_write();
+                            std::lock_guard lock(this->mutex_);
+                            this->write_msgs_.consume(length);
+                            mark = this->write_msgs_.watermark();
+                            if (mark == Watermark::Low)
+                            {
+                                waiters = this->waiters_.take();
+                            }
+                            if (!write_msgs_.empty())
+                            {
+                                do_write();
+                            }
                         }
+                        WriteWaitList::complete(std::move(waiters), this->socket_.get_executor(), std::error_code());
+                        this->notify(mark);
                     }
                     else
                     {
+                        Metrics::Add(Metric::DisconnectWrite);
                         this->server_->Error(0);
 						this->server_->Disconnect(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
                         this->users_.Leave(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
                         this->SetConnect(false);
+                        this->cancel_waiters();
+                        this->rpc_.cancel();
+                        this->idle_.cancel();
                     }
                 });
         }
@@ -191,6 +412,7 @@ namespace asio {
         void Final()
         {
             std::lock_guard lock(this->mutex_);
+            WriteWaitList::complete(this->waiters_.take(), this->socket_.get_executor(), asio::error::operation_aborted);
             this->write_msgs_.clear();
         }
 
@@ -198,20 +420,52 @@ namespace asio {
         tcp::socket socket_;
         ServerUser& users_;
         Message read_msg_;
-        MessageQueue write_msgs_;
+        FrameReader reader_;
+        WriteQueue write_msgs_;
+        WriteWaitList waiters_;
         NetServer* server_;
 		std::mutex mutex_;
+        RpcChannel rpc_;
+        IdleTimer idle_;
     };
 
+    //----------------------------------------------------------------------
+    // SO_REUSEPORT lets every shard bind its own acceptor to the same port,
+    // the kernel then spreads new connections over the shards
+#if defined(SO_REUSEPORT)
+    typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
+
     //----------------------------------------------------------------------
     // Singleton Server Basic class
+    // One io_context and acceptor by default. SetThreads(n) before Startup()
+    // adds n - 1 shards, each with its own io_context, thread, acceptor and
+    // snowflake generator; a session stays on the shard that accepted it.
     class TcpSocketServer : public Worker, public NetServer
     {
+        // IoShard
+        struct IoShard
+        {
+            IoShard()
+                : acceptor(context)
+                , work(asio::make_work_guard(context))
+                , subId(0)
+            {
+            }
+            asio::io_context context;
+            tcp::acceptor acceptor;
+            asio::executor_work_guard<asio::io_context::executor_type> work;
+            SnowFlake uuid;
+            int subId;
+        };
     public:
         explicit TcpSocketServer(const tcp::endpoint& endpoint)
-            : acceptor_(io_context, endpoint)
+            : acceptor_(io_context)
             , signals_(io_context)
             , stoped_(false)
+            , endpoint_(endpoint)
+            , reuse_port_(false)
+            , next_shard_(0)
         {
             // ensure one signals handler application
 			//signals_.add(SIGINT);
@@ -219,7 +473,7 @@ namespace asio {
 #if defined(SIGQUIT)
 			signals_.add(SIGQUIT);
 #endif // defined(SIGQUIT)
-			acceptor_.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+            this->open(acceptor_);
 			signals_.async_wait(
 				[this](std::error_code /*ec*/, int /*signal*/)
 				{
@@ -238,6 +492,18 @@ namespace asio {
 
         virtual ~TcpSocketServer() {}
 
+        // Starts the I/O threads. False, and nothing runs, when the snowflake
+        // ids of the shards fall outside [0, 31] or two shards share one.
+        bool Startup()
+        {
+            if (!this->ResolveShardIds())
+            {
+                std::cout << "TcpSocketServer: shard sub ids out of range or duplicated" << std::endl;
+                return false;
+            }
+            return Worker::Startup();
+        }
+
         // stop asio io_content
 		void Stop() 
         {
@@ -250,8 +516,47 @@ namespace asio {
 			{
 				this->io_context.stop();
 			}
+            for (auto& shard : this->shards_)
+            {
+                shard->work.reset();
+                shard->context.stop();
+            }
 		}
 
+        // Number of I/O threads, call before Startup(). Shard i uses
+        // snowflake sub id SubId() + i unless SetShardSubId() says otherwise;
+        // Startup() fails when that runs past 31, the snowflake limit.
+        void SetThreads(int threads)
+        {
+            for (int i = static_cast<int>(this->shards_.size()) + 1; i < threads; ++i)
+            {
+                auto shard = std::make_unique<IoShard>();
+                if (this->reuse_port_)
+                {
+                    this->open(shard->acceptor);
+                    this->do_accept(*shard);
+                }
+                this->shards_.push_back(std::move(shard));
+            }
+        }
+
+        int Threads() const
+        {
+            return static_cast<int>(this->shards_.size()) + 1;
+        }
+
+        // shard 0 is the main context and always uses SubId(); subId in
+        // [1, 31], 0 restores the derived one
+        bool SetShardSubId(int shard, int subId)
+        {
+            if (shard <= 0 || shard > static_cast<int>(this->shards_.size()) || subId < 0 || subId > max_snowflake_id)
+            {
+                return false;
+            }
+            this->shards_[shard - 1]->subId = subId;
+            return true;
+        }
+
         ServerUser& getRoom() 
         {
             return this->users_;
@@ -267,30 +572,82 @@ namespace asio {
             this->name_ = name;
         }
     private:
-        // single thread run
+        static constexpr int max_snowflake_id = 31;
+
+        int MainUUIDId() const
+        {
+            return this->MainId() == 0 ? 1 : this->MainId();
+        }
+
+        int SubUUIDId() const
+        {
+            return this->SubId() == 0 ? 1 : this->SubId();
+        }
+
+        // Sub id of every shard, derived ones are SubId() + i. False when an
+        // id is outside [0, 31] or two shards would hand out the same ids.
+        bool ResolveShardIds()
+        {
+            const int mainId = this->MainUUIDId();
+            const int subId = this->SubUUIDId();
+            if (mainId < 0 || mainId > max_snowflake_id || subId < 0 || subId > max_snowflake_id)
+            {
+                return false;
+            }
+            uint32 used = 1u << subId;
+            for (std::size_t i = 0; i < this->shards_.size(); ++i)
+            {
+                IoShard& shard = *this->shards_[i];
+                const int id = shard.subId != 0 ? shard.subId : subId + static_cast<int>(i) + 1;
+                if (id < 0 || id > max_snowflake_id || (used & (1u << id)))
+                {
+                    return false;
+                }
+                used |= 1u << id;
+            }
+            for (std::size_t i = 0; i < this->shards_.size(); ++i)
+            {
+                IoShard& shard = *this->shards_[i];
+                if (shard.subId == 0)
+                {
+                    shard.subId = subId + static_cast<int>(i) + 1;
+                }
+            }
+            return true;
+        }
+
+        // single thread run, one extra thread per shard
         void Exec() override
         {
-            // snowflake algrithem
-			int mainId = this->MainId() == 0 ? 1 : this->MainId();
-			int subId  = this->SubId()  == 0 ? 1 : this->SubId();
-			this->InitUUID(mainId, subId);
+            // snowflake algrithem, ids checked by Startup()
+			const int mainId = this->MainUUIDId();
+			this->InitUUID(mainId, this->SubUUIDId());
+            for (auto& shard : this->shards_)
+            {
+                shard->uuid.init(mainId, shard->subId);
+            }
 
             // multi thread
 		    // Run the I/O service on the requested number of threads
             std::vector<std::thread> v;
-            v.reserve(1);
-            int threads = 1;
-            for (auto i = threads - 1; i > 0; --i) {
+            v.reserve(this->shards_.size());
+            for (auto& shard : this->shards_) {
+                IoShard* s = shard.get();
                 v.emplace_back(
-                    [&]
+                    [s]
                     {
-                        this->io_context.run();
+                        s->context.run();
                     });
             }
             // main thread worker
             io_context.run();
 
             // wait for threads exit
+            for (auto& shard : this->shards_)
+            {
+                shard->work.reset();
+                shard->context.stop();
+            }
             for (auto& it : v)
             {
                 if (it.joinable())
@@ -300,27 +657,97 @@ namespace asio {
             }
         }
 
+        // open, bind and listen, with SO_REUSEPORT where the platform has it
+        void open(tcp::acceptor& acceptor)
+        {
+            acceptor.open(this->endpoint_.protocol());
+            acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+            std::error_code ec;
+            acceptor.set_option(reuse_port(true), ec);
+            this->reuse_port_ = !ec;
+#endif
+            acceptor.bind(this->endpoint_);
+            acceptor.listen();
+        }
+
         // accept
+        // Without SO_REUSEPORT the main acceptor hands sockets to the shards
+        // round robin, each socket is created on its shard's io_context.
         void do_accept()
         {
-            acceptor_.async_accept(
-                [this](std::error_code ec, tcp::socket socket)
+            const std::size_t count = this->shards_.size() + 1;
+            const std::size_t index = (this->reuse_port_ || count == 1) ? 0 : (this->next_shard_++ % count);
+            if (index == 0)
+            {
+                acceptor_.async_accept(
+                    [this](std::error_code ec, tcp::socket socket)
+                    {
+                        if (!ec)
+                        {
+                            std::make_shared<TcpSession>(std::move(socket), users_, dynamic_cast<NetServer*>(this))->Start();
+                        }
+                        if (acceptor_.is_open())
+                        {
+                            this->do_accept();
+                        }
+                    });
+                return;
+            }
+            IoShard* shard = this->shards_[index - 1].get();
+            acceptor_.async_accept(shard->context,
+                [this, shard](std::error_code ec, tcp::socket socket)
+                {
+                    if (!ec)
+                    {
+                        this->start_session(*shard, std::move(socket));
+                    }
+                    if (acceptor_.is_open())
+                    {
+                        this->do_accept();
+                    }
+                });
+        }
+
+        void do_accept(IoShard& shard)
+        {
+            shard.acceptor.async_accept(
+                [this, &shard](std::error_code ec, tcp::socket socket)
                 {
                     if (!ec)
                     {
-                        std::make_shared<TcpSession>(std::move(socket), users_, dynamic_cast<NetServer*>(this))->Start();
+                        std::make_shared<TcpSession>(std::move(socket), users_, dynamic_cast<NetServer*>(this))->Start(shard.uuid.nextid());
+                    }
+                    if (shard.acceptor.is_open())
+                    {
+                        this->do_accept(shard);
                     }
-                    this->do_accept();
+                });
+        }
+
+        // Start() runs on the shard thread that owns the socket
+        void start_session(IoShard& shard, tcp::socket socket)
+        {
+            auto session = std::make_shared<TcpSession>(std::move(socket), users_, dynamic_cast<NetServer*>(this));
+            IoShard* s = &shard;
+            asio::post(shard.context, [session, s]()
+                {
+                    session->Start(s->uuid.nextid());
                 });
         }
     private:
         // io_service
 		asio::io_context io_context;
+        // shard contexts must outlive the sessions kept in users_
+        std::vector<std::unique_ptr<IoShard>> shards_;
         tcp::acceptor acceptor_;
         ServerUser users_;
         asio::signal_set signals_;
         bool stoped_;
         std::string name_;
+        tcp::endpoint endpoint_;
+        bool reuse_port_;
+        std::size_t next_shard_;
     };
 
     //----------------------------------------------------------------------
@@ -21,7 +21,14 @@
 #include <asio/msgdef/message.hpp>
 #include <asio/extend/object.hpp>
 #include <asio/extend/typedef.hpp>
+#include <asio/extend/write_queue.hpp>
+#include <asio/extend/compress.hpp>
+#include <asio/extend/write_waiters.hpp>
+#include <asio/extend/frame_reader.hpp>
 #include <asio/extend/users.hpp>
+#include <asio/extend/session_lanes.hpp>
+#include <asio/extend/timer_wheel.hpp>
+#include <asio/extend/metrics.hpp>
 #include <asio/signal_set.hpp>
 
 namespace asio {
@@ -34,6 +41,7 @@ namespace asio {
 	// Tcp Session GroupServer
 	class TcpSession
 		: public NetObject
+		, public std::enable_shared_from_this<TcpSession>
 	{
 	public:
 		explicit TcpSession(tcp::socket socket, ServerUser& users, NetServer* server) noexcept
@@ -41,7 +49,7 @@ namespace asio {
 			users_(users),
 			server_(server)
 		{
-
+			this->write_msgs_.set_watermarks(server->Watermarks());
 		}
 
 		virtual ~TcpSession()
@@ -69,15 +77,26 @@ namespace asio {
 			this->setSessionId(sessionId);
 			// server room jion
 			users_.Join(this->shared_from_this());
-			read_msg_.setNetObject(this->weak_from_this());
+			read_msg_.setNetObject(this->shared_from_this());
 			// connect event
 			this->SetConnect(true);
+			Metrics::Add(Metric::Accepts);
 			server_->Connect(shared_from_this());
+			// idle expiry on the context's wheel, the read error path cleans up
+			if (this->server_->IdleTimeout().count() > 0)
+			{
+				this->idle_.start(TimerWheel::of(*this->Context()), this->server_->IdleTimeout(),
+					[this]()
+					{
+						Metrics::Add(Metric::IdleCloses);
+						this->Close();
+					});
+			}
 			// start receive stream data
-			do_read_header();
+			do_read();
 		}
 
-		void Deliver(const Message& msg) override
+		void Deliver(const Message& msg)
 		{
 			/*
 			std::lock_guard lock(this->mutex_);
@@ -103,13 +122,82 @@ namespace asio {
 			this->write(msg);
 		}
 
+		// shared payload, queued by reference
+		void PostShared(const PayloadPtr& payload) override
+		{
+			this->write(payload);
+		}
+
+		// shared payload with a priority for BackpressurePolicy::Drop
+		void PostPriority(const PayloadPtr& payload, uint8 priority) override
+		{
+			this->write(payload, priority);
+		}
+
+		void SetWatermarks(const WatermarkOptions& options) override
+		{
+			std::lock_guard lock(this->mutex_);
+			this->write_msgs_.set_watermarks(options);
+		}
+
+		bool Writable() override
+		{
+			std::lock_guard lock(this->mutex_);
+			return this->write_msgs_.writable();
+		}
+
+		// completes once the output queue is back under its low watermark,
+		// with operation_aborted when the session goes away first
+		template <typename WaitToken>
+		auto AsyncWaitWritable(WaitToken&& token)
+		{
+			return asio::async_initiate<WaitToken, void(std::error_code)>(
+				[self = this->shared_from_this()](auto handler)
+				{
+					std::unique_lock lock(self->mutex_);
+					if (self->write_msgs_.writable() || !self->IsConnect())
+					{
+						lock.unlock();
+						const std::error_code ec = self->IsConnect() ? std::error_code() : asio::error::not_connected;
+						asio::post(self->socket_.get_executor(), asio::append(std::move(handler), ec));
+						return;
+					}
+					self->waiters_.add(std::move(handler));
+				}, token);
+		}
+
+		// sockets are always opened on an io_context here
+		asio::io_context* Context() override
+		{
+			return &static_cast<asio::io_context&>(asio::query(this->socket_.get_executor(), asio::execution::context));
+		}
+
+		std::size_t PendingBytes() override
+		{
+			std::lock_guard lock(this->mutex_);
+			return this->write_msgs_.bytes();
+		}
+
+		std::size_t DropPending(std::size_t keepBytes) override
+		{
+			std::lock_guard lock(this->mutex_);
+			return this->write_msgs_.drop_oldest(keepBytes);
+		}
+
+		// caps for one gathered send
+		void SetWriteLimits(std::size_t maxBytes, std::size_t maxBuffers)
+		{
+			std::lock_guard lock(this->mutex_);
+			this->write_msgs_.set_gather_limits(maxBytes, maxBuffers);
+		}
+
 		// warning error 10009 scope NetObject socket
 		std::string Ip() override
 		{
 			return this->socket_.remote_endpoint().address().to_string();
 		}
 
-		uint64 SocketId() override final
+		uint64 SocketId() override
 		{
 			return this->socket_.native_handle();
 		}
@@ -121,89 +209,185 @@ namespace asio {
 		}
 		void write(const Message& msg)
 		{
+			this->write(MsgCompression::Encode(msg));
+		}
+		void write(const PayloadPtr& payload, uint8 priority = 0)
+		{
+			Watermark mark = Watermark::None;
+			{
+				std::lock_guard lock(this->mutex_);
+				bool write_in_progress = !write_msgs_.empty();
+				const Admission admission = this->write_msgs_.offer(PayloadSlice(payload, priority));
+				if (admission != Admission::Queued)
+				{
+					if (admission == Admission::Close)
+					{
+						this->close_later();
+					}
+					return;
+				}
+				mark = this->write_msgs_.watermark();
+				Metrics::Add(Metric::MsgsOut);
+				Metrics::Record(Histogram::WriteQueueBytes, this->write_msgs_.bytes());
+				if (!write_in_progress)
+				{
+					this->do_write();
+				}
+			}
+			this->notify(mark);
+		}
+
+		// the client asks for another framing, see FramingHandshake
+		void handshake(const Message& msg)
+		{
+			FramingHandshake::Op op;
+			Framing framing;
+			if (!FramingHandshake::Parse(msg, op, framing))
+			{
+				return;
+			}
+			if (op == FramingHandshake::eSwitch)
+			{
+				// called from parse(), applies from the next frame
+				reader_.set_framing(framing);
+				return;
+			}
+			if (op != FramingHandshake::eOffer)
+			{
+				return;
+			}
+			const Framing chosen = framing == Framing::Compact && server_->AllowedFraming() == Framing::Compact
+				? Framing::Compact : Framing::Standard;
 			std::lock_guard lock(this->mutex_);
 			bool write_in_progress = !write_msgs_.empty();
-			this->write_msgs_.push_back(msg);
+			// the answer still goes out in the old framing, what follows it in the new one
+			this->write_msgs_.push(FramingHandshake::Make(FramingHandshake::eAccept, chosen));
+			this->write_msgs_.set_framing(chosen);
 			if (!write_in_progress)
 			{
-				do_write();
+				this->do_write();
 			}
 		}
-	private:
-		void do_read_header()
+
+		// close on the I/O thread, producers may run anywhere
+		void close_later()
 		{
-			auto self(shared_from_this());
-			asio::async_read(socket_,
-				asio::buffer(read_msg_.data(), Message::header_length),
-				[this, self](std::error_code ec, std::size_t /*length*/)
-				{
-					if (!ec && read_msg_.decode_header())
-					{
-						if (server_->IsPackSessionId())
-						{
-							MsgHeader* header = (MsgHeader*)(this->read_msg_.data());
-							header->sessionId = this->getSessionId();
-						}
-						do_read_body();
-					}
-					else
-					{
-						this->server_->Disconnect(shared_from_this());
-						this->users_.Leave(this->shared_from_this());
-						this->SetConnect(false);
-					}
-				});
+			auto self(this->shared_from_this());
+			asio::post(this->socket_.get_executor(), [self]() { self->Close(); });
+		}
+
+		void notify(Watermark mark)
+		{
+			if (mark == Watermark::High)
+			{
+				this->server_->HighWatermark(this->shared_from_this());
+			}
+			else if (mark == Watermark::Low)
+			{
+				this->server_->LowWatermark(this->shared_from_this());
+			}
 		}
 
-		void do_read_body()
+		void cancel_waiters()
+		{
+			WriteWaitList::List waiters;
+			{
+				std::lock_guard lock(this->mutex_);
+				waiters = this->waiters_.take();
+			}
+			WriteWaitList::complete(std::move(waiters), this->socket_.get_executor(), asio::error::operation_aborted);
+		}
+	private:
+		// read what the socket has and dispatch every complete frame in it
+		void do_read()
 		{
 			auto self(shared_from_this());
-			asio::async_read(socket_,
-				asio::buffer(read_msg_.body(), read_msg_.body_length()),
-				[this, self](std::error_code ec, std::size_t /*length*/)
+			socket_.async_read_some(reader_.prepare(),
+				[this, self](std::error_code ec, std::size_t length)
 				{
 					if (!ec)
 					{
-						server_->PostMsg(read_msg_);
-						do_read_header();
-					}
-					else
-					{
-						this->server_->Disconnect(shared_from_this());
-						this->users_.Leave(this->shared_from_this());
-						this->SetConnect(false);
+						this->idle_.touch();
+						Metrics::Add(Metric::BytesIn, length);
+						reader_.commit(length);
+						const bool valid = reader_.parse(read_msg_,
+							[this, &self](Message& msg)
+							{
+								if (FramingHandshake::Is(msg))
+								{
+									this->handshake(msg);
+									return;
+								}
+								if (server_->IsPackSessionId())
+								{
+									MsgHeader* header = (MsgHeader*)(msg.data());
+									header->sId = this->getSessionId();
+								}
+								Metrics::Add(Metric::MsgsIn);
+								// hand the block to the workers, parse() allocates a new one
+								server_->PostMsg(this->getSessionId(), std::move(msg));
+								read_msg_.setNetObject(self);
+							});
+						if (valid)
+						{
+							do_read();
+							return;
+						}
 					}
+					Metrics::AddReadEnd(ec);
+					this->server_->Disconnect(shared_from_this());
+					this->users_.Leave(this->shared_from_this());
+					this->SetConnect(false);
+					this->cancel_waiters();
+					this->idle_.cancel();
 				});
 		}
 
+		// one gathered send for as much of the queue as the limits allow
 		void do_write()
 		{
 			auto self(shared_from_this());
-			asio::async_write(socket_,
-				asio::buffer(write_msgs_.front().data(),
-					write_msgs_.front().length()),
-				[this, self](std::error_code ec, std::size_t /*length*/)
+			socket_.async_write_some(write_msgs_.gather(),
+				[this, self](std::error_code ec, std::size_t length)
 				{
 					if (!ec)
 					{
-						write_msgs_.pop_front();
-						if (!write_msgs_.empty())
+						Metrics::Add(Metric::BytesOut, length);
+						Metrics::Record(Histogram::WriteBytes, length);
+						Watermark mark = Watermark::None;
+						WriteWaitList::List waiters;
 						{
-							do_write();
+							std::lock_guard lock(this->mutex_);
+							this->write_msgs_.consume(length);
+							mark = this->write_msgs_.watermark();
+							if (mark == Watermark::Low)
+							{
+								waiters = this->waiters_.take();
+							}
+							if (!write_msgs_.empty())
+							{
+								do_write();
+							}
 						}
+						WriteWaitList::complete(std::move(waiters), this->socket_.get_executor(), std::error_code());
+						this->notify(mark);
 					}
 					else
 					{
+						Metrics::Add(Metric::DisconnectWrite);
 						this->server_->Disconnect(shared_from_this());
 						this->users_.Leave(this->shared_from_this());
 						this->SetConnect(false);
+						this->cancel_waiters();
+						this->idle_.cancel();
 					}
 				});
 		}
 
-		void Final() override
+		void Final()
 		{
 			std::lock_guard lock(this->mutex_);
+			WriteWaitList::complete(this->waiters_.take(), this->socket_.get_executor(), asio::error::operation_aborted);
 			this->write_msgs_.clear();
 		}
 
@@ -211,9 +395,12 @@ namespace asio {
 		tcp::socket socket_;
 		ServerUser& users_;
 		Message read_msg_;
-		MessageQueue write_msgs_;
+		FrameReader reader_;
+		WriteQueue write_msgs_;
+		WriteWaitList waiters_;
 		NetServer* server_;
 		std::mutex mutex_;
+		IdleTimer idle_;
 	};
 
 	//----------------------------------------------------------------------
@@ -289,7 +476,7 @@ namespace asio {
 		}
 	private:
 
-		void AfterInit() override
+		void AfterInit()
 		{
 
 		}
@@ -299,7 +486,7 @@ namespace asio {
 
 		}
 
-		void BeforeExit() override
+		void BeforeExit()
 		{
 
 		}
@@ -331,7 +518,7 @@ namespace asio {
 	class NetGroupServer : public NetServer
 	{
 	public:
-		NetGroupServer() : m_stop(false) {}
+		NetGroupServer() {}
 		virtual ~NetGroupServer()
 		{
 			for (const auto& it : m_vSubServers) {
@@ -339,16 +526,8 @@ namespace asio {
 			}
 			m_vSubServers.clear();
 
-			// notify stop thread
-			{
-				std::unique_lock<std::mutex> lock(m_queue_mutex);
-				m_stop = true;
-			}
-			m_condition.notify_all();
-			
-			// waiting for thread stop
-			for (auto& worker : m_workers)
-				worker.join();
+			// run what is queued and wait for thread stop
+			m_lanes.Stop();
 		}
 
 		void Startup(const std::vector<int>& vPorts, int threadWorks = 1)
@@ -363,24 +542,13 @@ namespace asio {
 				pSubServer->Startup();
 			}
 
-			// thread pool works
-			for (size_t i = 0; i < threadWorks; ++i) {
-				m_workers.emplace_back(
-					[this]
-					{
-						for (;;)
-						{
-							std::unique_lock<std::mutex> lock(this->m_queue_mutex);
-							this->m_condition.wait(lock,
-								[this] { return this->m_stop || !this->m_msgQueue.empty(); });
-							if (this->m_stop && this->m_msgQueue.empty())
-								return;
-							auto msg = std::move(this->m_msgQueue.front());
-							this->m_msgQueue.pop();
-							this->HandleMessage(msg);
-						}
-					});
-			}
+			// thread pool works, one session always runs in order
+			m_lanes.Start(threadWorks > 0 ? threadWorks : 1,
+				[this](Message& msg)
+				{
+					HandlerTimer timer(((MsgHeader*)msg.data())->msgId);
+					this->HandleMessage(msg.getNetObject().lock(), msg);
+				});
 		}
 
 		void StopContext()
@@ -411,19 +579,19 @@ namespace asio {
 		}
 
 		void PostMsg(const Message& msg) override {
-			std::unique_lock<std::mutex> lock(m_queue_mutex);
-			if (m_stop) {
-				return;
-			}
-			m_msgQueue.emplace(msg);
-			m_condition.notify_one();
+			NetObjectPtr obj = msg.getNetObject().lock();
+			m_lanes.Post(obj ? obj->getSessionId() : 0, Message(msg));
+		}
+
+		void PostMsg(const uint64 sessionId, Message&& msg) override {
+			m_lanes.Post(sessionId, std::move(msg));
 		}
 
 	private:
 		void Init() /*override*/
 		{
-			int serverId = this->ServerId() == 0 ? 2 : this->ServerId();
-			int subId = this->ServerSubId() == 0 ? 1 : this->ServerSubId();
+			int serverId = this->MainId() == 0 ? 2 : this->MainId();
+			int subId = this->SubId() == 0 ? 1 : this->SubId();
 			this->InitUUID(serverId, subId);
 		}
 		
@@ -438,16 +606,8 @@ namespace asio {
 		typedef std::vector<TcpSubServer*> ServerList;
 		ServerList m_vSubServers;
 
-		typedef std::vector<std::thread> ThreadList;
-		ThreadList m_workers;
-
-		typedef std::queue<Message>      MsgQueue;
-		MsgQueue   m_msgQueue;
-
-		// synchronization
-		std::mutex m_queue_mutex;
-		std::condition_variable m_condition;
-		bool m_stop;
+		// per session ordered worker queues
+		SessionLanes m_lanes;
 	};
 
 
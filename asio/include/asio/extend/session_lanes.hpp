@@ -0,0 +1,233 @@
+//
+// session_lanes.hpp
+// per session ordered message dispatch over a worker pool
+//
+
+#ifndef __SESSION_LANES_HPP__
+#define __SESSION_LANES_HPP__
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <asio/extend/base.hpp>
+#include <asio/extend/nocopyobj.hpp>
+#include <asio/extend/metrics.hpp>
+#include <asio/msgdef/message.hpp>
+
+namespace asio {
+
+	// SessionLanes
+	// Messages are spread over lanes by a hash of their session id, so one
+	// session always lands in the same lane. A lane is scheduled on at most
+	// one worker at a time, which keeps every session in order while
+	// different sessions run in parallel.
+	// Each worker owns a ready list of lanes and takes a lane's whole backlog
+	// in one swap, then runs it without any lock held. A lane with more work
+	// goes back to the tail of its worker's list. A worker with nothing ready
+	// steals a lane from the tail of another worker's list before it sleeps.
+	// Messages are moved in, so the pooled block travels from the reading
+	// session to the handler without a copy. The time a lane waits on a
+	// ready list goes to Histogram::QueueWaitNs, one clock read per batch.
+	class SessionLanes : protected NoCopyObj
+	{
+	public:
+		typedef std::function<void(Message&)> Handler;
+
+		static constexpr std::size_t lanes_per_worker = 16;
+
+		SessionLanes() = default;
+
+		~SessionLanes()
+		{
+			this->Stop();
+		}
+
+		void Start(std::size_t workers, Handler handler)
+		{
+			if (workers == 0)
+				workers = 1;
+			std::size_t lanes = 1;
+			while (lanes < workers * lanes_per_worker)
+				lanes <<= 1;
+			this->handler_ = std::move(handler);
+			this->lane_mask_ = lanes - 1;
+			this->lanes_.reset(new Lane[lanes]);
+			this->workers_.reset(new Worker[workers]);
+			this->worker_count_ = workers;
+			this->stop_ = false;
+			for (std::size_t i = 0; i < workers; ++i)
+			{
+				this->threads_.emplace_back([this, i]() { this->run(i); });
+			}
+		}
+
+		// runs what is queued, then joins the workers
+		void Stop()
+		{
+			{
+				std::lock_guard lock(this->idle_mutex_);
+				this->stop_ = true;
+			}
+			this->idle_cv_.notify_all();
+			for (auto& thread : this->threads_)
+			{
+				if (thread.joinable())
+					thread.join();
+			}
+			this->threads_.clear();
+		}
+
+		// false once stopped
+		bool Post(const uint64 sessionId, Message&& msg)
+		{
+			if (this->stop_ || this->worker_count_ == 0)
+				return false;
+			const std::size_t index = this->index(sessionId);
+			Lane& lane = this->lanes_[index];
+			{
+				std::lock_guard lock(lane.mutex);
+				lane.queue.push_back(std::move(msg));
+				if (lane.scheduled)
+					return true;
+				lane.scheduled = true;
+				lane.since = Metrics::Timing() ? Metrics::Now() : 0;
+			}
+			this->ready(index % this->worker_count_, &lane);
+			return true;
+		}
+
+		std::size_t Workers() const
+		{
+			return this->worker_count_;
+		}
+
+	private:
+		struct alignas(64) Lane
+		{
+			std::mutex mutex;
+			std::vector<Message> queue;
+			bool scheduled = { false }; // queued on a ready list or running
+			uint64 since = { 0 };       // when it went on a ready list, 0 untimed
+		};
+
+		struct alignas(64) Worker
+		{
+			std::mutex mutex;
+			std::deque<Lane*> ready;
+		};
+
+		std::size_t index(const uint64 sessionId) const
+		{
+			const uint64 h = sessionId * 0x9E3779B97F4A7C15ull;
+			return static_cast<std::size_t>(h >> 32) & this->lane_mask_;
+		}
+
+		void ready(std::size_t worker, Lane* lane)
+		{
+			// counted first so a concurrent steal never takes it below zero
+			this->ready_count_.fetch_add(1);
+			{
+				std::lock_guard lock(this->workers_[worker].mutex);
+				this->workers_[worker].ready.push_back(lane);
+			}
+			if (this->idle_count_.load() > 0)
+			{
+				std::lock_guard lock(this->idle_mutex_);
+				this->idle_cv_.notify_one();
+			}
+		}
+
+		// own list from the front, others from the back
+		Lane* next(std::size_t self)
+		{
+			for (std::size_t i = 0; i < this->worker_count_; ++i)
+			{
+				Worker& worker = this->workers_[(self + i) % this->worker_count_];
+				std::lock_guard lock(worker.mutex);
+				if (worker.ready.empty())
+					continue;
+				Lane* lane;
+				if (i == 0)
+				{
+					lane = worker.ready.front();
+					worker.ready.pop_front();
+				}
+				else
+				{
+					lane = worker.ready.back();
+					worker.ready.pop_back();
+				}
+				this->ready_count_.fetch_sub(1);
+				return lane;
+			}
+			return nullptr;
+		}
+
+		void run(std::size_t self)
+		{
+			std::vector<Message> batch;
+			for (;;)
+			{
+				Lane* lane = this->next(self);
+				if (!lane)
+				{
+					std::unique_lock lock(this->idle_mutex_);
+					this->idle_count_.fetch_add(1);
+					this->idle_cv_.wait(lock,
+						[this] { return this->ready_count_.load() > 0 || this->stop_; });
+					this->idle_count_.fetch_sub(1);
+					if (this->stop_ && this->ready_count_.load() == 0)
+						return;
+					continue;
+				}
+				uint64 since;
+				{
+					std::lock_guard lock(lane->mutex);
+					batch.swap(lane->queue);
+					since = lane->since;
+				}
+				if (since)
+				{
+					Metrics::Record(Histogram::QueueWaitNs, Metrics::Now() - since);
+				}
+				for (auto& msg : batch)
+				{
+					this->handler_(msg);
+				}
+				batch.clear();
+				bool more;
+				{
+					std::lock_guard lock(lane->mutex);
+					more = !lane->queue.empty();
+					lane->scheduled = more;
+					lane->since = more && Metrics::Timing() ? Metrics::Now() : 0;
+				}
+				if (more)
+				{
+					this->ready(self, lane);
+				}
+			}
+		}
+
+	private:
+		Handler handler_;
+		std::unique_ptr<Lane[]> lanes_;
+		std::size_t lane_mask_ = { 0 };
+		std::unique_ptr<Worker[]> workers_;
+		std::size_t worker_count_ = { 0 };
+		std::vector<std::thread> threads_;
+		std::atomic<std::size_t> ready_count_ = { 0 };
+		std::atomic<std::size_t> idle_count_ = { 0 };
+		std::atomic<bool> stop_ = { false };
+		std::mutex idle_mutex_;
+		std::condition_variable idle_cv_;
+	};
+
+}
+
+#endif // __SESSION_LANES_HPP__
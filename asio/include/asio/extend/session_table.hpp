@@ -0,0 +1,188 @@
+//
+// session_table.hpp
+// sharded session id -> NetObject registry
+//
+
+#ifndef __SESSION_TABLE_HPP__
+#define __SESSION_TABLE_HPP__
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+#include <asio/extend/base.hpp>
+#include <asio/extend/nocopyobj.hpp>
+
+namespace asio {
+
+	class NetObject;
+
+	// SessionTable
+	// Session ids are spread over a power of two number of shards, each with
+	// its own reader / writer lock, so joins and lookups on different shards
+	// never meet and a lookup only ever takes a shared lock on one shard.
+	// Every shard also caches an immutable vector of its sessions; Snapshot()
+	// hands those out by reference count and only rebuilds the shards that
+	// changed since the previous snapshot, which keeps repeated broadcasts
+	// over a large table cheap.
+	class SessionTable : protected NoCopyObj
+	{
+	public:
+		typedef std::shared_ptr<NetObject>        NetObjectPtr;
+		typedef std::vector<NetObjectPtr>         ObjVector;
+		typedef std::shared_ptr<const ObjVector>  ShardView;
+		typedef std::vector<ShardView>            SnapshotList;
+
+		static constexpr std::size_t default_shards = 256;
+
+		explicit SessionTable(std::size_t shards = default_shards)
+		{
+			std::size_t count = 1;
+			while (count < shards)
+				count <<= 1;
+			this->mask_ = count - 1;
+			this->shards_.reset(new Shard[count]);
+		}
+
+		// false when the id is already registered
+		bool Insert(const uint64 sessionId, const NetObjectPtr& obj)
+		{
+			Shard& shard = this->shard(sessionId);
+			std::unique_lock lock(shard.mutex);
+			if (!shard.map.emplace(sessionId, obj).second)
+				return false;
+			shard.view.reset();
+			this->size_.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		// only removes the entry when it still belongs to obj
+		bool Erase(const uint64 sessionId, const NetObject* obj = nullptr)
+		{
+			Shard& shard = this->shard(sessionId);
+			std::unique_lock lock(shard.mutex);
+			auto it = shard.map.find(sessionId);
+			if (it == shard.map.end() || (obj && it->second.get() != obj))
+				return false;
+			shard.map.erase(it);
+			shard.view.reset();
+			this->size_.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		NetObjectPtr Find(const uint64 sessionId) const
+		{
+			const Shard& shard = this->shard(sessionId);
+			std::shared_lock lock(shard.mutex);
+			auto it = shard.map.find(sessionId);
+			return it != shard.map.end() ? it->second : nullptr;
+		}
+
+		std::size_t Size() const
+		{
+			return this->size_.load(std::memory_order_relaxed);
+		}
+
+		std::size_t ShardCount() const
+		{
+			return this->mask_ + 1;
+		}
+
+		// one immutable view per non empty shard
+		SnapshotList Snapshot() const
+		{
+			SnapshotList list;
+			list.reserve(this->ShardCount());
+			for (std::size_t i = 0; i <= this->mask_; ++i)
+			{
+				ShardView view = this->view(this->shards_[i]);
+				if (view && !view->empty())
+				{
+					list.push_back(std::move(view));
+				}
+			}
+			return list;
+		}
+
+		// f(const NetObjectPtr&) for every session of a snapshot
+		template <typename Function>
+		void ForEach(Function&& f) const
+		{
+			for (const auto& view : this->Snapshot())
+			{
+				for (const auto& obj : *view)
+				{
+					f(obj);
+				}
+			}
+		}
+
+		void Clear()
+		{
+			for (std::size_t i = 0; i <= this->mask_; ++i)
+			{
+				Shard& shard = this->shards_[i];
+				std::unique_lock lock(shard.mutex);
+				this->size_.fetch_sub(shard.map.size(), std::memory_order_relaxed);
+				shard.map.clear();
+				shard.view.reset();
+			}
+		}
+
+	private:
+		struct alignas(64) Shard
+		{
+			mutable std::shared_mutex mutex;
+			std::unordered_map<uint64, NetObjectPtr> map;
+			ShardView view; // null while stale
+		};
+
+		// snowflake ids keep the sequence in the low bits, mix before masking
+		std::size_t index(const uint64 sessionId) const
+		{
+			const uint64 h = sessionId * 0x9E3779B97F4A7C15ull;
+			return static_cast<std::size_t>(h >> 32) & this->mask_;
+		}
+
+		Shard& shard(const uint64 sessionId)
+		{
+			return this->shards_[this->index(sessionId)];
+		}
+
+		const Shard& shard(const uint64 sessionId) const
+		{
+			return this->shards_[this->index(sessionId)];
+		}
+
+		ShardView view(Shard& shard) const
+		{
+			{
+				std::shared_lock lock(shard.mutex);
+				if (shard.view || shard.map.empty())
+					return shard.view;
+			}
+			std::unique_lock lock(shard.mutex);
+			if (!shard.view)
+			{
+				auto objs = std::make_shared<ObjVector>();
+				objs->reserve(shard.map.size());
+				for (const auto& it : shard.map)
+				{
+					objs->push_back(it.second);
+				}
+				shard.view = std::move(objs);
+			}
+			return shard.view;
+		}
+
+	private:
+		std::unique_ptr<Shard[]> shards_;
+		std::size_t mask_ = { 0 };
+		std::atomic<std::size_t> size_ = { 0 };
+	};
+
+}
+
+#endif // __SESSION_TABLE_HPP__
@@ -2,6 +2,7 @@
 #ifndef __SNOWFLAKE_H__
 #define __SNOWFLAKE_H__
 
+#include <atomic>
 #include <cstdint>
 #include <chrono>
 #include <stdexcept>
@@ -108,4 +109,146 @@ private:
     }
 };
 
+// snowflake_atomic
+// Same id layout as snowflake, without a lock: the millisecond and the
+// sequence live together in one atomic counter, (ms << 12) | seq, and an id
+// is taken with a single CAS. When the sequence of a millisecond runs out
+// the increment carries into the millisecond field, so the generator borrows
+// the next millisecond instead of spinning until the clock gets there; the
+// clock catches up as soon as the burst ends. Ids stay unique and strictly
+// increasing in the order the CAS succeeds.
+// reserve() takes a block of ids with one CAS, and nextid_local() serves
+// each thread from its own cached block, so a shard or an accept thread can
+// hand out ids with no shared write at all. Ids from a block are increasing
+// within the thread but carry the time the block was reserved.
+template<int64_t Twepoch>
+class snowflake_atomic
+{
+    static constexpr int64_t TWEPOCH = Twepoch;
+    static constexpr int64_t WORKER_ID_BITS = 5L;
+    static constexpr int64_t SUB_ID_BITS = 5L;
+    static constexpr int64_t MAX_WORKER_ID = (1 << WORKER_ID_BITS) - 1;
+    static constexpr int64_t MAX_DATACENTER_ID = (1 << SUB_ID_BITS) - 1;
+    static constexpr int64_t SEQUENCE_BITS = 12L;
+    static constexpr int64_t WORKER_ID_SHIFT = SEQUENCE_BITS;
+    static constexpr int64_t SUB_ID_SHIFT = SEQUENCE_BITS + WORKER_ID_BITS;
+    static constexpr int64_t TIMESTAMP_LEFT_SHIFT = SEQUENCE_BITS + WORKER_ID_BITS + SUB_ID_BITS;
+    static constexpr int64_t SEQUENCE_MASK = (1 << SEQUENCE_BITS) - 1;
+
+    using time_point = std::chrono::time_point<std::chrono::steady_clock>;
+
+    time_point start_time_point_ = std::chrono::steady_clock::now();
+    int64_t start_millsecond_ = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+    // (timestamp - TWEPOCH) << SEQUENCE_BITS | sequence of the last id handed out
+    std::atomic<int64_t> last_ = { -1 };
+    int64_t node_ = 0; // (subid << SUB_ID_SHIFT) | (workerid << WORKER_ID_SHIFT)
+    // changes with every instance and every init(), invalidates thread caches
+    uint64_t serial_ = next_serial();
+public:
+    // a run of ids reserved in one step
+    class block
+    {
+    public:
+        block() = default;
+
+        bool empty() const noexcept
+        {
+            return next_ == end_;
+        }
+
+        int64_t size() const noexcept
+        {
+            return end_ - next_;
+        }
+
+        // call only when !empty()
+        int64_t next() noexcept
+        {
+            const int64_t counter = next_++;
+            return ((counter >> SEQUENCE_BITS) << TIMESTAMP_LEFT_SHIFT) | node_ | (counter & SEQUENCE_MASK);
+        }
+
+    private:
+        friend class snowflake_atomic;
+        block(int64_t first, int64_t end, int64_t node) : next_(first), end_(end), node_(node) {}
+
+        int64_t next_ = 0;
+        int64_t end_ = 0;
+        int64_t node_ = 0;
+    };
+
+    snowflake_atomic() = default;
+
+    snowflake_atomic(const snowflake_atomic&) = delete;
+
+    snowflake_atomic& operator=(const snowflake_atomic&) = delete;
+
+    // call before ids are handed out
+    void init(int64_t workerid, int64_t subid)
+    {
+        if (workerid > MAX_WORKER_ID || workerid < 0) {
+            throw std::runtime_error("worker Id can't be greater than 31 or less than 0");
+        }
+
+        if (subid > MAX_DATACENTER_ID || subid < 0) {
+            throw std::runtime_error("datacenter Id can't be greater than 31 or less than 0");
+        }
+
+        node_ = (subid << SUB_ID_SHIFT) | (workerid << WORKER_ID_SHIFT);
+        serial_ = next_serial();
+    }
+
+    int64_t nextid()
+    {
+        block ids = reserve(1);
+        return ids.next();
+    }
+
+    // count ids in one CAS, count must be at least 1
+    block reserve(int64_t count)
+    {
+        const int64_t now = (millsecond() - TWEPOCH) << SEQUENCE_BITS;
+        int64_t last = last_.load(std::memory_order_relaxed);
+        int64_t first;
+        do
+        {
+            // a new millisecond restarts the sequence, otherwise continue
+            // after the last id and carry into the next millisecond
+            first = last < now ? now : last + 1;
+        } while (!last_.compare_exchange_weak(last, first + count - 1, std::memory_order_relaxed));
+        return block(first, first + count, node_);
+    }
+
+    // from a block cached by the calling thread, refilled batch ids at a time
+    int64_t nextid_local(int64_t batch = 256)
+    {
+        struct cache
+        {
+            uint64_t serial = 0;
+            block ids;
+        };
+        static thread_local cache local;
+        if (local.serial != serial_ || local.ids.empty())
+        {
+            local.ids = reserve(batch);
+            local.serial = serial_;
+        }
+        return local.ids.next();
+    }
+
+private:
+    int64_t millsecond() const noexcept
+    {
+        auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time_point_);
+        return start_millsecond_ + diff.count();
+    }
+
+    static uint64_t next_serial() noexcept
+    {
+        static std::atomic<uint64_t> serial = { 0 };
+        return serial.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+};
+
 #endif // __SNOWFLAKE_H__
\ No newline at end of file
@@ -0,0 +1,107 @@
+//
+// submit_queue.hpp
+// lock free hand over of outbound slices from any thread to the I/O thread
+//
+
+#ifndef __SUBMIT_QUEUE_HPP__
+#define __SUBMIT_QUEUE_HPP__
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <asio/msgdef/buffer_pool.hpp>
+#include <asio/msgdef/payload.hpp>
+
+namespace asio {
+
+	// SubmitQueue
+	// Multi producer, single consumer. push() is one CAS on an intrusive
+	// stack of pooled nodes and tells the caller whether the queue was
+	// empty; only that caller schedules a drain, so a burst of sends costs
+	// one handler however many threads take part. drain() swaps the whole
+	// stack out and hands the slices over in push order. Slices pushed by
+	// one thread keep their order, as with one post per message.
+	class SubmitQueue
+	{
+	public:
+		SubmitQueue() = default;
+
+		~SubmitQueue()
+		{
+			this->drain([](PayloadSlice&&) {});
+		}
+
+		SubmitQueue(const SubmitQueue&) = delete;
+		SubmitQueue& operator=(const SubmitQueue&) = delete;
+
+		// any thread, true when the caller must schedule a drain
+		bool push(PayloadSlice slice)
+		{
+			std::size_t capacity = 0;
+			char* block = BufferPool::Allocate(sizeof(Entry), capacity);
+			Entry* entry = new (block) Entry(std::move(slice), capacity);
+			Entry* head = this->head_.load(std::memory_order_relaxed);
+			do
+			{
+				entry->next = head;
+			} while (!this->head_.compare_exchange_weak(head, entry,
+				std::memory_order_release, std::memory_order_relaxed));
+			return head == nullptr;
+		}
+
+		// consumer only, calls f(PayloadSlice&&) for every slice pushed so
+		// far, oldest first, and returns how many there were
+		template <typename F>
+		std::size_t drain(F&& f)
+		{
+			Entry* entry = this->head_.exchange(nullptr, std::memory_order_acquire);
+			// the stack is newest first
+			Entry* ordered = nullptr;
+			while (entry)
+			{
+				Entry* next = entry->next;
+				entry->next = ordered;
+				ordered = entry;
+				entry = next;
+			}
+			std::size_t count = 0;
+			while (ordered)
+			{
+				Entry* next = ordered->next;
+				f(std::move(ordered->slice));
+				release(ordered);
+				ordered = next;
+				++count;
+			}
+			return count;
+		}
+
+		bool empty() const
+		{
+			return this->head_.load(std::memory_order_relaxed) == nullptr;
+		}
+
+	private:
+		struct Entry
+		{
+			Entry(PayloadSlice&& s, std::size_t c) : slice(std::move(s)), capacity(c) {}
+
+			Entry* next = { nullptr };
+			PayloadSlice slice;
+			std::size_t capacity;
+		};
+
+		static void release(Entry* entry)
+		{
+			const std::size_t capacity = entry->capacity;
+			entry->~Entry();
+			BufferPool::Deallocate(reinterpret_cast<char*>(entry), capacity);
+		}
+
+	private:
+		std::atomic<Entry*> head_ = { nullptr };
+	};
+
+}
+
+#endif // __SUBMIT_QUEUE_HPP__
@@ -10,6 +10,21 @@
 #include <future>
 #include <functional>
 #include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <new>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <asio/append.hpp>
+#include <asio/async_result.hpp>
+#include <asio/executor_work_guard.hpp>
+#include <asio/post.hpp>
 
 #if defined(__clang__) || defined(__GNUC__)
 #define CPP_STANDARD __cplusplus
@@ -38,95 +53,476 @@
 
 #if __cplusplus >= 201703L
 
+// PoolTask
+// Move only void() callable. Callables up to inline_size bytes that are
+// nothrow movable live inside the task, bigger ones go to the heap, so the
+// common lambda costs no allocation and no std::function copy.
+class PoolTask {
+public:
+    static constexpr std::size_t inline_size = 48;
+
+    PoolTask() noexcept = default;
+
+    template<class F, class = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, PoolTask>::value>::type>
+    PoolTask(F&& f)
+    {
+        using T = typename std::decay<F>::type;
+        if constexpr (fits<T>()) {
+            new (&this->buf_) T(std::forward<F>(f));
+            this->ops_ = &inline_ops<T>;
+        } else {
+            *reinterpret_cast<T**>(&this->buf_) = new T(std::forward<F>(f));
+            this->ops_ = &heap_ops<T>;
+        }
+    }
+
+    PoolTask(PoolTask&& other) noexcept
+    {
+        this->take(other);
+    }
+
+    PoolTask& operator=(PoolTask&& other) noexcept
+    {
+        if (this != &other) {
+            this->reset();
+            this->take(other);
+        }
+        return *this;
+    }
+
+    PoolTask(const PoolTask&) = delete;
+    PoolTask& operator=(const PoolTask&) = delete;
+
+    ~PoolTask()
+    {
+        this->reset();
+    }
+
+    void operator()()
+    {
+        this->ops_->invoke(&this->buf_);
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return this->ops_ != nullptr;
+    }
+
+    void reset() noexcept
+    {
+        if (this->ops_) {
+            this->ops_->destroy(&this->buf_);
+            this->ops_ = nullptr;
+        }
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void*);
+        void (*move)(void* dst, void* src) noexcept; // leaves src destroyed
+        void (*destroy)(void*) noexcept;
+    };
+
+    template<class T>
+    static constexpr bool fits()
+    {
+        return sizeof(T) <= inline_size && alignof(T) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible<T>::value;
+    }
+
+    template<class T>
+    static constexpr Ops inline_ops = {
+        [](void* p) { (*static_cast<T*>(p))(); },
+        [](void* dst, void* src) noexcept {
+            new (dst) T(std::move(*static_cast<T*>(src)));
+            static_cast<T*>(src)->~T();
+        },
+        [](void* p) noexcept { static_cast<T*>(p)->~T(); },
+    };
+
+    template<class T>
+    static constexpr Ops heap_ops = {
+        [](void* p) { (**static_cast<T**>(p))(); },
+        [](void* dst, void* src) noexcept { *static_cast<T**>(dst) = *static_cast<T**>(src); },
+        [](void* p) noexcept { delete *static_cast<T**>(p); },
+    };
+
+    void take(PoolTask& other) noexcept
+    {
+        if (other.ops_) {
+            other.ops_->move(&this->buf_, &other.buf_);
+            this->ops_ = other.ops_;
+            other.ops_ = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char buf_[inline_size];
+    const Ops* ops_ = nullptr;
+};
+
+namespace thread_pool_detail {
+
+    // What ThreadPool::async_enqueue hands over for a result R: always an
+    // optional, empty when f() threw. An lvalue reference travels as a
+    // reference_wrapper, an rvalue reference as the moved value.
+    template<class R>
+    struct result {
+        typedef typename std::conditional<std::is_lvalue_reference<R>::value,
+            std::reference_wrapper<typename std::remove_reference<R>::type>,
+            typename std::remove_cv<typename std::remove_reference<R>::type>::type>::type value_type;
+        typedef std::optional<value_type> type;
+    };
+
+    // completion signature of ThreadPool::async_enqueue
+    template<class R>
+    struct completion { typedef void type(std::exception_ptr, typename result<R>::type); };
+
+    template<>
+    struct completion<void> { typedef void type(std::exception_ptr); };
+
+}
+
+// ThreadPool
+// Every worker owns a deque. Tasks submitted from a worker go to its own
+// deque, others are spread round robin. A worker runs its own deque from the
+// front and, when that is empty, steals from the back of the others before
+// it sleeps, so one mutex is never shared by all producers and consumers.
+// enqueue() keeps the future based interface; post() is fire and forget and
+// builds no future; bulk_enqueue() and parallel_for() split an index range
+// into chunks pushed with one lock per deque; async_enqueue() delivers the
+// result to an asio completion token on the caller's executor.
+// An exception leaving a posted task ends the process, as with std::thread.
 class ThreadPool {
 public:
-    ThreadPool(size_t);
+    explicit ThreadPool(size_t threads = std::thread::hardware_concurrency());
     template<class F, class... Args>
-    auto enqueue(F&& f, Args&&... args) 
+    auto enqueue(F&& f, Args&&... args)
         -> std::future<typename std::invoke_result<F, Args...>::type>;
+    template<class F, class... Args>
+    void post(F&& f, Args&&... args);
+    template<class Index, class F>
+    std::future<void> bulk_enqueue(Index first, Index last, F f, Index grain = 0);
+    template<class Index, class F>
+    void parallel_for(Index first, Index last, F f, Index grain = 0);
+    template<class Executor, class F, class CompletionToken>
+    auto async_enqueue(const Executor& ex, F&& f, CompletionToken&& token);
     ~ThreadPool();
+
+    size_t size() const { return this->count_; }
+
+    // no new work is accepted, queued tasks still run
+    void Stop() {
+        {
+            std::unique_lock<std::mutex> lock(idle_mutex_);
+            stop = true;
+        }
+        condition.notify_all();
+    }
 private:
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::deque<PoolTask> tasks;
+    };
+
+    // the pool and deque of the calling thread when it is a worker
+    struct Current {
+        ThreadPool* pool;
+        size_t index;
+    };
+
+    static Current& current() {
+        static thread_local Current self = { nullptr, 0 };
+        return self;
+    }
+
+    void push(PoolTask task);
+    void push_bulk(std::vector<PoolTask>& tasks);
+    void reserve(size_t count);
+    void wake(size_t count);
+    bool take(size_t self, PoolTask& task);
+    void run(size_t self);
+
     // need to keep track of threads so we can join them
     std::vector< std::thread > workers;
-    // the task queue
-    std::queue< std::function<void()> > tasks;
-    
+    // one task deque per worker
+    std::unique_ptr<Queue[]> queues_;
+    size_t count_;
+    std::atomic<size_t> next_ = { 0 };
+    // queued and not yet taken, counted before the push
+    std::atomic<size_t> pending_ = { 0 };
+    std::atomic<size_t> idle_ = { 0 };
+
     // synchronization
-    std::mutex queue_mutex;
+    std::mutex idle_mutex_;
     std::condition_variable condition;
-    bool stop;
-public:
-    void Stop() {
-		std::unique_lock<std::mutex> lock(queue_mutex);
-		stop = true;
-    }
+    std::atomic<bool> stop;
 };
- 
+
 // the constructor just launches some amount of workers
 inline ThreadPool::ThreadPool(size_t threads)
-    :   stop(false)
+    :   count_(threads ? threads : 1), stop(false)
 {
-    for(size_t i = 0;i<threads;++i)
-        workers.emplace_back(
-            [this]
-            {
-                for(;;)
-                {
-                    std::function<void()> task;
-
-                    {
-                        std::unique_lock<std::mutex> lock(this->queue_mutex);
-                        this->condition.wait(lock,
-                            [this]{ return this->stop || !this->tasks.empty(); });
-                        if(this->stop && this->tasks.empty())
-                            return;
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
-                    }
-
-                    task();
-                }
-            }
-        );
+    queues_.reset(new Queue[count_]);
+    for(size_t i = 0;i<count_;++i)
+        workers.emplace_back([this, i] { this->run(i); });
+}
+
+inline void ThreadPool::run(size_t self)
+{
+    current() = Current{ this, self };
+    for(;;)
+    {
+        PoolTask task;
+        if(this->take(self, task))
+        {
+            task();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(this->idle_mutex_);
+        this->idle_.fetch_add(1);
+        this->condition.wait(lock,
+            [this]{ return this->stop || this->pending_.load() > 0; });
+        this->idle_.fetch_sub(1);
+        if(this->stop && this->pending_.load() == 0)
+            return;
+    }
+}
+
+// own deque from the front, the others from the back
+inline bool ThreadPool::take(size_t self, PoolTask& task)
+{
+    for(size_t i = 0;i<count_;++i)
+    {
+        Queue& queue = queues_[(self + i) % count_];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if(queue.tasks.empty())
+            continue;
+        if(i == 0)
+        {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        else
+        {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        pending_.fetch_sub(1);
+        return true;
+    }
+    return false;
+}
+
+// counted before the push so a concurrent take never goes below zero, and
+// checked against stop after counting so a stopping worker either sees the
+// count or the producer sees stop
+inline void ThreadPool::reserve(size_t count)
+{
+    pending_.fetch_add(count);
+    if(stop)
+    {
+        pending_.fetch_sub(count);
+        // don't allow enqueueing after stopping the pool
+        throw std::runtime_error("enqueue on stopped ThreadPool");
+    }
+}
+
+inline void ThreadPool::wake(size_t count)
+{
+    if(idle_.load() == 0)
+        return;
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    if(count > 1)
+        condition.notify_all();
+    else
+        condition.notify_one();
+}
+
+inline void ThreadPool::push(PoolTask task)
+{
+    reserve(1);
+    const Current& self = current();
+    const size_t index = self.pool == this ? self.index : next_.fetch_add(1) % count_;
+    {
+        std::lock_guard<std::mutex> lock(queues_[index].mutex);
+        queues_[index].tasks.push_back(std::move(task));
+    }
+    wake(1);
+}
+
+// tasks[i] goes to deque (start + i) % count_, one lock per deque
+inline void ThreadPool::push_bulk(std::vector<PoolTask>& tasks)
+{
+    if(tasks.empty())
+        return;
+    reserve(tasks.size());
+    const size_t start = next_.fetch_add(1);
+    for(size_t q = 0;q<count_ && q<tasks.size();++q)
+    {
+        Queue& queue = queues_[(start + q) % count_];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        for(size_t i = q;i<tasks.size();i += count_)
+            queue.tasks.push_back(std::move(tasks[i]));
+    }
+    wake(tasks.size());
 }
 
 // add new work item to the pool
 template<class F, class... Args>
-auto ThreadPool::enqueue(F&& f, Args&&... args) 
+auto ThreadPool::enqueue(F&& f, Args&&... args)
     -> std::future<typename std::invoke_result<F, Args...>::type>
 {
     using return_type = typename std::invoke_result<F, Args...>::type;
 
-    auto task = std::make_shared< std::packaged_task<return_type()> >(
-            std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-        );
-        
-    std::future<return_type> res = task->get_future();
+    // arguments are stored and passed as lvalues, as std::bind did
+    std::packaged_task<return_type()> task(
+        [f = std::forward<F>(f), args = std::make_tuple(std::forward<Args>(args)...)]() mutable
+        { return std::apply(f, args); });
+
+    std::future<return_type> res = task.get_future();
+    push(PoolTask(std::move(task)));
+    return res;
+}
+
+// add new work item to the pool, without a future
+template<class F, class... Args>
+void ThreadPool::post(F&& f, Args&&... args)
+{
+    if constexpr (sizeof...(Args) == 0)
+        push(PoolTask(std::forward<F>(f)));
+    else
+        push(PoolTask(
+            [f = std::forward<F>(f), args = std::make_tuple(std::forward<Args>(args)...)]() mutable
+            { std::apply(f, args); }));
+}
+
+// f(i) for every i in [first, last), split into chunks of grain indices
+// (0 picks about four chunks per worker). The future holds the first
+// exception thrown by any chunk.
+template<class Index, class F>
+std::future<void> ThreadPool::bulk_enqueue(Index first, Index last, F f, Index grain)
+{
+    struct Batch {
+        Batch(F&& fn, size_t chunks) : f(std::move(fn)), left(chunks) {}
+        F f;
+        std::atomic<size_t> left;
+        std::atomic<bool> failed = { false };
+        std::exception_ptr error;
+        std::promise<void> done;
+    };
+
+    if(!(first < last))
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        std::promise<void> done;
+        done.set_value();
+        return done.get_future();
+    }
+    const size_t total = static_cast<size_t>(last - first);
+    size_t step = static_cast<size_t>(grain);
+    if(step == 0)
+        step = (std::max)(size_t(1), total / (count_ * 4));
+    const size_t chunks = (total + step - 1) / step;
 
-        // don't allow enqueueing after stopping the pool
-        if(stop)
-            throw std::runtime_error("enqueue on stopped ThreadPool");
+    auto batch = std::make_shared<Batch>(std::move(f), chunks);
+    std::future<void> res = batch->done.get_future();
 
-        tasks.emplace([task](){ (*task)(); });
+    std::vector<PoolTask> tasks;
+    tasks.reserve(chunks);
+    for(size_t c = 0;c<chunks;++c)
+    {
+        const Index lo = static_cast<Index>(first + static_cast<Index>(c * step));
+        const Index hi = c + 1 == chunks ? last : static_cast<Index>(lo + static_cast<Index>(step));
+        tasks.emplace_back([batch, lo, hi]
+        {
+            try
+            {
+                for(Index i = lo;i<hi;++i)
+                    batch->f(i);
+            }
+            catch(...)
+            {
+                if(!batch->failed.exchange(true))
+                    batch->error = std::current_exception();
+            }
+            if(batch->left.fetch_sub(1) == 1)
+            {
+                if(batch->error)
+                    batch->done.set_exception(batch->error);
+                else
+                    batch->done.set_value();
+            }
+        });
     }
-    condition.notify_one();
+    push_bulk(tasks);
     return res;
 }
 
-// the destructor joins all threads
-inline ThreadPool::~ThreadPool()
+// bulk_enqueue() and wait; the calling thread runs queued chunks while it
+// waits, so a worker may call it without starving the pool
+template<class Index, class F>
+void ThreadPool::parallel_for(Index first, Index last, F f, Index grain)
 {
+    std::future<void> res = bulk_enqueue(first, last, std::move(f), grain);
+    const Current& self = current();
+    const size_t index = self.pool == this ? self.index : 0;
+    while(res.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop = true;
+        PoolTask task;
+        if(!take(index, task))
+            break; // the rest is already running on the workers
+        task();
     }
-    condition.notify_all();
+    res.get();
+}
+
+// Runs f() on the pool and completes token with (std::exception_ptr,
+// std::optional<R>), or (std::exception_ptr) for void, on the handler's
+// associated executor, ex when it has none. The result is built in place
+// in the optional, which is empty when f() throws, so R needs neither a
+// default constructor nor assignment. use_future yields std::optional<R>.
+// Outstanding work is held on that executor while f runs, so an io_context
+// does not run out of work in between.
+template<class Executor, class F, class CompletionToken>
+auto ThreadPool::async_enqueue(const Executor& ex, F&& f, CompletionToken&& token)
+{
+    using return_type = typename std::invoke_result<typename std::decay<F>::type&>::type;
+    using signature = typename thread_pool_detail::completion<return_type>::type;
+
+    return asio::async_initiate<CompletionToken, signature>(
+        [this, ex](auto handler, auto f)
+        {
+            auto work = asio::make_work_guard(handler, ex);
+            post([handler = std::move(handler), work = std::move(work), f = std::move(f)]() mutable
+            {
+                std::exception_ptr error;
+                if constexpr (std::is_void<return_type>::value)
+                {
+                    try { f(); } catch(...) { error = std::current_exception(); }
+                    asio::post(work.get_executor(), asio::append(std::move(handler), error));
+                }
+                else
+                {
+                    typename thread_pool_detail::result<return_type>::type value;
+                    try { value.emplace(f()); } catch(...) { error = std::current_exception(); }
+                    asio::post(work.get_executor(),
+                        asio::append(std::move(handler), error, std::move(value)));
+                }
+                work.reset();
+            });
+        },
+        token, std::forward<F>(f));
+}
+
+// the destructor joins all threads
+inline ThreadPool::~ThreadPool()
+{
+    Stop();
     for(std::thread &worker: workers)
         worker.join();
 }
 
+
 #else
 
 class ThreadPool {
@@ -5,12 +5,20 @@
 
 #ifndef __TIMER_HPP__
 #define __TIMER_HPP__
+#include <asio/extend/base.hpp>
 #include <asio/extend/worker.hpp>
 #include <asio/time_traits.hpp>
 #include <asio/io_context.hpp>
+#include <asio/executor_work_guard.hpp>
+#include <asio/post.hpp>
 #include <asio/steady_timer.hpp>
 #include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
 #include <optional>
+#include <vector>
 #include <cstddef>
 #include <iostream>
 #include <chrono>
@@ -57,14 +65,41 @@ namespace asio {
 	// duration_cast<milliseconds>(t.elapsed()).count() << "ms";
 
 	// Async timer
+	// Once() / Every() return a TimerId and run the task on the timer
+	// thread; they and Cancel() may be called from any thread. Other
+	// threads hand their requests over through a lock free stack drained
+	// by one posted handler, calls from a task apply at once. Deadlines sit
+	// in one min heap behind one steady_timer, cancelled entries are
+	// skipped when they come up. The named steady_timers of GetTimer() /
+	// InsertTimer() stay for existing callers, now under a lock.
 	class AsioTimer : public Worker
 	{
 		using io_timer = std::shared_ptr<asio::steady_timer>;
 	public:
-		AsioTimer() noexcept {}
-		~AsioTimer() {}
+		typedef std::chrono::steady_clock clock;
+		typedef uint64 TimerId;  // 0 never names a timer
+		typedef std::function<void()> Task;
+
+		AsioTimer() noexcept
+			: work_(asio::make_work_guard(ioc_))
+			, alarm_(ioc_)
+			, armed_(clock::time_point::max())
+		{
+		}
+
+		~AsioTimer()
+		{
+			Command* command = this->take_commands();
+			while (command)
+			{
+				Command* next = command->next;
+				delete command;
+				command = next;
+			}
+		}
 
 		void Stop() {
+			this->work_.reset();
 			if (!this->ioc_.stopped())
 			{
 				this->ioc_.stop();
@@ -77,7 +112,45 @@ namespace asio {
 			return ioc_;
 		}
 
+		// runs task once after delay
+		TimerId Once(std::chrono::milliseconds delay, Task task)
+		{
+			return this->schedule(delay, std::chrono::milliseconds(0), std::move(task));
+		}
+
+		// Runs task every interval, the first time after one interval. Fixed
+		// rate: the k-th run is due at start + k * interval however long the
+		// runs take, and periods lost to a stall are skipped, not bunched.
+		TimerId Every(std::chrono::milliseconds interval, Task task)
+		{
+			if (interval.count() <= 0)
+			{
+				interval = std::chrono::milliseconds(1);
+			}
+			return this->schedule(interval, interval, std::move(task));
+		}
+
+		// a task already running finishes, a recurring one does not come back
+		void Cancel(TimerId id)
+		{
+			if (id == 0)
+			{
+				return;
+			}
+			Command* command = new Command();
+			command->id = id;
+			command->cancel = true;
+			this->submit(command);
+		}
+
+		// timers scheduled and not yet done, as of the timer thread
+		std::size_t Active() const
+		{
+			return this->active_.load(std::memory_order_relaxed);
+		}
+
 		auto GetTimer(const std::string &key_name) -> io_timer {
+			std::lock_guard lock(this->mutex_);
 			auto it = timer_list_.find(key_name);
 			if (it != timer_list_.end())
 			{
@@ -87,6 +160,7 @@ namespace asio {
 		}
 
 		auto& InsertTimer(const std::string &key_name) {
+			std::lock_guard lock(this->mutex_);
 			auto it = timer_list_.find(key_name);
 			if (it != timer_list_.end())
 			{
@@ -98,6 +172,7 @@ namespace asio {
 		}
 
 		void RemoveTimer(const std::string &key_name) {
+			std::lock_guard lock(this->mutex_);
 			const auto it = timer_list_.find(key_name);
 			if (it != timer_list_.end()) {
 				this->timer_list_.erase(it);
@@ -112,12 +187,206 @@ namespace asio {
 		}
 
 		void Clear() {
+			std::lock_guard lock(this->mutex_);
 			timer_list_.clear();
 		}
 
+	private:
+		// one request on its way to the timer thread
+		struct Command
+		{
+			Command* next = { nullptr };
+			TimerId id = { 0 };
+			clock::time_point at;
+			std::chrono::milliseconds interval = { std::chrono::milliseconds(0) };
+			Task task;
+			bool cancel = { false };
+		};
+
+		struct Entry
+		{
+			clock::time_point at;
+			std::chrono::milliseconds interval;
+			Task task;
+		};
+
+		struct Deadline
+		{
+			clock::time_point at;
+			TimerId id;
+		};
+
+		static bool later(const Deadline& a, const Deadline& b)
+		{
+			return a.at > b.at;
+		}
+
+		TimerId schedule(std::chrono::milliseconds delay, std::chrono::milliseconds interval, Task task)
+		{
+			Command* command = new Command();
+			command->id = this->next_id_.fetch_add(1, std::memory_order_relaxed);
+			command->at = clock::now() + delay;
+			command->interval = interval;
+			command->task = std::move(task);
+			const TimerId id = command->id;
+			this->submit(command);
+			return id;
+		}
+
+		// the first request into an empty stack posts the drain
+		void submit(Command* command)
+		{
+			Command* head = this->commands_.load(std::memory_order_relaxed);
+			do
+			{
+				command->next = head;
+			} while (!this->commands_.compare_exchange_weak(head, command,
+				std::memory_order_release, std::memory_order_relaxed));
+			if (this->ioc_.get_executor().running_in_this_thread())
+			{
+				this->drain();
+			}
+			else if (head == nullptr)
+			{
+				asio::post(this->ioc_, [this]() { this->drain(); });
+			}
+		}
+
+		// swaps the stack out, oldest first
+		Command* take_commands()
+		{
+			Command* command = this->commands_.exchange(nullptr, std::memory_order_acquire);
+			Command* ordered = nullptr;
+			while (command)
+			{
+				Command* next = command->next;
+				command->next = ordered;
+				ordered = command;
+				command = next;
+			}
+			return ordered;
+		}
+
+		// timer thread
+		void drain()
+		{
+			Command* command = this->take_commands();
+			while (command)
+			{
+				Command* next = command->next;
+				if (command->cancel)
+				{
+					if (this->entries_.erase(command->id) != 0)
+					{
+						this->active_.fetch_sub(1, std::memory_order_relaxed);
+					}
+				}
+				else
+				{
+					if (this->deadlines_.size() >= 2 * this->entries_.size() + 64)
+					{
+						this->purge();
+					}
+					this->entries_.emplace(command->id, Entry{ command->at, command->interval, std::move(command->task) });
+					this->deadlines_.push_back(Deadline{ command->at, command->id });
+					std::push_heap(this->deadlines_.begin(), this->deadlines_.end(), later);
+					this->active_.fetch_add(1, std::memory_order_relaxed);
+				}
+				delete command;
+				command = next;
+			}
+			this->arm();
+		}
+
+		// drops heap entries of cancelled timers
+		void purge()
+		{
+			auto end = std::remove_if(this->deadlines_.begin(), this->deadlines_.end(),
+				[this](const Deadline& d) { return this->entries_.find(d.id) == this->entries_.end(); });
+			this->deadlines_.erase(end, this->deadlines_.end());
+			std::make_heap(this->deadlines_.begin(), this->deadlines_.end(), later);
+		}
+
+		// waits for the earliest deadline unless the alarm already does
+		void arm()
+		{
+			const clock::time_point at = this->deadlines_.empty() ? clock::time_point::max() : this->deadlines_.front().at;
+			if (at == this->armed_)
+			{
+				return;
+			}
+			this->armed_ = at;
+			if (at == clock::time_point::max())
+			{
+				this->alarm_.cancel();
+				return;
+			}
+			this->alarm_.expires_at(at);
+			this->alarm_.async_wait([this](std::error_code ec)
+				{
+					if (ec != asio::error::operation_aborted)
+					{
+						this->armed_ = clock::time_point::max();
+						this->expire();
+					}
+				});
+		}
+
+		void expire()
+		{
+			const clock::time_point now = clock::now();
+			while (!this->deadlines_.empty() && this->deadlines_.front().at <= now)
+			{
+				const Deadline due = this->deadlines_.front();
+				std::pop_heap(this->deadlines_.begin(), this->deadlines_.end(), later);
+				this->deadlines_.pop_back();
+				auto it = this->entries_.find(due.id);
+				if (it == this->entries_.end())
+				{
+					continue;
+				}
+				Entry& entry = it->second;
+				if (entry.interval.count() == 0)
+				{
+					Task task = std::move(entry.task);
+					this->entries_.erase(it);
+					this->active_.fetch_sub(1, std::memory_order_relaxed);
+					task();
+					continue;
+				}
+				// next slot on the original grid, past the ones already missed
+				entry.at += entry.interval;
+				if (entry.at <= now)
+				{
+					entry.at += entry.interval * ((now - entry.at) / entry.interval + 1);
+				}
+				this->deadlines_.push_back(Deadline{ entry.at, due.id });
+				std::push_heap(this->deadlines_.begin(), this->deadlines_.end(), later);
+				// the task may cancel itself while it runs
+				Task task = std::move(entry.task);
+				task();
+				it = this->entries_.find(due.id);
+				if (it != this->entries_.end())
+				{
+					it->second.task = std::move(task);
+				}
+			}
+			this->arm();
+		}
+
 	private:
 		asio::io_context ioc_;
+		asio::executor_work_guard<asio::io_context::executor_type> work_;
+		std::mutex mutex_;
 		std::unordered_map<std::string, io_timer> timer_list_;
+		// handle timers, touched on the timer thread only
+		asio::steady_timer alarm_;
+		clock::time_point armed_;
+		std::unordered_map<TimerId, Entry> entries_;
+		std::vector<Deadline> deadlines_;
+		std::atomic<Command*> commands_ = { nullptr };
+		std::atomic<TimerId> next_id_ = { 1 };
+		std::atomic<std::size_t> active_ = { 0 };
 	};
 
 }
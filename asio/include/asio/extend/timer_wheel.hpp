@@ -0,0 +1,427 @@
+//
+// timer_wheel.hpp
+// hierarchical timing wheel per io_context, idle session expiry
+//
+
+#ifndef __TIMER_WHEEL_HPP__
+#define __TIMER_WHEEL_HPP__
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <system_error>
+#include <utility>
+#include <asio/execution_context.hpp>
+#include <asio/io_context.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/extend/base.hpp>
+
+namespace asio {
+
+	class TimerWheel;
+
+	// links of the intrusive slot lists, a slot head is a bare link
+	struct WheelLink
+	{
+		WheelLink* prev_ = { nullptr };
+		WheelLink* next_ = { nullptr };
+	};
+
+	// WheelTimer
+	// One entry of a TimerWheel, embedded in its owner so arming never
+	// allocates. Armed, cancelled and destroyed on the wheel's thread.
+	class WheelTimer : private WheelLink
+	{
+		friend class TimerWheel;
+	public:
+		WheelTimer() = default;
+		WheelTimer(const WheelTimer&) = delete;
+		WheelTimer& operator=(const WheelTimer&) = delete;
+
+		virtual ~WheelTimer()
+		{
+			this->cancel();
+		}
+
+		bool armed() const
+		{
+			return this->next_ != nullptr;
+		}
+
+		// tick it fires at
+		uint64 deadline() const
+		{
+			return this->deadline_;
+		}
+
+		inline void cancel();
+
+	protected:
+		// the entry is no longer armed and may arm itself again
+		virtual void expire() = 0;
+
+	private:
+		TimerWheel* wheel_ = { nullptr };
+		uint64 deadline_ = { 0 };
+	};
+
+	// TimerWheel
+	// Four levels of 64 slots, one io_context service per context, so every
+	// session of a shard shares one steady_timer instead of putting its own
+	// entry into the timer queue heap. arm(), re-arm and cancel() are O(1)
+	// list operations; entries of an upper level move down once when their
+	// slot comes round. The timer only runs while entries are armed, an
+	// empty wheel does not keep run() from returning. Use it from the
+	// thread running the context.
+	class TimerWheel
+		: public asio::detail::execution_context_service_base<TimerWheel>
+	{
+	public:
+		static constexpr int level_bits = 6;
+		static constexpr int slots      = 1 << level_bits;
+		static constexpr int levels     = 4;
+
+		explicit TimerWheel(asio::io_context& context)
+			: asio::detail::execution_context_service_base<TimerWheel>(context)
+			, timer_(context)
+			, start_(std::chrono::steady_clock::now())
+		{
+			for (auto& level : this->slots_)
+			{
+				for (auto& slot : level)
+				{
+					slot.prev_ = slot.next_ = &slot;
+				}
+			}
+		}
+
+		// the wheel of a context, created on first use
+		static TimerWheel& of(asio::io_context& context)
+		{
+			return asio::use_service<TimerWheel>(context);
+		}
+
+		// length of one tick, 100ms by default; applies while nothing is armed
+		void set_resolution(std::chrono::milliseconds resolution)
+		{
+			if (this->size_ != 0)
+			{
+				return;
+			}
+			this->resolution_ = resolution.count() > 0 ? resolution : std::chrono::milliseconds(1);
+			this->start_ = std::chrono::steady_clock::now() - this->resolution_ * this->now();
+		}
+
+		std::chrono::milliseconds resolution() const
+		{
+			return this->resolution_;
+		}
+
+		// coarse clock in ticks, advanced by the wheel's timer; reading it is
+		// one relaxed load from any thread
+		uint64 now() const
+		{
+			return this->now_.load(std::memory_order_relaxed);
+		}
+
+		// whole ticks covering d, at least one
+		uint64 ticks(std::chrono::milliseconds d) const
+		{
+			const int64 count = d.count() <= 0 ? 1 : (d.count() + this->resolution_.count() - 1) / this->resolution_.count();
+			return static_cast<uint64>(count);
+		}
+
+		// fires after d, an armed entry moves
+		void arm(WheelTimer& entry, std::chrono::milliseconds d)
+		{
+			this->sync();
+			this->arm_at(entry, this->now() + this->ticks(d));
+		}
+
+		// fires at tick, no earlier than the next one
+		void arm_at(WheelTimer& entry, uint64 tick)
+		{
+			this->sync();
+			if (entry.armed())
+			{
+				unlink(&entry);
+			}
+			else
+			{
+				++this->size_;
+			}
+			entry.wheel_ = this;
+			entry.deadline_ = tick > this->now() ? tick : this->now() + 1;
+			this->place(&entry);
+			if (!this->running_)
+			{
+				this->running_ = true;
+				this->wait();
+			}
+		}
+
+		void cancel(WheelTimer& entry)
+		{
+			if (entry.armed())
+			{
+				unlink(&entry);
+				entry.prev_ = entry.next_ = nullptr;
+				--this->size_;
+			}
+		}
+
+		// armed entries
+		std::size_t size() const
+		{
+			return this->size_;
+		}
+
+		// Moves the clock count ticks ahead as if that time had passed and
+		// runs them at once, for tests and simulated time. The pending wait
+		// stays as it is and finds nothing left to catch up.
+		void fast_forward(uint64 count)
+		{
+			this->start_ -= this->resolution_ * count;
+			if (!this->running_)
+			{
+				this->sync();
+				return;
+			}
+			const uint64 target = this->elapsed();
+			while (this->now() < target && this->size_ != 0)
+			{
+				this->tick();
+			}
+		}
+
+	private:
+		void shutdown() override
+		{
+			for (auto& level : this->slots_)
+			{
+				for (auto& slot : level)
+				{
+					while (slot.next_ != &slot)
+					{
+						WheelLink* link = slot.next_;
+						unlink(link);
+						link->prev_ = link->next_ = nullptr;
+					}
+				}
+			}
+			this->size_ = 0;
+			this->running_ = false;
+			this->timer_.cancel();
+		}
+
+		static void unlink(WheelLink* link)
+		{
+			link->prev_->next_ = link->next_;
+			link->next_->prev_ = link->prev_;
+		}
+
+		static void push_back(WheelLink& head, WheelLink* link)
+		{
+			link->prev_ = head.prev_;
+			link->next_ = &head;
+			head.prev_->next_ = link;
+			head.prev_ = link;
+		}
+
+		// moves the whole list of from onto the empty head to
+		static void splice(WheelLink& from, WheelLink& to)
+		{
+			to.prev_ = to.next_ = &to;
+			if (from.next_ == &from)
+			{
+				return;
+			}
+			to.next_ = from.next_;
+			to.prev_ = from.prev_;
+			to.next_->prev_ = &to;
+			to.prev_->next_ = &to;
+			from.prev_ = from.next_ = &from;
+		}
+
+		// slot of the lowest level whose span covers the deadline; past the
+		// top level it waits in the farthest slot and is placed again. A
+		// cascade runs before the tick's own slot, so deadline now still fires.
+		void place(WheelTimer* entry)
+		{
+			const uint64 now = this->now();
+			uint64 deadline = entry->deadline_ > now ? entry->deadline_ : now;
+			const uint64 delta = deadline - now;
+			int level = 0;
+			while (level < levels - 1 && delta >= (uint64(1) << (level_bits * (level + 1))))
+			{
+				++level;
+			}
+			const uint64 span = uint64(1) << (level_bits * levels);
+			if (delta >= span)
+			{
+				deadline = now + span - 1;
+			}
+			const int index = static_cast<int>((deadline >> (level_bits * level)) & (slots - 1));
+			push_back(this->slots_[level][index], entry);
+		}
+
+		// one tick: cascade the upper slots that came round, then fire
+		void tick()
+		{
+			const uint64 now = this->now() + 1;
+			this->now_.store(now, std::memory_order_relaxed);
+			for (int level = 1; level < levels; ++level)
+			{
+				if (((now >> (level_bits * (level - 1))) & (slots - 1)) != 0)
+				{
+					break;
+				}
+				WheelLink moving;
+				splice(this->slots_[level][(now >> (level_bits * level)) & (slots - 1)], moving);
+				while (moving.next_ != &moving)
+				{
+					WheelTimer* entry = static_cast<WheelTimer*>(moving.next_);
+					unlink(entry);
+					this->place(entry);
+				}
+			}
+			// expire() may cancel or arm any entry, the due list stays consistent
+			WheelLink due;
+			splice(this->slots_[0][now & (slots - 1)], due);
+			while (due.next_ != &due)
+			{
+				WheelTimer* entry = static_cast<WheelTimer*>(due.next_);
+				unlink(entry);
+				if (entry->deadline_ > now)
+				{
+					this->place(entry);
+					continue;
+				}
+				entry->prev_ = entry->next_ = nullptr;
+				--this->size_;
+				entry->expire();
+			}
+		}
+
+		uint64 elapsed() const
+		{
+			const auto d = std::chrono::steady_clock::now() - this->start_;
+			return static_cast<uint64>(d / this->resolution_);
+		}
+
+		// an idle wheel lets the clock stand still, catch up before arming
+		void sync()
+		{
+			if (!this->running_)
+			{
+				const uint64 target = this->elapsed();
+				if (target > this->now())
+				{
+					this->now_.store(target, std::memory_order_relaxed);
+				}
+			}
+		}
+
+		void wait()
+		{
+			this->timer_.expires_at(this->start_ + this->resolution_ * (this->now() + 1));
+			this->timer_.async_wait(
+				[this](std::error_code ec)
+				{
+					if (ec)
+					{
+						this->running_ = false;
+						return;
+					}
+					this->advance();
+				});
+		}
+
+		// runs the ticks that passed, a late wake up catches up at once
+		void advance()
+		{
+			const uint64 target = this->elapsed();
+			while (this->now() < target && this->size_ != 0)
+			{
+				this->tick();
+			}
+			if (this->size_ == 0)
+			{
+				this->running_ = false;
+				this->sync();
+				return;
+			}
+			this->wait();
+		}
+
+	private:
+		asio::steady_timer timer_;
+		std::chrono::steady_clock::time_point start_;
+		std::chrono::milliseconds resolution_ = { std::chrono::milliseconds(100) };
+		std::atomic<uint64> now_ = { 0 };
+		std::size_t size_ = { 0 };
+		bool running_ = { false };
+		WheelLink slots_[levels][slots];
+	};
+
+	inline void WheelTimer::cancel()
+	{
+		if (this->armed())
+		{
+			this->wheel_->cancel(*this);
+		}
+	}
+
+	// IdleTimer
+	// Calls on_idle once touch() has not been called for the timeout.
+	// touch() only stores the wheel's coarse tick, no clock read and no
+	// wheel operation; an entry that comes due after recent traffic is
+	// armed again for the rest of the timeout.
+	class IdleTimer : public WheelTimer
+	{
+	public:
+		using Callback = std::function<void()>;
+
+		void start(TimerWheel& wheel, std::chrono::milliseconds timeout, Callback on_idle)
+		{
+			this->owner_ = &wheel;
+			this->timeout_ = wheel.ticks(timeout);
+			this->on_idle_ = std::move(on_idle);
+			wheel.arm(*this, timeout);
+			this->touch();
+		}
+
+		// traffic seen, any thread
+		void touch()
+		{
+			if (this->owner_)
+			{
+				this->last_.store(this->owner_->now(), std::memory_order_relaxed);
+			}
+		}
+
+	protected:
+		void expire() override
+		{
+			const uint64 due = this->last_.load(std::memory_order_relaxed) + this->timeout_;
+			if (due > this->owner_->now())
+			{
+				this->owner_->arm_at(*this, due);
+				return;
+			}
+			if (this->on_idle_)
+			{
+				this->on_idle_();
+			}
+		}
+
+	private:
+		TimerWheel* owner_ = { nullptr };
+		uint64 timeout_ = { 0 };
+		std::atomic<uint64> last_ = { 0 };
+		Callback on_idle_;
+	};
+
+}
+
+#endif // __TIMER_WHEEL_HPP__
@@ -4,13 +4,19 @@
 #include <asio/extend/object.hpp>
 #include <asio/msgdef/message.hpp>
 #include <asio/extend/base.hpp>
-#include <map>
-#include <set>
-#include <unordered_map>
+#include <asio/extend/typedef.hpp>
+#include <asio/extend/session_table.hpp>
+#include <asio/extend/broadcast.hpp>
+#include <asio/msgdef/payload.hpp>
+#include <deque>
+#include <mutex>
 
 namespace asio {
 	// One server one room
 	// Server -> Room
+	// Sessions join and leave from the I/O threads while game logic looks
+	// them up from workers; the sharded SessionTable keeps both sides off a
+	// global lock.
 	class NetObject;
 	class ServerUser final : protected NoCopyObj
 	{
@@ -18,74 +24,100 @@ namespace asio {
 		typedef std::shared_ptr<NetObject> NetObjectPtr;
 		typedef std::weak_ptr<NetObject>   NetObjectWeakPtr;
 
-		typedef std::set<NetObjectPtr> ObjList;
-		typedef std::unordered_map<uint64, NetObjectWeakPtr> SessionObjMap;// session id -> NetObject
+		typedef SessionTable::ObjVector    ObjList;
 		ServerUser() {}
 		~ServerUser() {}
 
+		// Join / Leave run on every I/O shard thread
 		void Join(NetObjectPtr obj)
 		{
-			obj_list_.insert(obj);
-			/*
-			for (const auto& msg : recent_msgs_)
-			{
-				obj->Deliver(msg);
-			}
-			*/
 			const uint64 sessionId = obj->getSessionId();
-			session_obj_map_[sessionId] = obj;
+			this->sessions_.Insert(sessionId, obj);
+			//this->ReplayRecent(obj);
 		}
 
 		void Leave(NetObjectPtr obj)
 		{
-			obj_list_.erase(obj);
-			session_obj_map_.erase(obj->getSessionId());
+			this->sessions_.Erase(obj->getSessionId(), obj.get());
 		}
 
 		// find Object by session id
-		bool FindObjBySessionId(NetObjectWeakPtr ptr, const uint64& sessionId)
+		bool FindObjBySessionId(NetObjectWeakPtr& ptr, const uint64& sessionId)
 		{
-			auto it = this->session_obj_map_.find(sessionId);
-			if (it != this->session_obj_map_.end())
+			NetObjectPtr obj = this->sessions_.Find(sessionId);
+			if (obj)
 			{
-				ptr = it->second;
+				ptr = obj;
 				return true;
 			}
 			return false;
 		}
 
-		ObjList& GetObjList() {
-			return this->obj_list_;
+		NetObjectPtr Find(const uint64& sessionId) const
+		{
+			return this->sessions_.Find(sessionId);
 		}
 
-		SessionObjMap& GetSessionMap() {
-			return this->session_obj_map_;
+		std::size_t Size() const
+		{
+			return this->sessions_.Size();
 		}
-	private:
+
+		// flat copy of the current sessions
+		ObjList GetObjList() const
+		{
+			ObjList list;
+			list.reserve(this->sessions_.Size());
+			this->sessions_.ForEach([&list](const NetObjectPtr& obj) { list.push_back(obj); });
+			return list;
+		}
+
+		SessionTable& GetSessionTable() {
+			return this->sessions_;
+		}
+
+		// message boardcast, encoded once and shared by every session
 		void Deliver(const Message& msg)
 		{
-			while (recent_msgs_.size() > max_recent_msgs)
-			{
-				recent_msgs_.pop_front();
-			}
-			// message boardcast
-			for (auto& obj : obj_list_)
+			this->Deliver(MsgCompression::Encode(msg));
+		}
+
+		void Deliver(const PayloadPtr& payload)
+		{
 			{
-				if (obj)
+				std::lock_guard lock(this->recent_mutex_);
+				this->recent_msgs_.push_back(payload);
+				while (this->recent_msgs_.size() > max_recent_msgs)
 				{
-					obj->Post(msg);
+					this->recent_msgs_.pop_front();
 				}
 			}
+			this->broadcaster_.Deliver(payload, this->sessions_.Snapshot());
+		}
+
+		// send the last broadcasts to a late joiner
+		void ReplayRecent(const NetObjectPtr& obj)
+		{
+			std::lock_guard lock(this->recent_mutex_);
+			for (const auto& payload : this->recent_msgs_)
+			{
+				obj->PostShared(payload);
+			}
+		}
+
+		// slow consumer policy and queue limit, set before broadcasting
+		void SetBroadcastOptions(const BroadcastOptions& options)
+		{
+			this->broadcaster_.SetOptions(options);
 		}
 
 	private:
-		// net user
-		ObjList   obj_list_;
+		// net user, guid session map
+		SessionTable sessions_;
+		Broadcaster broadcaster_;
 		enum { max_recent_msgs = 100 };
-		MessageQueue recent_msgs_;
-
-		// guid session map
-		SessionObjMap session_obj_map_;
+		std::mutex recent_mutex_;
+		std::deque<PayloadPtr> recent_msgs_;
 	};
 
 
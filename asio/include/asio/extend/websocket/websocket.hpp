@@ -265,6 +265,7 @@ private:
 		// step 4 check
 		//int header_size = sizeof(asio::MsgHeader);
 		asio::Message *msg = &this->read_msg_;
+		msg->reserve(static_cast<int>(buffer_.size()));
 		std::memcpy(msg->data(), buffer_.data().data(), buffer_.size());
 		if (!msg->decode_header())
 		{
@@ -32,6 +32,9 @@
 #include <asio/extend/object.hpp>
 #include <asio/extend/worker.hpp>
 #include <asio/extend/typedef.hpp>
+#include <asio/extend/write_queue.hpp>
+#include <asio/extend/compress.hpp>
+#include <asio/extend/metrics.hpp>
 using namespace asio;
 
 namespace beast = boost::beast;         // from <boost/beast.hpp>
@@ -49,7 +52,7 @@ private:
     websocket::stream<beast::tcp_stream> ws_;
     beast::flat_buffer buffer_;
 	Message read_msg_;
-    MessageQueue write_msgs_;
+    WriteQueue write_msgs_;
     std::mutex mutex_;
     NetServer* server_;
 public:
@@ -58,6 +61,7 @@ public:
         : ws_(std::move(socket))
         , server_(server)
     {
+        this->write_msgs_.set_watermarks(server->Watermarks());
         // step 2
         ws_.binary(true);
     }
@@ -82,6 +86,36 @@ public:
         this->write(msg);
     }
 
+    // shared payload, queued by reference
+    void PostShared(const PayloadPtr& payload) override
+    {
+        this->write(payload);
+    }
+
+    // shared payload with a priority for BackpressurePolicy::Drop
+    void PostPriority(const PayloadPtr& payload, uint8 priority) override
+    {
+        this->write(payload, priority);
+    }
+
+    void SetWatermarks(const WatermarkOptions& options) override
+    {
+        std::lock_guard lock(this->mutex_);
+        this->write_msgs_.set_watermarks(options);
+    }
+
+    bool Writable() override
+    {
+        std::lock_guard lock(this->mutex_);
+        return this->write_msgs_.writable();
+    }
+
+    std::size_t PendingBytes() override
+    {
+        std::lock_guard lock(this->mutex_);
+        return this->write_msgs_.bytes();
+    }
+
     // warning error 10009 scope NetObject and socket
     std::string Ip() override
     {
@@ -140,6 +174,7 @@ public:
             return fail(ec, "accept");
 
         // Connect
+        Metrics::Add(Metric::Accepts);
         this->server_->Connect(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()));
 
         // Read a message
@@ -160,19 +195,25 @@ public:
             beast::error_code ec,
             std::size_t bytes_transferred)
     {
-        boost::ignore_unused(bytes_transferred);
-
         // This indicates that the session was closed
         if (ec == websocket::error::closed)
+        {
+            Metrics::Add(Metric::DisconnectEof);
             return;
+        }
 
         if (ec)
+        {
+            Metrics::Add(Metric::DisconnectError);
             return fail(ec, "read");
+        }
 
         // step 3 read complete
         // check max buff length valid
+        Metrics::Add(Metric::BytesIn, bytes_transferred);
         if (this->buffer_.size() > this->read_msg_.max_length())
         {
+            Metrics::Add(Metric::DisconnectProtocol);
 			// Close the WebSocket connection
 			ws_.async_close(websocket::close_code::normal,
 				beast::bind_front_handler(
@@ -182,12 +223,31 @@ public:
         }
 
         // Copy data into message
+		this->read_msg_.reserve(static_cast<int>(buffer_.size()));
 		std::memcpy(this->read_msg_.data(), buffer_.data().data(), buffer_.size());
 		this->read_msg_.decode_header();
+		// with MsgCompression::EnableReceive() compressed bodies are inflated
+		// before the handler sees them
+		if (MsgCompression::ShouldUnpack(*(asio::MsgHeader*)this->read_msg_.data())
+			&& !MsgCompression::Unpack(this->read_msg_,
+				static_cast<const char*>(buffer_.data().data()) + Message::header_length,
+				static_cast<int>(buffer_.size()) - Message::header_length))
+		{
+			Metrics::Add(Metric::DisconnectProtocol);
+			ws_.async_close(websocket::close_code::protocol_error,
+				beast::bind_front_handler(
+					&WebSession::on_close,
+					this->shared_from_this()));
+			return;
+		}
 		asio::MsgHeader* header = ((asio::MsgHeader*)this->read_msg_.data());
 
         // Handle message
-        this->server_->HandleMessage(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()), this->read_msg_);
+        Metrics::Add(Metric::MsgsIn);
+        {
+            HandlerTimer timer(header->msgId);
+            this->server_->HandleMessage(std::dynamic_pointer_cast<NetObject>(this->shared_from_this()), this->read_msg_);
+        }
 
 		//printf("%.*s\n", this->read_msg_.body_length(), this->read_msg_.body());
 		
@@ -223,14 +283,45 @@ public:
 
     void write(const asio::Message& msg)
     {
-        std::lock_guard lock(this->mutex_);
-        bool write_in_progress = !write_msgs_.empty();
-        this->write_msgs_.push_back(msg);
-        if (!write_in_progress) {
-            this->do_write();
+        this->write(MsgCompression::Encode(msg));
+    }
+
+    void write(const PayloadPtr& payload, uint8 priority = 0)
+    {
+        Watermark mark = Watermark::None;
+        {
+            std::lock_guard lock(this->mutex_);
+            bool write_in_progress = !write_msgs_.empty();
+            const Admission admission = this->write_msgs_.offer(PayloadSlice(payload, priority));
+            if (admission != Admission::Queued)
+            {
+                if (admission == Admission::Close)
+                {
+                    // the pending read fails and reports the disconnect
+                    auto self(this->shared_from_this());
+                    net::post(ws_.get_executor(), [self]() { beast::get_lowest_layer(self->ws_).close(); });
+                }
+                return;
+            }
+            mark = this->write_msgs_.watermark();
+            Metrics::Add(Metric::MsgsOut);
+            Metrics::Record(Histogram::WriteQueueBytes, this->write_msgs_.bytes());
+            if (!write_in_progress) {
+                this->do_write();
+            }
         }
+        this->notify(mark);
     }
 
+    void notify(Watermark mark)
+    {
+        if (mark == Watermark::High)
+            this->server_->HighWatermark(this->shared_from_this());
+        else if (mark == Watermark::Low)
+            this->server_->LowWatermark(this->shared_from_this());
+    }
+
+    // one websocket frame per queued message
     void do_write()
     {
         // Send the message
@@ -239,19 +330,24 @@ public:
                 write_msgs_.front().length()),
             [this](beast::error_code ec, std::size_t bytes_transferred)
             {
-                boost::ignore_unused(bytes_transferred);
                 if (ec) {
+                    Metrics::Add(Metric::DisconnectWrite);
                     return fail(ec, "write");
                 }
-                else {
+                Metrics::Add(Metric::BytesOut, bytes_transferred);
+                Metrics::Record(Histogram::WriteBytes, bytes_transferred);
+                Watermark mark = Watermark::None;
+                {
+                    std::lock_guard lock(this->mutex_);
                     if (!write_msgs_.empty()) {
                         this->write_msgs_.pop_front();
                     }
-
+                    mark = this->write_msgs_.watermark();
                     if (!write_msgs_.empty()) {
                         do_write();
                     }
                 }
+                this->notify(mark);
             });
     }
     // Report a failure
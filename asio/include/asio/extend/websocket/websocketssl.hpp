@@ -292,6 +292,7 @@ public:
 
         // step 4 check
 		asio::Message* msg = &this->read_msg_;
+		msg->reserve(static_cast<int>(buffer_.size()));
 		std::memcpy(msg->data(), buffer_.data().data(), buffer_.size());
         if (!msg->decode_header())
         {
@@ -1,5 +1,6 @@
 ﻿#ifndef __WORKER_HPP__
 #define __WORKER_HPP__
+#include <atomic>
 #include <thread>
 #include <iostream>
 #include <functional>
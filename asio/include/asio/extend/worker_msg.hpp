@@ -1,64 +1,162 @@
 #ifndef __WORKER_MSG_HPP__
 #define __WORKER_MSG_HPP__
 #include <asio/extend/worker.hpp>
-#include <queue>
+#include <asio/executor_work_guard.hpp>
+#include <asio/io_context.hpp>
+#include <asio/post.hpp>
+#include <memory>
+#include <optional>
+#include <vector>
 #include <mutex>
 #include <condition_variable>
 
 namespace asio {
 	class Message;
+	// MsgWorker
+	// Producers append to a pending vector under a short lock; the worker
+	// swaps the whole vector out and runs the batch without the lock, so a
+	// slow handler never blocks Post(). Only the post that finds the queue
+	// empty wakes the worker, the following ones ride on that wakeup.
+	// After AttachContext() the worker thread runs that io_context instead
+	// of sleeping on its condition variable and batches arrive as posted
+	// handlers, so one thread serves messages, timers and sockets alike.
+	// The destructor returns once no batch runs any more. It joins the
+	// thread, which in context mode exits after the drain Stop() posted
+	// once the context has no other work. Called from a handler of the
+	// context it drains on the spot instead. Handlers still queued on the
+	// context then do nothing. A derived class whose HandleMessage uses its
+	// own members calls Stop() and WaitStop() in its own destructor.
 	class MsgWorker : public Worker
 	{
 	public:
-		MsgWorker() :stop(false) {}
+		MsgWorker() :stop(false), link_(std::make_shared<Link>(this)) {}
 		virtual ~MsgWorker()
 		{
 			this->Stop();
+			if (this->context_ && this->context_->get_executor().running_in_this_thread()) {
+				this->Drain();
+				this->work_.reset();
+			}
+			else {
+				this->WaitStop();
+			}
+			std::lock_guard<std::mutex> lock(this->link_->mutex);
+			this->link_->owner = nullptr;
+		}
+
+		// call before Startup, the context must only be run by this worker
+		void AttachContext(asio::io_context& context) {
+			this->context_ = &context;
 		}
 
 		void Post(Message* msg) {
-			try
+			bool wake = false;
 			{
-				std::unique_lock<std::mutex> lock(this->mutex_);
+				std::lock_guard<std::mutex> lock(this->mutex_);
 				if (stop) {
-					throw std::runtime_error("enqueue on stopped.");
+					std::cout << "enqueue on stopped." << std::endl;
+					return;
 				}
-				msg_queue.emplace(std::move(msg));
+				wake = this->msg_queue.empty();
+				msg_queue.push_back(msg);
+			}
+			// notify activate thread on the empty -> non empty edge only
+			if (wake) {
+				this->Wakeup();
 			}
-			catch (std::exception& ex) { std::cout << ex.what() << std::endl; }
-			// notify activate thread
-			condition.notify_one();
 		}
 
 		void Stop() {
 			{
-				std::unique_lock<std::mutex> lock(this->mutex_);
+				std::lock_guard<std::mutex> lock(this->mutex_);
+				if (stop)
+					return;
 				stop = true;
 			}
+			if (this->context_) {
+				// run what is left, then let run() return once the context is idle
+				this->PostDrain(true);
+			}
 			condition.notify_all();
 		}
 
 	protected:
 		void Exec() override {
+			if (this->context_) {
+				this->work_.emplace(this->context_->get_executor());
+				this->context_->run();
+				return;
+			}
+			std::vector<Message*> batch;
 			for (;;)
 			{
-				std::unique_lock<std::mutex> lock(this->mutex_);
-				this->condition.wait(lock,
-					[this] { return this->stop || !this->msg_queue.empty(); });
-				if (this->stop && this->msg_queue.empty())
-					return;
-				auto msg = std::move(this->msg_queue.front());
-				this->msg_queue.pop();
-				this->HandleMessage(msg);
+				{
+					std::unique_lock<std::mutex> lock(this->mutex_);
+					this->condition.wait(lock,
+						[this] { return this->stop || !this->msg_queue.empty(); });
+					if (this->stop && this->msg_queue.empty())
+						return;
+					batch.swap(this->msg_queue);
+				}
+				for (Message* msg : batch) {
+					this->HandleMessage(msg);
+				}
+				batch.clear();
 			}
 		}
 
 		virtual void HandleMessage(Message* msg) {}
 	private:
-		std::queue<Message*> msg_queue;
+		// what posted handlers reach the worker through, cleared by the
+		// destructor so handlers left on the context do nothing
+		struct Link {
+			explicit Link(MsgWorker* worker) : owner(worker) {}
+			std::mutex mutex;
+			MsgWorker* owner;
+		};
+
+		void Wakeup() {
+			if (this->context_) {
+				this->PostDrain(false);
+				return;
+			}
+			condition.notify_one();
+		}
+
+		// a drain on the context, the last one also releases the work guard
+		void PostDrain(bool last) {
+			std::shared_ptr<Link> link = this->link_;
+			asio::post(*this->context_, [link, last]() {
+				std::lock_guard<std::mutex> guard(link->mutex);
+				MsgWorker* worker = link->owner;
+				if (!worker)
+					return;
+				worker->Drain();
+				if (last)
+					worker->work_.reset();
+			});
+		}
+
+		// context mode, runs on the worker thread
+		void Drain() {
+			{
+				std::lock_guard<std::mutex> lock(this->mutex_);
+				this->batch_.swap(this->msg_queue);
+			}
+			for (Message* msg : this->batch_) {
+				this->HandleMessage(msg);
+			}
+			this->batch_.clear();
+		}
+	private:
+		std::vector<Message*> msg_queue;
+		std::vector<Message*> batch_;
 		std::mutex mutex_;
 		std::condition_variable condition;
 		bool stop;
+		std::shared_ptr<Link> link_;
+		asio::io_context* context_ = { nullptr };
+		std::optional<asio::executor_work_guard<asio::io_context::executor_type>> work_;
 	};
 }
 
@@ -0,0 +1,346 @@
+//
+// write_queue.hpp
+// outbound queue of shared payload slices
+//
+
+#ifndef __WRITE_QUEUE_HPP__
+#define __WRITE_QUEUE_HPP__
+#include <cstddef>
+#include <deque>
+#include <utility>
+#include <vector>
+#include <asio/buffer.hpp>
+#include <asio/extend/backpressure.hpp>
+#include <asio/extend/frame_crc.hpp>
+#include <asio/extend/framing.hpp>
+#include <asio/msgdef/message.hpp>
+#include <asio/msgdef/payload.hpp>
+
+namespace asio {
+
+	// ConstBufferSpan
+	// Non owning view over gathered buffers. Passing it to async_write_some
+	// avoids copying the vector into every write operation.
+	struct ConstBufferSpan
+	{
+		typedef asio::const_buffer value_type;
+		typedef const asio::const_buffer* const_iterator;
+
+		const_iterator begin() const { return first; }
+		const_iterator end() const { return first + count; }
+
+		const asio::const_buffer* first = { nullptr };
+		std::size_t count = { 0 };
+	};
+
+	// WriteQueue
+	// Holds references into immutable payloads, never the bytes themselves.
+	// A Message pushed here is encoded once; a PayloadPtr is shared as is.
+	// gather() turns the front of the queue into one buffer sequence so a
+	// single gathered send drains many messages, consume() then pops every
+	// slice the send completed and trims a partially written one.
+	// offer() applies the watermark policy and watermark() reports the
+	// crossings the session turns into callbacks.
+	// With Framing::Compact every slice is re-encoded into its own payload
+	// with compact headers as it is queued; what is already queued keeps
+	// the framing it was queued with, so a switch is exact in the stream.
+	class WriteQueue
+	{
+	public:
+		typedef std::deque<PayloadSlice> SliceList;
+
+		// per send limits, 64 matches the iovec cap of the reactor
+		static constexpr std::size_t default_max_bytes   = 256 * 1024;
+		static constexpr std::size_t default_max_buffers = 64;
+
+		WriteQueue() = default;
+
+		~WriteQueue()
+		{
+			OutboundBudget::Sub(this->bytes_);
+		}
+
+		WriteQueue(const WriteQueue&) = delete;
+		WriteQueue& operator=(const WriteQueue&) = delete;
+
+		void set_watermarks(const WatermarkOptions& options)
+		{
+			this->watermarks_ = options;
+			if (this->watermarks_.low == 0 || this->watermarks_.low > this->watermarks_.high)
+			{
+				this->watermarks_.low = this->watermarks_.high / 2;
+			}
+		}
+
+		const WatermarkOptions& watermarks() const
+		{
+			return this->watermarks_;
+		}
+
+		void set_gather_limits(std::size_t max_bytes, std::size_t max_buffers)
+		{
+			this->max_bytes_ = max_bytes > 0 ? max_bytes : 1;
+			this->max_buffers_ = max_buffers > 0 ? max_buffers : 1;
+		}
+
+		void push(const Message& msg)
+		{
+			PayloadPtr payload = Payload::Create(msg);
+			FrameCrc::Seal(const_cast<char*>(payload->data()));
+			this->push(PayloadSlice(std::move(payload)));
+		}
+
+		void push(const PayloadPtr& payload)
+		{
+			this->push(PayloadSlice(payload));
+		}
+
+		// an empty slice has nothing to send and is not queued
+		void push(PayloadSlice slice)
+		{
+			if (slice.length() <= 0)
+				return;
+			this->append(this->encode(std::move(slice)));
+		}
+
+		// push unless the watermark policy refuses the slice
+		Admission offer(PayloadSlice slice)
+		{
+			if (slice.length() <= 0)
+				return Admission::Queued;
+			slice = this->encode(std::move(slice));
+			const std::size_t size = static_cast<std::size_t>(slice.length());
+			if (this->watermarks_.policy != BackpressurePolicy::None && this->over(size))
+			{
+				switch (this->watermarks_.policy)
+				{
+				case BackpressurePolicy::Drop:
+					if (!this->make_room(size, slice.priority))
+						return Admission::Dropped;
+					break;
+				case BackpressurePolicy::Close:
+					return Admission::Close;
+				default:
+					break;
+				}
+			}
+			this->append(std::move(slice));
+			return Admission::Queued;
+		}
+
+		// header layout of everything queued from now on
+		void set_framing(Framing framing)
+		{
+			this->framing_ = framing;
+		}
+
+		Framing framing() const
+		{
+			return this->framing_;
+		}
+
+		// Reports the watermark crossed since the previous call, the session
+		// calls it after every push and consume.
+		Watermark watermark()
+		{
+			if (this->watermarks_.high == 0)
+				return Watermark::None;
+			if (!this->above_ && this->bytes_ >= this->watermarks_.high)
+			{
+				this->above_ = true;
+				return Watermark::High;
+			}
+			if (this->above_ && this->bytes_ <= this->watermarks_.low)
+			{
+				this->above_ = false;
+				return Watermark::Low;
+			}
+			return Watermark::None;
+		}
+
+		// false from the high watermark until the queue drains to the low one
+		bool writable() const
+		{
+			return !this->above_;
+		}
+
+		PayloadSlice& front()
+		{
+			return this->list_.front();
+		}
+
+		void pop_front()
+		{
+			this->sub_bytes(static_cast<std::size_t>(this->list_.front().length()));
+			this->list_.pop_front();
+		}
+
+		void clear()
+		{
+			this->list_.clear();
+			this->sub_bytes(this->bytes_);
+			this->inflight_ = 0;
+			this->above_ = false;
+		}
+
+		// buffers for the next send, always holds at least the front slice
+		ConstBufferSpan gather()
+		{
+			this->buffers_.clear();
+			this->inflight_ = 0;
+			std::size_t total = 0;
+			for (const auto& slice : this->list_)
+			{
+				if (!this->buffers_.empty() &&
+					(this->buffers_.size() >= this->max_buffers_ ||
+					 total + static_cast<std::size_t>(slice.length()) > this->max_bytes_))
+				{
+					break;
+				}
+				this->buffers_.emplace_back(slice.data(), static_cast<std::size_t>(slice.length()));
+				total += static_cast<std::size_t>(slice.length());
+			}
+			this->inflight_ = this->buffers_.size();
+			ConstBufferSpan span;
+			span.first = this->buffers_.data();
+			span.count = this->buffers_.size();
+			return span;
+		}
+
+		// drop what a send wrote, returns the number of finished slices
+		std::size_t consume(std::size_t length)
+		{
+			std::size_t finished = 0;
+			while (!this->list_.empty())
+			{
+				PayloadSlice& slice = this->list_.front();
+				const std::size_t size = static_cast<std::size_t>(slice.length());
+				// an empty front slice is finished by any send
+				if (size > 0 && length == 0)
+					break;
+				if (length < size)
+				{
+					slice.offset += static_cast<int>(length);
+					slice.size -= static_cast<int>(length);
+					this->sub_bytes(length);
+					break;
+				}
+				length -= size;
+				this->pop_front();
+				++finished;
+			}
+			this->inflight_ = finished < this->inflight_ ? this->inflight_ - finished : 0;
+			return finished;
+		}
+
+		// Drop the oldest slices not handed to a send yet until at most
+		// keep bytes remain queued, returns the bytes dropped.
+		std::size_t drop_oldest(std::size_t keep)
+		{
+			std::size_t dropped = 0;
+			auto it = this->list_.begin() + static_cast<std::ptrdiff_t>(this->inflight_);
+			while (this->bytes_ > keep && it != this->list_.end())
+			{
+				const std::size_t size = static_cast<std::size_t>(it->length());
+				this->sub_bytes(size);
+				dropped += size;
+				it = this->list_.erase(it);
+			}
+			return dropped;
+		}
+
+		bool empty() const
+		{
+			return this->list_.empty();
+		}
+
+		std::size_t size() const
+		{
+			return this->list_.size();
+		}
+
+		// queued bytes not yet written
+		std::size_t bytes() const
+		{
+			return this->bytes_;
+		}
+
+	private:
+		void append(PayloadSlice slice)
+		{
+			this->add_bytes(static_cast<std::size_t>(slice.length()));
+			this->list_.push_back(std::move(slice));
+		}
+
+		PayloadSlice encode(PayloadSlice slice) const
+		{
+			if (this->framing_ != Framing::Compact || !slice.payload)
+				return slice;
+			return PayloadSlice(CompactHeader::FromStandard(slice.data(), slice.length()), slice.priority);
+		}
+
+		void add_bytes(std::size_t size)
+		{
+			this->bytes_ += size;
+			OutboundBudget::Add(size);
+		}
+
+		void sub_bytes(std::size_t size)
+		{
+			this->bytes_ -= size;
+			OutboundBudget::Sub(size);
+		}
+
+		// size more bytes would pass the session or the global limit
+		bool over(std::size_t size) const
+		{
+			return (this->watermarks_.high > 0 && this->bytes_ + size > this->watermarks_.high)
+				|| OutboundBudget::Exceeded(size);
+		}
+
+		// Evicts unsent slices of lower priority than the new one, lowest
+		// priority and oldest first, until size bytes fit.
+		bool make_room(std::size_t size, uint8 priority)
+		{
+			while (this->over(size))
+			{
+				const auto first = this->list_.begin() + static_cast<std::ptrdiff_t>(this->inflight_);
+				int lowest = priority;
+				for (auto it = first; it != this->list_.end(); ++it)
+				{
+					if (it->priority < lowest)
+						lowest = it->priority;
+				}
+				if (lowest >= priority)
+					return false;
+				for (auto it = first; it != this->list_.end() && this->over(size);)
+				{
+					if (it->priority == lowest)
+					{
+						this->sub_bytes(static_cast<std::size_t>(it->length()));
+						it = this->list_.erase(it);
+					}
+					else
+					{
+						++it;
+					}
+				}
+			}
+			return true;
+		}
+
+	private:
+		SliceList list_;
+		std::size_t bytes_ = { 0 };
+		std::vector<asio::const_buffer> buffers_;
+		std::size_t inflight_ = { 0 }; // front slices owned by the current send
+		std::size_t max_bytes_   = { default_max_bytes };
+		std::size_t max_buffers_ = { default_max_buffers };
+		WatermarkOptions watermarks_;
+		Framing framing_ = { Framing::Standard };
+		bool above_ = { false };
+	};
+
+}
+
+#endif // __WRITE_QUEUE_HPP__
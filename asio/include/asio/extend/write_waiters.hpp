@@ -0,0 +1,59 @@
+//
+// write_waiters.hpp
+// producers parked until a write queue drains
+//
+
+#ifndef __WRITE_WAITERS_HPP__
+#define __WRITE_WAITERS_HPP__
+#include <system_error>
+#include <utility>
+#include <vector>
+#include <asio/any_completion_handler.hpp>
+#include <asio/append.hpp>
+#include <asio/post.hpp>
+
+namespace asio {
+
+	// WriteWaitList
+	// Handlers of AsyncWaitWritable() calls made while a session sits above
+	// its high watermark. The session takes the list under its own lock once
+	// the queue drains to the low watermark, or when it goes away, and then
+	// completes it outside the lock.
+	class WriteWaitList
+	{
+	public:
+		typedef asio::any_completion_handler<void(std::error_code)> Handler;
+		typedef std::vector<Handler> List;
+
+		void add(Handler handler)
+		{
+			this->list_.push_back(std::move(handler));
+		}
+
+		List take()
+		{
+			return std::exchange(this->list_, List());
+		}
+
+		bool empty() const
+		{
+			return this->list_.empty();
+		}
+
+		// completes handlers on their own executor, ex when they have none
+		template <typename Executor>
+		static void complete(List list, const Executor& ex, std::error_code ec)
+		{
+			for (auto& handler : list)
+			{
+				asio::post(ex, asio::append(std::move(handler), ec));
+			}
+		}
+
+	private:
+		List list_;
+	};
+
+}
+
+#endif // __WRITE_WAITERS_HPP__
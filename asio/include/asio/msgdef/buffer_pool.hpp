@@ -0,0 +1,190 @@
+//
+// buffer_pool.hpp
+// size classed slab buffers backing Message
+//
+// Blocks are grouped in classes of 64 / 256 / 1K / 4K / 64K bytes. Every
+// thread keeps a short free list per class, so the common alloc / free pair
+// never takes a lock. When a thread list grows past its limit half of it is
+// handed to a shared depot, and an empty thread list refills from the depot
+// before falling back to the heap. Requests above the largest class are
+// served directly from the heap.
+//
+
+#ifndef __BUFFER_POOL_HPP__
+#define __BUFFER_POOL_HPP__
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+namespace asio {
+
+	class BufferPool
+	{
+	public:
+		static constexpr int class_count = 5;
+		static constexpr std::size_t class_size[class_count]  = { 64, 256, 1024, 4096, 65536 };
+		// max blocks cached per thread for each class
+		static constexpr std::size_t cache_limit[class_count] = { 1024, 512, 256, 64, 8 };
+		// max blocks parked in the shared depot for each class
+		static constexpr std::size_t depot_limit[class_count] = { 65536, 32768, 8192, 2048, 128 };
+
+		// size class of a request, -1 when it is served by the heap
+		static int SizeClass(std::size_t size)
+		{
+			for (int i = 0; i < class_count; ++i)
+			{
+				if (size <= class_size[i])
+					return i;
+			}
+			return -1;
+		}
+
+		// real capacity handed out for a request of size bytes
+		static std::size_t Capacity(std::size_t size)
+		{
+			const int index = SizeClass(size);
+			return index < 0 ? size : class_size[index];
+		}
+
+		// capacity receives the usable size of the returned block
+		static char* Allocate(std::size_t size, std::size_t& capacity)
+		{
+			const int index = SizeClass(size);
+			if (index < 0)
+			{
+				capacity = size;
+				return static_cast<char*>(::operator new(size));
+			}
+			capacity = class_size[index];
+			ThreadCache& cache = Local();
+			if (!cache.head[index])
+			{
+				cache.Refill(index);
+			}
+			if (FreeBlock* block = cache.head[index])
+			{
+				cache.head[index] = block->next;
+				--cache.count[index];
+				return reinterpret_cast<char*>(block);
+			}
+			return static_cast<char*>(::operator new(capacity));
+		}
+
+		// capacity must be the value reported by Allocate
+		static void Deallocate(char* data, std::size_t capacity)
+		{
+			if (!data)
+				return;
+			const int index = SizeClass(capacity);
+			if (index < 0 || class_size[index] != capacity)
+			{
+				::operator delete(data);
+				return;
+			}
+			ThreadCache& cache = Local();
+			FreeBlock* block = reinterpret_cast<FreeBlock*>(data);
+			block->next = cache.head[index];
+			cache.head[index] = block;
+			if (++cache.count[index] > cache_limit[index])
+			{
+				cache.Flush(index, cache_limit[index] / 2);
+			}
+		}
+
+	private:
+		struct FreeBlock
+		{
+			FreeBlock* next;
+		};
+
+		// shared by all threads, never destroyed so late thread exits stay safe
+		struct Depot
+		{
+			std::mutex  mutex[class_count];
+			FreeBlock*  head[class_count]  = {};
+			std::size_t count[class_count] = {};
+		};
+
+		static Depot& Shared()
+		{
+			static Depot* depot = new Depot;
+			return *depot;
+		}
+
+		struct ThreadCache
+		{
+			FreeBlock*  head[class_count]  = {};
+			std::size_t count[class_count] = {};
+
+			~ThreadCache()
+			{
+				for (int i = 0; i < class_count; ++i)
+				{
+					this->Flush(i, 0);
+				}
+			}
+
+			// move blocks to the depot until keep are left
+			void Flush(int index, std::size_t keep)
+			{
+				if (count[index] <= keep)
+					return;
+				FreeBlock* first = head[index];
+				FreeBlock* last = first;
+				std::size_t moved = 1;
+				while (moved < count[index] - keep)
+				{
+					last = last->next;
+					++moved;
+				}
+				head[index] = last->next;
+				count[index] -= moved;
+
+				Depot& depot = Shared();
+				{
+					std::lock_guard lock(depot.mutex[index]);
+					if (depot.count[index] < depot_limit[index])
+					{
+						last->next = depot.head[index];
+						depot.head[index] = first;
+						depot.count[index] += moved;
+						return;
+					}
+				}
+				// depot is full, give the memory back
+				while (first)
+				{
+					FreeBlock* next = (first == last) ? nullptr : first->next;
+					::operator delete(first);
+					first = next;
+				}
+			}
+
+			// take up to half of the thread limit from the depot
+			void Refill(int index)
+			{
+				Depot& depot = Shared();
+				std::lock_guard lock(depot.mutex[index]);
+				std::size_t want = cache_limit[index] / 2;
+				while (want-- > 0 && depot.head[index])
+				{
+					FreeBlock* block = depot.head[index];
+					depot.head[index] = block->next;
+					--depot.count[index];
+					block->next = head[index];
+					head[index] = block;
+					++count[index];
+				}
+			}
+		};
+
+		static ThreadCache& Local()
+		{
+			thread_local ThreadCache cache;
+			return cache;
+		}
+	};
+
+}
+
+#endif // __BUFFER_POOL_HPP__
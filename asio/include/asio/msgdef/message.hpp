@@ -16,7 +16,8 @@
 #include <memory>
 #pragma warning(disable : 26495)
 #include <asio/msgdef/node.hpp>
-#include <asio/extend/base.hpp>
+#include <asio/msgdef/buffer_pool.hpp>
+#include <asio/msgdef/types.hpp>
 
 namespace asio {
 	class NetObject;
@@ -56,56 +57,87 @@ namespace asio {
 	};
 
 	// Message Support memory object pool
+	// The frame lives in a block taken from BufferPool, sized to what the
+	// message really carries, so small packets cost a 64 byte slab instead of
+	// a fixed 4 KB array and bodies may grow past 4096 bytes.
+	// A move leaves the source without a block; it reads as an empty frame
+	// and takes a fresh header block on the first write, so a moved-from
+	// Message may be copied, decoded or filled again.
 	class Message : public Node<Message>
 	{
 	public:
 	  static constexpr int header_length   = sizeof(MsgHeader);
-	  static constexpr int max_body_length = 4096;
+#if defined(ASIO_MSG_MAX_BODY_LENGTH)
+	  static constexpr int max_body_length = ASIO_MSG_MAX_BODY_LENGTH;
+#else
+	  static constexpr int max_body_length = 1024 * 1024;
+#endif
 
-	  Message(Message& other)
+	  Message(const Message& other)
 	  {
 		  this->object_ = other.object_;
+		  this->allocate(other.length());
 		  std::memcpy(data_, other.data(), other.length());
 		  this->body_length_ = other.body_length_;
 	  }
-	  Message(const Message& other) 
+
+	  Message(Message&& other) noexcept
+		  : data_(other.data_)
+		  , capacity_(other.capacity_)
+		  , body_length_(other.body_length_)
+		  , object_(std::move(other.object_))
 	  {
-		  this->object_ = other.object_;
-		  std::memcpy(data_, other.data(), other.length());
-		  this->body_length_ = other.body_length_;
+		  other.data_ = nullptr;
+		  other.capacity_ = 0;
+		  other.body_length_ = 0;
 	  }
 
-	  Message& operator=(Message& other)
+	  const Message& operator=(const Message& other)
 	  {
 		  if (this == &other)
 			  return *this;
 		  this->object_ = other.object_;
+		  this->body_length_ = 0;
+		  this->reserve(other.length());
 		  std::memcpy(data_, other.data(), other.length());
 		  this->body_length_ = other.body_length_;
 		  return *this;
 	  }
-	  const Message& operator=(const Message& other)
+
+	  Message& operator=(Message&& other) noexcept
 	  {
 		  if (this == &other)
 			  return *this;
-		  this->object_ = other.object_;
-		  std::memcpy(data_, other.data(), other.length());
+		  this->release();
+		  this->data_ = other.data_;
+		  this->capacity_ = other.capacity_;
 		  this->body_length_ = other.body_length_;
+		  this->object_ = std::move(other.object_);
+		  other.data_ = nullptr;
+		  other.capacity_ = 0;
+		  other.body_length_ = 0;
 		  return *this;
 	  }
 
 	  Message():body_length_(0)
 	  {
+		  this->allocate(header_length);
 		  this->clear();
 	  }
 
+	  ~Message()
+	  {
+		  this->release();
+	  }
+
 	  const char* data() const
 	  {
-		return data_;
+		return data_ ? data_ : empty_frame();
 	  }
 
 	  char* data()
 	  {
+		this->ensure();
 		return data_;
 	  }
 
@@ -119,13 +151,39 @@ namespace asio {
 		  return header_length + max_body_length;
 	  }
 
+	  // bytes available in the current block
+	  int capacity() const
+	  {
+		  return static_cast<int>(capacity_);
+	  }
+
+	  // grow the block to hold new_length bytes, keeping the current frame
+	  void reserve(int new_length)
+	  {
+		  if (new_length <= this->capacity())
+			  return;
+		  char* old_data = data_;
+		  const std::size_t old_capacity = capacity_;
+		  this->allocate(new_length);
+		  if (old_data)
+		  {
+			  std::memcpy(data_, old_data, this->length());
+			  BufferPool::Deallocate(old_data, old_capacity);
+		  }
+		  else
+		  {
+			  std::memset(data_, 0, header_length);
+		  }
+	  }
+
 	  const char* body() const
 	  {
-		return data_ + header_length;
+		return this->data() + header_length;
 	  }
 
 	  char* body()
 	  {
+		this->ensure();
 		return data_ + header_length;
 	  }
 
@@ -136,26 +194,36 @@ namespace asio {
 
 	  void body_length(int new_length)
 	  {
-		  body_length_ = new_length;
-		  if (body_length_ > max_body_length)  // data length too long
+		  if (new_length > max_body_length)  // data length too long
+		  {
+			  new_length = max_body_length;
+		  }
+		  if (new_length < 0)
 		  {
-			  body_length_ = max_body_length;
+			  new_length = 0;
 		  }
+		  this->reserve(header_length + new_length);
+		  body_length_ = new_length;
 	  }
 
 	  bool decode_header() {
+		  this->ensure();
 		  MsgHeader* msg = (MsgHeader*)data_;
-		  body_length_ = msg->body_len;
-		  if (body_length_ > max_body_length)  // range out
+		  const int body_len = msg->body_len;
+		  if (body_len < 0 || body_len > max_body_length)  // range out
 		  {
 			  body_length_ = 0;
 			  return false;
 		  }
+		  body_length_ = 0;
+		  this->reserve(header_length + body_len);
+		  body_length_ = body_len;
 		  return true;
 	  }
 
 	  void encode_header(MsgHeader& msg) 
 	  {
+		  this->ensure();
 		  std::memcpy(data_, &msg, header_length);
 	  }
 
@@ -169,14 +237,46 @@ namespace asio {
 		  return object_;
 	  }
 
+	  // only the header is reset, the body is overwritten by the next frame
 	  void clear()
 	  {
-		  std::memset(data_, 0, header_length + max_body_length);
 		  this->body_length_ = 0;
+		  this->ensure();
+		  std::memset(data_, 0, header_length);
+	  }
+	private:
+	  // a moved-from message gets a zeroed header block back
+	  void ensure()
+	  {
+		  if (!data_)
+		  {
+			  this->body_length_ = 0;
+			  this->reserve(header_length);
+		  }
+	  }
+
+	  // what a message without a block reads as
+	  static const char* empty_frame()
+	  {
+		  static const char frame[header_length] = {};
+		  return frame;
+	  }
+
+	  void allocate(int length)
+	  {
+		  data_ = BufferPool::Allocate(static_cast<std::size_t>(length), capacity_);
+	  }
+
+	  void release()
+	  {
+		  BufferPool::Deallocate(data_, capacity_);
+		  data_ = nullptr;
+		  capacity_ = 0;
 	  }
 	private:
-	  char data_[header_length + max_body_length];
-	  int body_length_;
+	  char* data_ = { nullptr };
+	  std::size_t capacity_ = { 0 };
+	  int body_length_ = { 0 };
 	  NetObjectWeakPtr object_;
 	};
 }
@@ -0,0 +1,171 @@
+//
+// payload.hpp
+// encoded once, shared frames for the outbound path
+//
+// A Payload holds the wire bytes of one or more frames in a pooled block with
+// an intrusive reference count. Once Create() returns the bytes are never
+// written again, so the same Payload can sit in any number of session write
+// queues at the cost of one pointer each.
+//
+
+#ifndef __PAYLOAD_HPP__
+#define __PAYLOAD_HPP__
+#include <atomic>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <asio/msgdef/buffer_pool.hpp>
+#include <asio/msgdef/message.hpp>
+
+namespace asio {
+
+	class Payload;
+
+	// PayloadPtr intrusive reference to an immutable Payload
+	class PayloadPtr
+	{
+	public:
+		PayloadPtr() noexcept {}
+		explicit PayloadPtr(Payload* p) noexcept : ptr_(p) {} // adopts one reference
+		PayloadPtr(const PayloadPtr& other) noexcept;
+		PayloadPtr(PayloadPtr&& other) noexcept : ptr_(other.ptr_) { other.ptr_ = nullptr; }
+		~PayloadPtr();
+
+		PayloadPtr& operator=(const PayloadPtr& other) noexcept
+		{
+			PayloadPtr(other).swap(*this);
+			return *this;
+		}
+		PayloadPtr& operator=(PayloadPtr&& other) noexcept
+		{
+			PayloadPtr(std::move(other)).swap(*this);
+			return *this;
+		}
+
+		void swap(PayloadPtr& other) noexcept { std::swap(ptr_, other.ptr_); }
+		void reset() noexcept { PayloadPtr().swap(*this); }
+
+		const Payload* get() const noexcept { return ptr_; }
+		const Payload* operator->() const noexcept { return ptr_; }
+		const Payload& operator*() const noexcept { return *ptr_; }
+		explicit operator bool() const noexcept { return ptr_ != nullptr; }
+
+	private:
+		Payload* ptr_ = { nullptr };
+	};
+
+	class Payload
+	{
+	public:
+		// one frame copied out of msg, header included
+		static PayloadPtr Create(const Message& msg)
+		{
+			return Create(msg.data(), msg.length());
+		}
+
+		// raw wire bytes, may hold several frames back to back
+		static PayloadPtr Create(const char* data, int length)
+		{
+			PayloadPtr ptr = Allocate(length);
+			if (length > 0)
+			{
+				std::memcpy(const_cast<char*>(ptr->data()), data, length);
+			}
+			return ptr;
+		}
+
+		// uninitialised payload, the caller fills data() before sharing it
+		static PayloadPtr Allocate(int length)
+		{
+			std::size_t capacity = 0;
+			char* block = BufferPool::Allocate(sizeof(Payload) + static_cast<std::size_t>(length), capacity);
+			return PayloadPtr(new (block) Payload(length, capacity));
+		}
+
+		const char* data() const
+		{
+			return reinterpret_cast<const char*>(this + 1);
+		}
+
+		int length() const
+		{
+			return length_;
+		}
+
+		// an Allocate()d payload that came out shorter, before it is shared
+		void shrink(int length)
+		{
+			if (length >= 0 && length < length_)
+				length_ = length;
+		}
+
+		int use_count() const
+		{
+			return refs_.load(std::memory_order_relaxed);
+		}
+
+	private:
+		friend class PayloadPtr;
+
+		Payload(int length, std::size_t capacity) noexcept
+			: refs_(1), length_(length), capacity_(capacity)
+		{
+		}
+
+		void AddRef() const noexcept
+		{
+			refs_.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void Release() const noexcept
+		{
+			if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				const std::size_t capacity = capacity_;
+				char* block = reinterpret_cast<char*>(const_cast<Payload*>(this));
+				this->~Payload();
+				BufferPool::Deallocate(block, capacity);
+			}
+		}
+
+	private:
+		mutable std::atomic<int> refs_;
+		int length_;
+		std::size_t capacity_;
+	};
+
+	inline PayloadPtr::PayloadPtr(const PayloadPtr& other) noexcept
+		: ptr_(other.ptr_)
+	{
+		if (ptr_)
+			ptr_->AddRef();
+	}
+
+	inline PayloadPtr::~PayloadPtr()
+	{
+		if (ptr_)
+			ptr_->Release();
+	}
+
+	// PayloadSlice what a write queue holds: a reference and a byte range
+	struct PayloadSlice
+	{
+		PayloadSlice() = default;
+		explicit PayloadSlice(PayloadPtr p)
+			: payload(std::move(p)), offset(0), size(payload ? payload->length() : 0) {}
+		PayloadSlice(PayloadPtr p, int off, int len)
+			: payload(std::move(p)), offset(off), size(len) {}
+		PayloadSlice(PayloadPtr p, uint8 prio)
+			: payload(std::move(p)), offset(0), size(payload ? payload->length() : 0), priority(prio) {}
+
+		const char* data() const { return payload->data() + offset; }
+		int length() const { return size; }
+
+		PayloadPtr payload;
+		int offset = { 0 };
+		int size   = { 0 };
+		uint8 priority = { 0 }; // higher survives longer under backpressure
+	};
+}
+
+#endif // __PAYLOAD_HPP__
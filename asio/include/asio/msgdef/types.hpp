@@ -0,0 +1,31 @@
+//
+// types.hpp
+// short names of the integer types used by the wire headers
+//
+
+#ifndef __MSGDEF_TYPES_HPP__
+#define __MSGDEF_TYPES_HPP__
+
+/*************************************************************************
+	Simplification of some 'unsigned' types
+*************************************************************************/
+
+typedef	unsigned long		ulong;
+typedef unsigned short		ushort;
+typedef unsigned int		uint;
+typedef unsigned char		uchar;
+
+typedef long long			int64;
+typedef int					int32;
+typedef short				int16;
+typedef char				int8;
+
+typedef unsigned long long  uint64;
+typedef unsigned int        uint32;
+typedef unsigned short      uint16;
+typedef unsigned char       uint8;
+
+typedef float               float32;
+typedef double              float64;
+
+#endif // __MSGDEF_TYPES_HPP__
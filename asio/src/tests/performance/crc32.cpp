@@ -0,0 +1,107 @@
+//
+// crc32.cpp
+// ~~~~~~~~~
+//
+// Throughput of every CRC-32 and CRC-32C kernel in asio/extend/crc32.hpp.
+//
+// usage: crc32 [seconds per case]
+//
+
+#include "asio/extend/crc32.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+struct kernel
+{
+  const char* name;
+  Crypto::CrcKernel id;
+};
+
+const kernel kernels[] =
+{
+  { "table", Crypto::CrcKernel::Table },
+  { "slice8", Crypto::CrcKernel::Slice8 },
+  { "slice16", Crypto::CrcKernel::Slice16 },
+  { "pclmul", Crypto::CrcKernel::Pclmul },
+  { "sse42", Crypto::CrcKernel::Sse42 },
+};
+
+const std::size_t sizes[] = { 64, 256, 1500, 4096, 65536, 1 << 20 };
+
+volatile uint32_t sink;
+
+// bytes per second of fn over len byte buffers for about seconds
+template <typename Function>
+double measure(Function fn, const unsigned char* data, std::size_t len,
+    double seconds)
+{
+  typedef std::chrono::steady_clock clock;
+  const std::size_t batch = (std::max<std::size_t>)(1, (1 << 24) / len);
+  std::size_t rounds = 0;
+  uint32_t crc = 0;
+  const clock::time_point start = clock::now();
+  double elapsed = 0;
+  do
+  {
+    for (std::size_t i = 0; i < batch; ++i)
+      crc = fn(data, len, crc);
+    rounds += batch;
+    elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  } while (elapsed < seconds);
+  sink = crc;
+  return static_cast<double>(rounds) * len / elapsed;
+}
+
+void run(const char* crc_name, bool castagnoli, double seconds,
+    const std::vector<unsigned char>& buffer)
+{
+  for (const kernel& k : kernels)
+  {
+    const bool available = castagnoli
+      ? Crypto::HasCrc32cKernel(k.id) : Crypto::HasCrc32Kernel(k.id);
+    if (!available)
+      continue;
+    std::printf("%-7s %-8s", crc_name, k.name);
+    for (std::size_t len : sizes)
+    {
+      const Crypto::CrcKernel id = k.id;
+      double rate;
+      if (castagnoli)
+        rate = measure([id](const unsigned char* p, std::size_t n, uint32_t c)
+            { return Crypto::Crc32cWith(id, p, n, c); }, buffer.data(), len, seconds);
+      else
+        rate = measure([id](const unsigned char* p, std::size_t n, uint32_t c)
+            { return Crypto::Crc32With(id, p, n, c); }, buffer.data(), len, seconds);
+      std::printf(" %9.2f", rate / 1e9);
+    }
+    std::printf("\n");
+  }
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  const double seconds = argc > 1 ? std::atof(argv[1]) : 0.2;
+
+  std::vector<unsigned char> buffer(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+  uint32_t seed = 12345;
+  for (unsigned char& c : buffer)
+  {
+    seed = seed * 1103515245 + 12345;
+    c = static_cast<unsigned char>(seed >> 16);
+  }
+
+  std::printf("GB/s    kernel  ");
+  for (std::size_t len : sizes)
+    std::printf(" %9zu", len);
+  std::printf("\n");
+  run("crc32", false, seconds, buffer);
+  run("crc32c", true, seconds, buffer);
+  return 0;
+}
@@ -0,0 +1,495 @@
+//
+// extend_loopback.cpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Round trip benchmark of the extend TCP stack over loopback: TcpClient
+// links send framed Messages to a server that echoes them back. Every
+// link keeps --depth messages in flight. Sweeps message size, connection
+// count, I/O threads and worker threads, and prints one JSON object per
+// case.
+//
+// usage: extend_loopback [--sizes=16,256,4096,65536] [--conns=1,16,256]
+//          [--io-threads=1] [--workers=1] [--depth=1] [--seconds=1]
+//          [--client-threads=1] [--port=47000]
+//
+// extend_loopback runs a TcpSocketServer, which has no workers and ignores
+// --workers. extend_loopback_group is the same source built with
+// EXTEND_LOOPBACK_GROUP and runs a NetGroupServer: --io-threads is its
+// number of listening ports, each with its own I/O thread, and --workers
+// its number of lane workers. server.hpp and server_group.hpp do not go
+// into one program, both define TcpSession.
+// Connection counts beyond a few thousand need a raised open file limit;
+// loopback has room for about 28k links per server port.
+//
+
+#if defined(EXTEND_LOOPBACK_GROUP)
+# include "asio/extend/server_group.hpp"
+#else
+# include "asio/extend/server.hpp"
+#endif
+#include "asio/extend/client.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#if !defined(_WIN32)
+# include <sys/resource.h>
+#endif
+
+namespace {
+
+typedef std::chrono::steady_clock clock_type;
+
+// Round trip times in ns: 16 linear sub buckets per power of two, so a
+// percentile is off by at most 1/16.
+class latency_histogram
+{
+public:
+  static const int sub_bits = 4;
+  static const int subs = 1 << sub_bits;
+  static const int buckets = (64 - sub_bits + 1) * subs;
+
+  latency_histogram()
+  {
+    clear();
+  }
+
+  void clear()
+  {
+    std::fill(counts_, counts_ + buckets, 0);
+    count_ = 0;
+    max_ = 0;
+  }
+
+  void record(uint64_t ns)
+  {
+    ++counts_[index(ns)];
+    ++count_;
+    if (ns > max_)
+      max_ = ns;
+  }
+
+  void merge(const latency_histogram& other)
+  {
+    for (int i = 0; i < buckets; ++i)
+      counts_[i] += other.counts_[i];
+    count_ += other.count_;
+    max_ = (std::max)(max_, other.max_);
+  }
+
+  uint64_t count() const
+  {
+    return count_;
+  }
+
+  uint64_t max() const
+  {
+    return max_;
+  }
+
+  // upper bound of the bucket holding quantile q
+  uint64_t percentile(double q) const
+  {
+    if (count_ == 0)
+      return 0;
+    const uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(count_ - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < buckets; ++i)
+    {
+      seen += counts_[i];
+      if (seen >= rank)
+        return (std::min)(upper(i), max_);
+    }
+    return max_;
+  }
+
+private:
+  static int index(uint64_t v)
+  {
+    if (v < static_cast<uint64_t>(subs))
+      return static_cast<int>(v);
+    int bits = 0;
+    for (uint64_t x = v; x; x >>= 1)
+      ++bits;
+    const int shift = bits - sub_bits - 1;
+    return (shift + 1) * subs + static_cast<int>((v >> shift) - subs);
+  }
+
+  static uint64_t upper(int i)
+  {
+    if (i < subs)
+      return static_cast<uint64_t>(i);
+    const int shift = i / subs - 1;
+    const uint64_t sub = static_cast<uint64_t>(i % subs + subs);
+    return ((sub + 1) << shift) - 1;
+  }
+
+  uint64_t counts_[buckets];
+  uint64_t count_;
+  uint64_t max_;
+};
+
+struct options
+{
+  std::vector<int> sizes = { 16, 256, 4096, 65536 };
+  std::vector<int> conns = { 1, 16, 256 };
+  std::vector<int> io_threads = { 1 };
+  std::vector<int> workers = { 1 };
+  int depth = 1;
+  double seconds = 1.0;
+  int client_threads = 1;
+  int port = 47000;
+};
+
+struct bench_case
+{
+  int size;
+  int conns;
+  int io_threads;
+  int workers;
+};
+
+// what one client I/O thread saw during the measured window
+struct client_stats
+{
+  latency_histogram rtt;
+  uint64_t msgs = 0;
+};
+
+std::atomic<bool> measuring(false);
+std::atomic<bool> running(false);
+thread_local client_stats* this_thread_stats = 0;
+
+const int bench_msg_id = 1;
+
+uint64_t now_ns()
+{
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      clock_type::now().time_since_epoch()).count());
+}
+
+// a body of size bytes led by its send time
+asio::Message make_message(int size)
+{
+  asio::Message msg;
+  asio::MsgHeader header;
+  header.msgId = bench_msg_id;
+  header.body_len = size;
+  msg.body_length(size);
+  const uint64_t stamp = now_ns();
+  std::memcpy(msg.body(), &stamp, sizeof(stamp));
+  msg.encode_header(header);
+  return msg;
+}
+
+#if defined(EXTEND_LOOPBACK_GROUP)
+
+const char* const server_kind = "group";
+
+class echo_server : public asio::NetGroupServer
+{
+public:
+  void Connect(asio::NetObjectPtr) override {}
+  void Disconnect(asio::NetObjectPtr) override {}
+  void Error(int) override {}
+
+  void HandleMessage(asio::NetObjectPtr obj, const asio::Message& msg) override
+  {
+    if (obj)
+      obj->Send(msg);
+  }
+};
+
+#else // defined(EXTEND_LOOPBACK_GROUP)
+
+const char* const server_kind = "tcp";
+
+class echo_server : public asio::TcpSocketServer
+{
+public:
+  using asio::TcpSocketServer::TcpSocketServer;
+
+  void HandleMessage(asio::NetObjectPtr obj, const asio::Message& msg) override
+  {
+    if (obj)
+      obj->Send(msg);
+  }
+
+  void Error(int) override {}
+
+protected:
+  void Init() override {}
+  void Exit() override {}
+};
+
+#endif // defined(EXTEND_LOOPBACK_GROUP)
+
+// answers every echo with the next message while the case runs
+class client_event : public asio::NetEvent
+{
+public:
+  explicit client_event(int size)
+    : size_(size)
+  {
+  }
+
+  void Post(const asio::Message&) override {}
+  void Send(const asio::Message&) override {}
+  void Connect(asio::NetObjectPtr) override {}
+  void Disconnect(asio::NetObjectPtr) override {}
+
+  void HandleMessage(asio::NetObjectPtr obj, const asio::Message& msg) override
+  {
+    if (measuring.load(std::memory_order_relaxed) && this_thread_stats
+        && msg.body_length() >= static_cast<int>(sizeof(uint64_t)))
+    {
+      uint64_t stamp;
+      std::memcpy(&stamp, msg.body(), sizeof(stamp));
+      this_thread_stats->rtt.record(now_ns() - stamp);
+      ++this_thread_stats->msgs;
+    }
+    if (running.load(std::memory_order_relaxed) && obj)
+      obj->Send(make_message(size_));
+  }
+
+private:
+  int size_;
+};
+
+// the echo server of one case
+class bench_server
+{
+public:
+  bench_server(const bench_case& c, int port)
+  {
+#if defined(EXTEND_LOOPBACK_GROUP)
+    for (int i = 0; i < c.io_threads; ++i)
+      ports_.push_back(port + i);
+    server_.reset(new echo_server());
+    server_->Startup(ports_, c.workers);
+#else
+    server_.reset(new echo_server(asio::ip::tcp::endpoint(
+            asio::ip::tcp::v4(), static_cast<unsigned short>(port))));
+    server_->SetThreads(c.io_threads);
+    server_->Startup();
+    ports_.push_back(port);
+#endif
+  }
+
+  ~bench_server()
+  {
+#if defined(EXTEND_LOOPBACK_GROUP)
+    server_->StopContext();
+#else
+    server_->Stop();
+#endif
+    server_->WaitStop();
+  }
+
+  const std::vector<int>& ports() const
+  {
+    return ports_;
+  }
+
+private:
+  std::unique_ptr<echo_server> server_;
+  std::vector<int> ports_;
+};
+
+void run_case(const options& opt, const bench_case& c, int port)
+{
+  bench_server server(c, port);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  client_event event(c.size);
+  const int client_threads = (std::max)(1, (std::min)(opt.client_threads, c.conns));
+  std::vector<std::unique_ptr<asio::io_context>> contexts;
+  std::vector<client_stats> stats(client_threads);
+  for (int i = 0; i < client_threads; ++i)
+    contexts.emplace_back(new asio::io_context());
+
+  std::vector<std::shared_ptr<asio::TcpClient>> clients;
+  clients.reserve(c.conns);
+  for (int i = 0; i < c.conns; ++i)
+  {
+    const int p = server.ports()[i % server.ports().size()];
+    clients.push_back(std::make_shared<asio::TcpClient>(
+          *contexts[i % client_threads], &event, "127.0.0.1", std::to_string(p)));
+  }
+
+  running = true;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < client_threads; ++i)
+  {
+    asio::io_context* ctx = contexts[i].get();
+    client_stats* s = &stats[i];
+    threads.emplace_back([ctx, s]
+        {
+          this_thread_stats = s;
+          asio::executor_work_guard<asio::io_context::executor_type> work(ctx->get_executor());
+          ctx->run();
+        });
+  }
+
+  // wait for the links, then prime each with depth messages
+  const clock_type::time_point connect_deadline = clock_type::now()
+    + std::chrono::seconds(10 + c.conns / 1000);
+  int connected = 0;
+  for (;;)
+  {
+    connected = 0;
+    for (auto& client : clients)
+      connected += client->IsConnect() ? 1 : 0;
+    if (connected == c.conns || clock_type::now() > connect_deadline)
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  for (auto& client : clients)
+    if (client->IsConnect())
+      for (int d = 0; d < opt.depth; ++d)
+        client->Send(make_message(c.size));
+
+  // a short warm up, then the measured window
+  std::this_thread::sleep_for(std::chrono::duration<double>((std::min)(0.2, opt.seconds / 5)));
+  measuring = true;
+  const clock_type::time_point start = clock_type::now();
+  std::this_thread::sleep_for(std::chrono::duration<double>(opt.seconds));
+  measuring = false;
+  const double elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+  running = false;
+
+  for (auto& client : clients)
+    client->Close();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  for (auto& ctx : contexts)
+    ctx->stop();
+  for (auto& thread : threads)
+    thread.join();
+  clients.clear();
+
+  latency_histogram rtt;
+  uint64_t msgs = 0;
+  for (const client_stats& s : stats)
+  {
+    rtt.merge(s.rtt);
+    msgs += s.msgs;
+  }
+  const double rate = static_cast<double>(msgs) / elapsed;
+  std::printf("{\"server\":\"%s\",\"size\":%d,\"conns\":%d,\"connected\":%d,"
+      "\"io_threads\":%d,\"workers\":%d,\"depth\":%d,\"client_threads\":%d,"
+      "\"seconds\":%.3f,\"msgs\":%llu,\"msgs_per_sec\":%.0f,\"mb_per_sec\":%.2f,"
+      "\"rtt_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+      server_kind, c.size, c.conns, connected,
+      c.io_threads, c.workers, opt.depth, client_threads,
+      elapsed, static_cast<unsigned long long>(msgs), rate,
+      rate * c.size / (1024.0 * 1024.0),
+      rtt.percentile(0.50) / 1e3, rtt.percentile(0.99) / 1e3,
+      rtt.percentile(0.999) / 1e3, rtt.max() / 1e3);
+  std::fflush(stdout);
+}
+
+std::vector<std::string> split(const std::string& list)
+{
+  std::vector<std::string> items;
+  std::string::size_type begin = 0;
+  while (begin <= list.size())
+  {
+    std::string::size_type end = list.find(',', begin);
+    if (end == std::string::npos)
+      end = list.size();
+    if (end > begin)
+      items.push_back(list.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  return items;
+}
+
+std::vector<int> split_ints(const std::string& list)
+{
+  std::vector<int> values;
+  for (const std::string& item : split(list))
+    values.push_back(std::atoi(item.c_str()));
+  return values;
+}
+
+bool parse(int argc, char* argv[], options& opt)
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    const std::string::size_type eq = arg.find('=');
+    const std::string name = arg.substr(0, eq);
+    const std::string value = eq == std::string::npos ? std::string() : arg.substr(eq + 1);
+    if (name == "--sizes")
+      opt.sizes = split_ints(value);
+    else if (name == "--conns")
+      opt.conns = split_ints(value);
+    else if (name == "--io-threads")
+      opt.io_threads = split_ints(value);
+    else if (name == "--workers")
+      opt.workers = split_ints(value);
+    else if (name == "--depth")
+      opt.depth = (std::max)(1, std::atoi(value.c_str()));
+    else if (name == "--seconds")
+      opt.seconds = std::atof(value.c_str());
+    else if (name == "--client-threads")
+      opt.client_threads = (std::max)(1, std::atoi(value.c_str()));
+    else if (name == "--port")
+      opt.port = std::atoi(value.c_str());
+    else
+    {
+      std::fprintf(stderr, "unknown option %s\n", arg.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  options opt;
+  if (!parse(argc, argv, opt))
+    return 1;
+
+#if !defined(_WIN32)
+  // one descriptor per link on each side
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+  {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+#endif
+
+  // TcpClient logs every connect on std::cout, stdout carries the results
+  std::streambuf* log = std::cout.rdbuf(0);
+
+#if defined(EXTEND_LOOPBACK_GROUP)
+  const std::vector<int> workers = opt.workers;
+#else
+  const std::vector<int> workers(1, 0);
+#endif
+  int port = opt.port;
+  for (int io_threads : opt.io_threads)
+    for (int worker_count : workers)
+      for (int conns : opt.conns)
+        for (int size : opt.sizes)
+        {
+          bench_case c = { size, conns, io_threads, worker_count };
+          run_case(opt, c, port);
+          // a fresh port range per case, no wait for TIME_WAIT
+          port += (std::max)(1, io_threads);
+        }
+
+  std::cout.rdbuf(log);
+  return 0;
+}
@@ -0,0 +1,207 @@
+//
+// compact_header.cpp
+// ~~~~~~~~~~~~~~~~~~
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include "asio/extend/framing.hpp"
+
+#include "asio/extend/frame_reader.hpp"
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "unit_test.hpp"
+
+using asio::CompactHeader;
+using asio::Framing;
+using asio::FrameReader;
+using asio::Message;
+using asio::MsgHeader;
+
+// header with the optional fields of flags set, sized by scale
+MsgHeader make_header(int flags, int scale)
+{
+  MsgHeader header;
+  header.body_len = scale * 1000 + flags;
+  header.msgId = scale % 2 ? -(scale * 77777) : scale * 300;
+  if (flags & CompactHeader::eSessionId) header.sId = 1ull << (scale * 9 % 64);
+  if (flags & CompactHeader::eCrc)       header.crc = static_cast<int>(0x89ABCDEFu + scale);
+  if (flags & CompactHeader::eFormat)    header.format = 3;
+  if (flags & CompactHeader::eGateId)    header.gateId = static_cast<uint8>(200 + scale);
+  if (flags & CompactHeader::eCrypto)    header.crypto = 0x18;
+  if (flags & CompactHeader::eAppId)     header.appId = 0xFF;
+  return header;
+}
+
+bool same_header(const MsgHeader& a, const MsgHeader& b)
+{
+  return a.msgId == b.msgId && a.body_len == b.body_len && a.sId == b.sId
+    && a.crc == b.crc && a.format == b.format && a.gateId == b.gateId
+    && a.crypto == b.crypto && a.appId == b.appId;
+}
+
+// standard frame of header with a body counting up from seed
+std::string make_frame(const MsgHeader& header, int seed)
+{
+  std::string frame(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (int i = 0; i < header.body_len; ++i)
+    frame.push_back(static_cast<char>(seed + i));
+  return frame;
+}
+
+// every flag combination encodes to Size() bytes and decodes back
+void round_trip_test()
+{
+  const int all = CompactHeader::eSessionId | CompactHeader::eCrc | CompactHeader::eFormat
+    | CompactHeader::eGateId | CompactHeader::eCrypto | CompactHeader::eAppId;
+  for (int flags = 0; flags <= all; ++flags)
+  {
+    for (int scale = 0; scale < 8; ++scale)
+    {
+      const MsgHeader header = make_header(flags, scale);
+      char buffer[CompactHeader::max_length];
+      const int written = CompactHeader::Encode(header, buffer);
+      ASIO_CHECK(written == CompactHeader::Size(header));
+      ASIO_CHECK(written <= CompactHeader::max_length);
+      ASIO_CHECK(static_cast<uint8>(buffer[0]) == flags);
+      MsgHeader decoded;
+      ASIO_CHECK(CompactHeader::Decode(buffer, written, decoded) == written);
+      ASIO_CHECK(same_header(header, decoded));
+    }
+  }
+
+  // a small client message fits in three bytes
+  MsgHeader small;
+  small.msgId = 5;
+  small.body_len = 20;
+  ASIO_CHECK(CompactHeader::Size(small) == 3);
+}
+
+// any prefix of a header asks for more bytes
+void truncated_test()
+{
+  for (int flags = 0; flags < 0x40; flags += 7)
+  {
+    const MsgHeader header = make_header(flags, 5);
+    char buffer[CompactHeader::max_length];
+    const int written = CompactHeader::Encode(header, buffer);
+    for (int length = 0; length < written; ++length)
+    {
+      MsgHeader decoded;
+      ASIO_CHECK(CompactHeader::Decode(buffer, length, decoded) == 0);
+    }
+  }
+}
+
+// reserved flag bits and overlong varints are not a compact header
+void reserved_bits_test()
+{
+  const uint8 reserved[] = { 0x40, 0x80, 0xC0, 0x41 };
+  for (uint8 flags : reserved)
+  {
+    const char bytes[] = { static_cast<char>(flags), 1, 1 };
+    MsgHeader decoded;
+    ASIO_CHECK(CompactHeader::Decode(bytes, sizeof(bytes), decoded) == -1);
+  }
+  const char overlong[] = { 0, '\x80', '\x80', '\x80', '\x80', '\x80', 1, 1 };
+  MsgHeader decoded;
+  ASIO_CHECK(CompactHeader::Decode(overlong, sizeof(overlong), decoded) == -1);
+}
+
+// back to back standard frames re-encode in order, a truncated tail is left out
+void from_standard_test()
+{
+  std::vector<MsgHeader> headers;
+  std::string bytes;
+  for (int i = 0; i < 10; ++i)
+  {
+    MsgHeader header = make_header(i * 5 % 0x40, i % 4);
+    header.body_len = i * 13;
+    headers.push_back(header);
+    bytes += make_frame(header, i);
+  }
+  const std::string tail = make_frame(make_header(1, 1), 0);
+  bytes += tail.substr(0, tail.size() - 1);
+
+  asio::PayloadPtr payload = CompactHeader::FromStandard(bytes.data(), static_cast<int>(bytes.size()));
+  const char* p = payload->data();
+  int left = payload->length();
+  for (int i = 0; i < 10; ++i)
+  {
+    MsgHeader decoded;
+    const int used = CompactHeader::Decode(p, left, decoded);
+    ASIO_CHECK(used > 0);
+    if (used <= 0)
+      return;
+    ASIO_CHECK(same_header(headers[i], decoded));
+    for (int b = 0; b < decoded.body_len; ++b)
+      ASIO_CHECK(p[used + b] == static_cast<char>(i + b));
+    p += used + decoded.body_len;
+    left -= used + decoded.body_len;
+  }
+  ASIO_CHECK(left == 0);
+
+  ASIO_CHECK(CompactHeader::FromStandard(bytes.data(), 10)->length() == 0);
+}
+
+// FrameReader expands compact frames split at every point into standard ones
+void frame_reader_test()
+{
+  std::vector<MsgHeader> headers;
+  std::string standard;
+  for (int i = 0; i < 16; ++i)
+  {
+    MsgHeader header = make_header(i * 3 % 0x40, 1);
+    header.crypto = 0; // no codec or crc flags, the body stays as is
+    header.body_len = (i * 37) % 300;
+    headers.push_back(header);
+    standard += make_frame(header, i);
+  }
+  asio::PayloadPtr payload = CompactHeader::FromStandard(standard.data(), static_cast<int>(standard.size()));
+  const std::string bytes(payload->data(), payload->length());
+
+  for (std::size_t chunk = 1; chunk <= 32; ++chunk)
+  {
+    FrameReader reader;
+    reader.set_framing(Framing::Compact);
+    Message msg;
+    int index = 0;
+    bool ok = true;
+    for (std::size_t offset = 0; ok && offset < bytes.size();)
+    {
+      asio::mutable_buffer space = reader.prepare();
+      const std::size_t length = (std::min)((std::min)(chunk, space.size()), bytes.size() - offset);
+      std::memcpy(space.data(), bytes.data() + offset, length);
+      reader.commit(length);
+      offset += length;
+      ok = reader.parse(msg, [&](Message& m)
+        {
+          const MsgHeader& header = *reinterpret_cast<const MsgHeader*>(m.data());
+          ASIO_CHECK(index < 16 && same_header(headers[index], header));
+          ASIO_CHECK(m.body_length() == header.body_len);
+          for (int b = 0; b < m.body_length(); ++b)
+            ASIO_CHECK(m.body()[b] == static_cast<char>(index + b));
+          ++index;
+        });
+    }
+    ASIO_CHECK(ok);
+    ASIO_CHECK(index == 16);
+    ASIO_CHECK(reader.pending() == 0);
+  }
+}
+
+ASIO_TEST_SUITE
+(
+  "compact_header",
+  ASIO_TEST_CASE(round_trip_test)
+  ASIO_TEST_CASE(truncated_test)
+  ASIO_TEST_CASE(reserved_bits_test)
+  ASIO_TEST_CASE(from_standard_test)
+  ASIO_TEST_CASE(frame_reader_test)
+)
@@ -0,0 +1,203 @@
+//
+// compress.cpp
+// ~~~~~~~~~~~~
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include "asio/extend/compress.hpp"
+
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include "unit_test.hpp"
+
+using asio::FrameCrc;
+using asio::FrameCrcMode;
+using asio::LzCodec;
+using asio::Message;
+using asio::MsgCompression;
+using asio::MsgHeader;
+
+enum input_kind { random_input, low_entropy_input, repetitive_input };
+
+std::string make_input(input_kind kind, int length, unsigned seed)
+{
+  std::mt19937 rng(seed);
+  std::string input(static_cast<std::size_t>(length), '\0');
+  for (int i = 0; i < length; ++i)
+  {
+    switch (kind)
+    {
+    case random_input: input[i] = static_cast<char>(rng()); break;
+    case low_entropy_input: input[i] = "abcd"[rng() % 4]; break;
+    case repetitive_input: input[i] = "the quick brown fox "[i % 20]; break;
+    }
+  }
+  return input;
+}
+
+std::string compress(const LzCodec& codec, const std::string& input)
+{
+  std::string out(static_cast<std::size_t>(codec.Bound(static_cast<int>(input.size()))), '\0');
+  const int packed = codec.Compress(input.data(), static_cast<int>(input.size()), &out[0], static_cast<int>(out.size()));
+  out.resize(packed > 0 ? static_cast<std::size_t>(packed) : 0);
+  return out;
+}
+
+// decompressed length of packed into capacity bytes, -1 on error
+int decompress(const LzCodec& codec, const std::string& packed, int capacity, std::string* out = 0)
+{
+  std::string buffer(static_cast<std::size_t>(capacity) + 1, '\0');
+  const int length = codec.Decompress(packed.data(), static_cast<int>(packed.size()), &buffer[0], capacity);
+  if (out && length >= 0)
+    out->assign(buffer.data(), static_cast<std::size_t>(length));
+  return length;
+}
+
+void round_trip_test()
+{
+  LzCodec codec;
+  const int lengths[] = { 1, 4, 12, 13, 17, 100, 255, 256, 1000, 4096, 20000, 65535, 65536 };
+  const input_kind kinds[] = { random_input, low_entropy_input, repetitive_input };
+  for (input_kind kind : kinds)
+  {
+    for (int length : lengths)
+    {
+      const std::string input = make_input(kind, length, static_cast<unsigned>(length));
+      const std::string packed = compress(codec, input);
+      ASIO_CHECK(!packed.empty());
+      ASIO_CHECK(static_cast<int>(packed.size()) <= codec.Bound(length));
+      if (kind == repetitive_input && length >= 1000)
+        ASIO_CHECK(packed.size() < input.size() / 10);
+      std::string output;
+      ASIO_CHECK(decompress(codec, packed, length, &output) == length);
+      ASIO_CHECK(output == input);
+    }
+  }
+}
+
+// truncated, corrupt or oversized input never decodes to the original
+void corrupt_input_test()
+{
+  LzCodec codec;
+  const std::string input = make_input(low_entropy_input, 4096, 7);
+  const std::string packed = compress(codec, input);
+  for (std::size_t length = 0; length < packed.size(); ++length)
+  {
+    std::string output;
+    const int result = decompress(codec, packed.substr(0, length), 4096, &output);
+    ASIO_CHECK(result < 0 || output != input);
+  }
+
+  // output larger than capacity
+  ASIO_CHECK(decompress(codec, packed, 4095) == -1);
+
+  // flipped bytes must not write outside the output
+  std::mt19937 rng(11);
+  for (int i = 0; i < 2000; ++i)
+  {
+    std::string broken = packed;
+    broken[rng() % broken.size()] = static_cast<char>(rng());
+    decompress(codec, broken, 4096);
+  }
+
+  // 4 literals, then a match of offset 0 and one reaching before the start
+  const char zero_offset[] = { '\x40', 'a', 'b', 'c', 'd', '\x00', '\x00' };
+  ASIO_CHECK(decompress(codec, std::string(zero_offset, sizeof(zero_offset)), 64) == -1);
+  const char far_offset[] = { '\x40', 'a', 'b', 'c', 'd', '\x05', '\x00' };
+  ASIO_CHECK(decompress(codec, std::string(far_offset, sizeof(far_offset)), 64) == -1);
+  const char good_offset[] = { '\x40', 'a', 'b', 'c', 'd', '\x04', '\x00' };
+  ASIO_CHECK(decompress(codec, std::string(good_offset, sizeof(good_offset)), 64) == 8);
+  // a literal length running past the input
+  const char long_literals[] = { '\xF0', '\xFF' };
+  ASIO_CHECK(decompress(codec, std::string(long_literals, sizeof(long_literals)), 64) == -1);
+}
+
+Message make_message(const std::string& body)
+{
+  Message msg;
+  MsgHeader header;
+  header.msgId = 42;
+  header.sId = 0x123456789ull;
+  header.body_len = static_cast<int>(body.size());
+  header.format = 1;
+  header.gateId = 7;
+  header.crypto = 0x01;
+  header.appId = 9;
+  msg.body_length(header.body_len);
+  msg.encode_header(header);
+  std::memcpy(msg.body(), body.data(), body.size());
+  return msg;
+}
+
+// Encode keeps every header field but the codec bits, Unpack restores the
+// body and clears the codec and crc bits
+void encode_unpack_test()
+{
+  FrameCrc::SetMode(FrameCrcMode::Sign);
+  MsgCompression::Enable(MsgCompression::lz_codec, 256);
+  const std::string body = make_input(repetitive_input, 8192, 0);
+  const Message msg = make_message(body);
+
+  asio::PayloadPtr payload = MsgCompression::Encode(msg);
+  const MsgHeader& wire = *reinterpret_cast<const MsgHeader*>(payload->data());
+  ASIO_CHECK(MsgCompression::Compressed(wire));
+  ASIO_CHECK((wire.crypto >> MsgCompression::codec_shift) == MsgCompression::lz_codec);
+  ASIO_CHECK((wire.crypto & asio::eCryptoCrc) != 0);
+  ASIO_CHECK(FrameCrc::Check(payload->data()));
+  ASIO_CHECK(wire.body_len < 1000);
+  ASIO_CHECK(payload->length() == Message::header_length + wire.body_len);
+  ASIO_CHECK(wire.msgId == 42 && wire.sId == 0x123456789ull && wire.format == 1
+    && wire.gateId == 7 && wire.appId == 9 && (wire.crypto & 0x07) == 0x01);
+
+  // off by default, receivers hand the body out as it is
+  ASIO_CHECK(!MsgCompression::Receiving());
+  ASIO_CHECK(!MsgCompression::ShouldUnpack(wire));
+  MsgCompression::EnableReceive(true);
+  ASIO_CHECK(MsgCompression::ShouldUnpack(wire));
+
+  Message received;
+  std::memcpy(received.data(), payload->data(), Message::header_length);
+  ASIO_CHECK(received.decode_header());
+  ASIO_CHECK(MsgCompression::Unpack(received, payload->data() + Message::header_length, wire.body_len));
+  const MsgHeader& plain = *reinterpret_cast<const MsgHeader*>(received.data());
+  ASIO_CHECK(received.body_length() == 8192 && plain.body_len == 8192);
+  ASIO_CHECK(std::memcmp(received.body(), body.data(), body.size()) == 0);
+  ASIO_CHECK(plain.crypto == 0x01 && plain.crc == 0);
+  ASIO_CHECK(plain.msgId == 42 && plain.sId == 0x123456789ull && plain.format == 1
+    && plain.gateId == 7 && plain.appId == 9);
+
+  // a truncated compressed body is rejected
+  Message truncated;
+  std::memcpy(truncated.data(), payload->data(), Message::header_length);
+  truncated.decode_header();
+  ASIO_CHECK(!MsgCompression::Unpack(truncated, payload->data() + Message::header_length, wire.body_len - 1));
+
+  // below the threshold or incompressible bodies go out as they are
+  const Message small = make_message(make_input(repetitive_input, 100, 0));
+  asio::PayloadPtr small_payload = MsgCompression::Encode(small);
+  ASIO_CHECK(!MsgCompression::Compressed(*reinterpret_cast<const MsgHeader*>(small_payload->data())));
+  ASIO_CHECK(small_payload->length() == small.length());
+  const Message noise = make_message(make_input(random_input, 4096, 3));
+  asio::PayloadPtr noise_payload = MsgCompression::Encode(noise);
+  ASIO_CHECK(!MsgCompression::Compressed(*reinterpret_cast<const MsgHeader*>(noise_payload->data())));
+  ASIO_CHECK(std::memcmp(noise_payload->data() + Message::header_length, noise.body(), noise.body_length()) == 0);
+
+  MsgCompression::EnableReceive(false);
+  MsgCompression::Enable(0);
+  FrameCrc::SetMode(FrameCrcMode::Off);
+}
+
+ASIO_TEST_SUITE
+(
+  "compress",
+  ASIO_TEST_CASE(round_trip_test)
+  ASIO_TEST_CASE(corrupt_input_test)
+  ASIO_TEST_CASE(encode_unpack_test)
+)
@@ -0,0 +1,140 @@
+//
+// frame_crc.cpp
+// ~~~~~~~~~~~~~
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include "asio/extend/frame_crc.hpp"
+
+#include "asio/extend/compress.hpp"
+#include "asio/extend/frame_reader.hpp"
+#include <cstring>
+#include <string>
+#include "unit_test.hpp"
+
+using asio::FrameCrc;
+using asio::FrameCrcMode;
+using asio::FrameReader;
+using asio::Message;
+using asio::MsgHeader;
+
+// standard frame of msg_id with a body of length bytes counting up from seed
+std::string make_frame(int msg_id, int length, int seed = 0)
+{
+  MsgHeader header;
+  header.msgId = msg_id;
+  header.body_len = length;
+  std::string frame(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (int i = 0; i < length; ++i)
+    frame.push_back(static_cast<char>(seed + i));
+  return frame;
+}
+
+const MsgHeader& header_of(const std::string& frame)
+{
+  return *reinterpret_cast<const MsgHeader*>(frame.data());
+}
+
+// true when the reader hands out the single frame in bytes
+bool read_frame(const std::string& bytes)
+{
+  FrameReader reader(bytes.size());
+  asio::mutable_buffer space = reader.prepare();
+  std::memcpy(space.data(), bytes.data(), bytes.size());
+  reader.commit(bytes.size());
+  Message msg;
+  return reader.next(msg) == 1;
+}
+
+// Off leaves frames as they are and accepts anything
+void off_test()
+{
+  FrameCrc::SetMode(FrameCrcMode::Off);
+  ASIO_CHECK(FrameCrc::Mode() == FrameCrcMode::Off);
+  std::string frame = make_frame(1, 100, 1);
+  const std::string plain = frame;
+  FrameCrc::Seal(&frame[0]);
+  ASIO_CHECK(frame == plain);
+  frame[sizeof(MsgHeader) + 10] ^= 0x55;
+  ASIO_CHECK(FrameCrc::Check(frame.data()));
+  std::string forged = make_frame(1, 100, 1);
+  const_cast<MsgHeader&>(header_of(forged)).crypto |= asio::eCryptoCrc;
+  ASIO_CHECK(FrameCrc::Check(forged.data()));
+  ASIO_CHECK(read_frame(forged));
+}
+
+// Sign fills crc, rejects a flagged frame that does not match and lets an
+// unflagged one through
+void sign_test()
+{
+  FrameCrc::SetMode(FrameCrcMode::Sign);
+  for (int length : { 0, 1, 7, 100, 4096 })
+  {
+    std::string frame = make_frame(2, length, length);
+    FrameCrc::Seal(&frame[0]);
+    ASIO_CHECK((header_of(frame).crypto & asio::eCryptoCrc) != 0);
+    ASIO_CHECK(FrameCrc::Check(frame.data()));
+    ASIO_CHECK(FrameCrc::Check(header_of(frame), frame.data() + sizeof(MsgHeader)));
+    ASIO_CHECK(read_frame(frame));
+    if (length > 0)
+    {
+      frame[sizeof(MsgHeader) + length / 2] ^= 0x01;
+      ASIO_CHECK(!FrameCrc::Check(frame.data()));
+      ASIO_CHECK(!read_frame(frame));
+    }
+  }
+  const std::string unsigned_frame = make_frame(3, 50, 3);
+  ASIO_CHECK(FrameCrc::Check(unsigned_frame.data()));
+  ASIO_CHECK(read_frame(unsigned_frame));
+  FrameCrc::SetMode(FrameCrcMode::Off);
+}
+
+// Require also rejects frames without the flag
+void require_test()
+{
+  FrameCrc::SetMode(FrameCrcMode::Require);
+  std::string frame = make_frame(4, 64, 4);
+  ASIO_CHECK(!FrameCrc::Check(frame.data()));
+  ASIO_CHECK(!read_frame(frame));
+  FrameCrc::Seal(&frame[0]);
+  ASIO_CHECK(FrameCrc::Check(frame.data()));
+  ASIO_CHECK(read_frame(frame));
+  frame[sizeof(MsgHeader)] ^= 0x80;
+  ASIO_CHECK(!FrameCrc::Check(frame.data()));
+  FrameCrc::SetMode(FrameCrcMode::Off);
+}
+
+// MsgCompression::Encode seals, Payload::Create leaves the frame alone
+void send_paths_test()
+{
+  FrameCrc::SetMode(FrameCrcMode::Sign);
+  Message msg;
+  MsgHeader header;
+  header.msgId = 5;
+  header.body_len = 32;
+  msg.body_length(32);
+  msg.encode_header(header);
+  for (int i = 0; i < 32; ++i)
+    msg.body()[i] = static_cast<char>(i);
+
+  asio::PayloadPtr sealed = asio::MsgCompression::Encode(msg);
+  ASIO_CHECK(FrameCrc::Check(sealed->data()));
+  ASIO_CHECK((reinterpret_cast<const MsgHeader*>(sealed->data())->crypto & asio::eCryptoCrc) != 0);
+  asio::PayloadPtr plain = asio::Payload::Create(msg);
+  ASIO_CHECK(std::memcmp(plain->data(), msg.data(), msg.length()) == 0);
+  FrameCrc::SetMode(FrameCrcMode::Off);
+}
+
+ASIO_TEST_SUITE
+(
+  "frame_crc",
+  ASIO_TEST_CASE(off_test)
+  ASIO_TEST_CASE(sign_test)
+  ASIO_TEST_CASE(require_test)
+  ASIO_TEST_CASE(send_paths_test)
+)
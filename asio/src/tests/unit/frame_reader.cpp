@@ -0,0 +1,178 @@
+//
+// frame_reader.cpp
+// ~~~~~~~~~~~~~~~~
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include "asio/extend/frame_reader.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "unit_test.hpp"
+
+using asio::FrameReader;
+using asio::Message;
+using asio::MsgHeader;
+
+// standard frame of msg_id with a body of length bytes counting up from seed
+std::string make_frame(int msg_id, int length, int seed = 0)
+{
+  MsgHeader header;
+  header.msgId = msg_id;
+  header.body_len = length;
+  std::string frame(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (int i = 0; i < length; ++i)
+    frame.push_back(static_cast<char>(seed + i));
+  return frame;
+}
+
+bool body_matches(const Message& msg, int seed)
+{
+  for (int i = 0; i < msg.body_length(); ++i)
+    if (msg.body()[i] != static_cast<char>(seed + i))
+      return false;
+  return true;
+}
+
+// feeds bytes through prepare() / commit() in reads of at most chunk bytes
+// and collects every parsed frame, false once the stream is corrupt
+bool feed(FrameReader& reader, const std::string& bytes, std::size_t chunk,
+    std::vector<std::pair<int, int> >& frames, std::vector<bool>* bodies = 0)
+{
+  Message msg;
+  std::size_t offset = 0;
+  while (offset < bytes.size())
+  {
+    asio::mutable_buffer space = reader.prepare();
+    const std::size_t length = (std::min)((std::min)(chunk, space.size()), bytes.size() - offset);
+    std::memcpy(space.data(), bytes.data() + offset, length);
+    reader.commit(length);
+    offset += length;
+    const bool ok = reader.parse(msg, [&](Message& m)
+        {
+          const MsgHeader* header = reinterpret_cast<const MsgHeader*>(m.data());
+          frames.push_back(std::make_pair(header->msgId, m.body_length()));
+          if (bodies)
+            bodies->push_back(body_matches(m, header->msgId));
+        });
+    if (!ok)
+      return false;
+  }
+  return true;
+}
+
+// many frames in one read come out in order
+void many_frames_per_read_test()
+{
+  std::string bytes;
+  for (int i = 1; i <= 50; ++i)
+    bytes += make_frame(i, i * 3, i);
+  FrameReader reader(64 * 1024);
+  std::vector<std::pair<int, int> > frames;
+  std::vector<bool> bodies;
+  ASIO_CHECK(feed(reader, bytes, bytes.size(), frames, &bodies));
+  ASIO_CHECK(frames.size() == 50);
+  for (int i = 0; i < static_cast<int>(frames.size()); ++i)
+  {
+    ASIO_CHECK(frames[i].first == i + 1);
+    ASIO_CHECK(frames[i].second == (i + 1) * 3);
+    ASIO_CHECK(bodies[i]);
+  }
+  ASIO_CHECK(reader.pending() == 0);
+}
+
+// headers and bodies split at every possible point still parse
+void partial_frames_test()
+{
+  std::string bytes;
+  for (int i = 1; i <= 20; ++i)
+    bytes += make_frame(i, (i * 37) % 200, i);
+  for (std::size_t chunk = 1; chunk <= 64; ++chunk)
+  {
+    FrameReader reader;
+    std::vector<std::pair<int, int> > frames;
+    std::vector<bool> bodies;
+    ASIO_CHECK(feed(reader, bytes, chunk, frames, &bodies));
+    ASIO_CHECK(frames.size() == 20);
+    for (int i = 0; i < static_cast<int>(frames.size()); ++i)
+    {
+      ASIO_CHECK(frames[i].first == i + 1);
+      ASIO_CHECK(bodies[i]);
+    }
+    ASIO_CHECK(reader.pending() == 0);
+  }
+}
+
+// a partial frame waits without being handed out
+void incomplete_frame_waits_test()
+{
+  const std::string frame = make_frame(7, 100, 7);
+  FrameReader reader;
+  Message msg;
+  for (std::size_t length = 0; length < frame.size(); ++length)
+  {
+    reader.clear();
+    asio::mutable_buffer space = reader.prepare();
+    std::memcpy(space.data(), frame.data(), length);
+    reader.commit(length);
+    ASIO_CHECK(reader.next(msg) == 0);
+  }
+}
+
+// a frame larger than the buffer grows it, then it drops back
+void large_frame_test()
+{
+  const int length = 256 * 1024;
+  std::string bytes = make_frame(1, 10, 1) + make_frame(2, length, 2) + make_frame(3, 10, 3);
+  FrameReader reader(1024);
+  std::vector<std::pair<int, int> > frames;
+  std::vector<bool> bodies;
+  ASIO_CHECK(feed(reader, bytes, 1000, frames, &bodies));
+  ASIO_CHECK(frames.size() == 3);
+  ASIO_CHECK(frames.size() == 3 && frames[1].second == length);
+  ASIO_CHECK(std::find(bodies.begin(), bodies.end(), false) == bodies.end());
+  Message msg;
+  ASIO_CHECK(reader.next(msg) == 0);
+  ASIO_CHECK(reader.prepare().size() < static_cast<std::size_t>(length));
+}
+
+// a body length outside [0, max_body_length] marks the stream corrupt
+void oversized_frame_test()
+{
+  const int lengths[] = { Message::max_body_length + 1, -1, 0x7fffffff };
+  for (int length : lengths)
+  {
+    MsgHeader header;
+    header.msgId = 1;
+    header.body_len = length;
+    std::string bytes = make_frame(1, 4, 1);
+    bytes.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    FrameReader reader;
+    std::vector<std::pair<int, int> > frames;
+    ASIO_CHECK(!feed(reader, bytes, bytes.size(), frames));
+    ASIO_CHECK(frames.size() == 1);
+  }
+
+  // the largest legal body still parses
+  FrameReader reader;
+  std::vector<std::pair<int, int> > frames;
+  ASIO_CHECK(feed(reader, make_frame(9, Message::max_body_length), 64 * 1024, frames));
+  ASIO_CHECK(frames.size() == 1 && frames[0].second == Message::max_body_length);
+}
+
+ASIO_TEST_SUITE
+(
+  "frame_reader",
+  ASIO_TEST_CASE(many_frames_per_read_test)
+  ASIO_TEST_CASE(partial_frames_test)
+  ASIO_TEST_CASE(incomplete_frame_waits_test)
+  ASIO_TEST_CASE(large_frame_test)
+  ASIO_TEST_CASE(oversized_frame_test)
+)
@@ -0,0 +1,124 @@
+//
+// session_lanes.cpp
+// ~~~~~~~~~~~~~~~~~
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include "asio/extend/session_lanes.hpp"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "unit_test.hpp"
+
+using asio::Message;
+using asio::MsgHeader;
+using asio::SessionLanes;
+
+const int producer_count = 8;
+const int sessions_per_producer = 16;
+const int messages_per_session = 2000;
+const int session_count = producer_count * sessions_per_producer;
+
+Message make_message(uint64 session, int seq)
+{
+  Message msg;
+  MsgHeader header;
+  header.msgId = seq;
+  header.sId = session;
+  header.body_len = 4;
+  msg.body_length(4);
+  msg.encode_header(header);
+  return msg;
+}
+
+// what the handler saw of one session
+struct session_state
+{
+  std::atomic<int> running{0};
+  std::atomic<int> next{0};
+  std::atomic<int> bad{0};
+};
+
+// Producers post interleaved sessions from many threads; every session is
+// handled in post order and never on two workers at once.
+void per_session_order_test()
+{
+  std::unique_ptr<session_state[]> states(new session_state[session_count]);
+  std::atomic<int> handled(0);
+  SessionLanes lanes;
+  lanes.Start(4, [&](Message& msg)
+    {
+      const MsgHeader* header = reinterpret_cast<const MsgHeader*>(msg.data());
+      session_state& state = states[static_cast<std::size_t>(header->sId)];
+      if (state.running.fetch_add(1) != 0)
+        ++state.bad;
+      if (header->msgId != state.next.load())
+        ++state.bad;
+      state.next.store(header->msgId + 1);
+      state.running.fetch_sub(1);
+      ++handled;
+    });
+  ASIO_CHECK(lanes.Workers() == 4);
+
+  std::vector<std::thread> producers;
+  for (int p = 0; p < producer_count; ++p)
+  {
+    producers.emplace_back([&, p]()
+      {
+        for (int seq = 0; seq < messages_per_session; ++seq)
+          for (int s = 0; s < sessions_per_producer; ++s)
+            lanes.Post(static_cast<uint64>(p * sessions_per_producer + s), make_message(p * sessions_per_producer + s, seq));
+      });
+  }
+  for (auto& producer : producers)
+    producer.join();
+
+  // Stop() runs what is still queued before the workers exit
+  lanes.Stop();
+  ASIO_CHECK(handled.load() == session_count * messages_per_session);
+  for (int s = 0; s < session_count; ++s)
+  {
+    ASIO_CHECK(states[s].bad.load() == 0);
+    ASIO_CHECK(states[s].next.load() == messages_per_session);
+  }
+}
+
+// the message reaches the handler moved, not copied
+void moved_message_test()
+{
+  const char* posted = 0;
+  const char* seen = 0;
+  SessionLanes lanes;
+  lanes.Start(1, [&](Message& msg) { seen = msg.data(); });
+  Message msg = make_message(1, 0);
+  posted = msg.data();
+  ASIO_CHECK(lanes.Post(1, std::move(msg)));
+  lanes.Stop();
+  ASIO_CHECK(seen == posted);
+}
+
+void post_after_stop_test()
+{
+  SessionLanes lanes;
+  ASIO_CHECK(!lanes.Post(1, make_message(1, 0)));
+  int handled = 0;
+  lanes.Start(2, [&](Message&) { ++handled; });
+  lanes.Stop();
+  ASIO_CHECK(!lanes.Post(1, make_message(1, 0)));
+  ASIO_CHECK(handled == 0);
+}
+
+ASIO_TEST_SUITE
+(
+  "session_lanes",
+  ASIO_TEST_CASE(per_session_order_test)
+  ASIO_TEST_CASE(moved_message_test)
+  ASIO_TEST_CASE(post_after_stop_test)
+)
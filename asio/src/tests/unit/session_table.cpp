@@ -0,0 +1,172 @@
+//
+// session_table.cpp
+// ~~~~~~~~~~~~~~~~~
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include "asio/extend/session_table.hpp"
+
+#include "asio/extend/object.hpp"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+#include "unit_test.hpp"
+
+using asio::NetObject;
+using asio::SessionTable;
+typedef std::shared_ptr<NetObject> NetObjectPtr;
+
+NetObjectPtr make_object(uint64 id)
+{
+  NetObjectPtr obj = std::make_shared<NetObject>();
+  obj->setSessionId(id);
+  return obj;
+}
+
+std::size_t snapshot_size(const SessionTable::SnapshotList& list)
+{
+  std::size_t size = 0;
+  for (const auto& view : list)
+    size += view->size();
+  return size;
+}
+
+void insert_erase_test()
+{
+  SessionTable table(8);
+  ASIO_CHECK(table.ShardCount() == 8);
+  NetObjectPtr a = make_object(1);
+  NetObjectPtr b = make_object(2);
+  ASIO_CHECK(table.Insert(1, a));
+  ASIO_CHECK(!table.Insert(1, b));
+  ASIO_CHECK(table.Insert(2, b));
+  ASIO_CHECK(table.Size() == 2);
+  ASIO_CHECK(table.Find(1) == a);
+  ASIO_CHECK(table.Find(3) == nullptr);
+
+  // only the owner removes its entry
+  ASIO_CHECK(!table.Erase(1, b.get()));
+  ASIO_CHECK(table.Find(1) == a);
+  ASIO_CHECK(table.Erase(1, a.get()));
+  ASIO_CHECK(!table.Erase(1));
+  ASIO_CHECK(table.Size() == 1);
+
+  table.Clear();
+  ASIO_CHECK(table.Size() == 0);
+  ASIO_CHECK(table.Snapshot().empty());
+}
+
+// unchanged shards hand out the same view, a change rebuilds one shard
+void snapshot_reuse_test()
+{
+  SessionTable table(16);
+  std::vector<NetObjectPtr> objects;
+  for (uint64 id = 1; id <= 1000; ++id)
+  {
+    objects.push_back(make_object(id));
+    table.Insert(id, objects.back());
+  }
+  SessionTable::SnapshotList first = table.Snapshot();
+  SessionTable::SnapshotList second = table.Snapshot();
+  ASIO_CHECK(snapshot_size(first) == 1000);
+  ASIO_CHECK(first.size() == second.size());
+  for (std::size_t i = 0; i < first.size() && i < second.size(); ++i)
+    ASIO_CHECK(first[i] == second[i]);
+
+  table.Erase(500);
+  SessionTable::SnapshotList third = table.Snapshot();
+  ASIO_CHECK(snapshot_size(third) == 999);
+  std::size_t changed = 0;
+  for (std::size_t i = 0; i < first.size() && i < third.size(); ++i)
+    changed += first[i] != third[i] ? 1 : 0;
+  ASIO_CHECK(changed == 1);
+  // the old snapshot still holds what it saw
+  ASIO_CHECK(snapshot_size(first) == 1000);
+}
+
+// Writers join and leave their own id ranges while readers look ids up and
+// take snapshots; every view stays consistent and the totals add up.
+void concurrent_test()
+{
+  const int writers = 4;
+  const int readers = 2;
+  const uint64 per_writer = 5000;
+  SessionTable table;
+  std::atomic<bool> done(false);
+  std::atomic<int> bad(0);
+
+  std::vector<std::thread> threads;
+  for (int w = 0; w < writers; ++w)
+  {
+    threads.emplace_back([&, w]()
+      {
+        const uint64 base = static_cast<uint64>(w) * per_writer + 1;
+        std::vector<NetObjectPtr> objects;
+        for (uint64 i = 0; i < per_writer; ++i)
+        {
+          objects.push_back(make_object(base + i));
+          if (!table.Insert(base + i, objects.back()))
+            ++bad;
+        }
+        // leave every odd id again
+        for (uint64 i = 1; i < per_writer; i += 2)
+          if (!table.Erase(base + i, objects[i].get()))
+            ++bad;
+      });
+  }
+  for (int r = 0; r < readers; ++r)
+  {
+    threads.emplace_back([&]()
+      {
+        while (!done.load())
+        {
+          for (const auto& view : table.Snapshot())
+          {
+            std::set<NetObject*> seen;
+            for (const auto& obj : *view)
+              if (!obj || !seen.insert(obj.get()).second)
+                ++bad;
+          }
+          for (uint64 id = 1; id <= writers * per_writer; id += 97)
+          {
+            NetObjectPtr obj = table.Find(id);
+            if (obj && obj->getSessionId() != id)
+              ++bad;
+          }
+        }
+      });
+  }
+  for (int w = 0; w < writers; ++w)
+    threads[w].join();
+  done = true;
+  for (std::size_t i = writers; i < threads.size(); ++i)
+    threads[i].join();
+
+  ASIO_CHECK(bad.load() == 0);
+  const std::size_t expected = writers * (per_writer / 2);
+  ASIO_CHECK(table.Size() == expected);
+  ASIO_CHECK(snapshot_size(table.Snapshot()) == expected);
+  std::size_t visited = 0;
+  table.ForEach([&](const NetObjectPtr& obj)
+    {
+      ++visited;
+      ASIO_CHECK(obj->getSessionId() % 2 == 1);
+    });
+  ASIO_CHECK(visited == expected);
+}
+
+ASIO_TEST_SUITE
+(
+  "session_table",
+  ASIO_TEST_CASE(insert_erase_test)
+  ASIO_TEST_CASE(snapshot_reuse_test)
+  ASIO_TEST_CASE(concurrent_test)
+)
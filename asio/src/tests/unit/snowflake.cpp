@@ -0,0 +1,138 @@
+//
+// snowflake.cpp
+// ~~~~~~~~~~~~~
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include "asio/extend/snowflake.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "unit_test.hpp"
+
+typedef snowflake_atomic<1534832906275L> generator;
+
+const int thread_count = 16;
+const int ids_per_thread = 20000;
+
+// 16 threads released together, each keeps the ids it got in order
+template <typename Next>
+std::vector<std::vector<int64_t> > storm(Next next)
+{
+  std::vector<std::vector<int64_t> > ids(thread_count);
+  std::atomic<int> ready(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_count; ++t)
+  {
+    threads.emplace_back([&, t]()
+      {
+        ids[t].reserve(ids_per_thread);
+        ready.fetch_add(1);
+        while (ready.load() < thread_count)
+          std::this_thread::yield();
+        for (int i = 0; i < ids_per_thread; ++i)
+          ids[t].push_back(next());
+      });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  return ids;
+}
+
+void check_storm(const std::vector<std::vector<int64_t> >& ids)
+{
+  std::vector<int64_t> all;
+  for (const auto& list : ids)
+  {
+    ASIO_CHECK(list.size() == static_cast<std::size_t>(ids_per_thread));
+    ASIO_CHECK(std::adjacent_find(list.begin(), list.end(),
+          [](int64_t a, int64_t b) { return a >= b; }) == list.end());
+    all.insert(all.end(), list.begin(), list.end());
+  }
+  std::sort(all.begin(), all.end());
+  ASIO_CHECK(std::adjacent_find(all.begin(), all.end()) == all.end());
+  ASIO_CHECK(all.size() == static_cast<std::size_t>(thread_count) * ids_per_thread);
+}
+
+void node_bits_test()
+{
+  generator gen;
+  gen.init(3, 7);
+  for (int i = 0; i < 10000; ++i)
+  {
+    const int64_t id = gen.nextid();
+    ASIO_CHECK(((id >> 12) & 0x1f) == 3);
+    ASIO_CHECK(((id >> 17) & 0x1f) == 7);
+  }
+}
+
+// more ids than one millisecond holds, the sequence carries without a wait
+void sequence_carry_test()
+{
+  generator gen;
+  gen.init(1, 1);
+  int64_t last = gen.nextid();
+  for (int i = 0; i < 3 * 4096; ++i)
+  {
+    const int64_t id = gen.nextid();
+    ASIO_CHECK(id > last);
+    last = id;
+  }
+  generator::block ids = gen.reserve(10000);
+  ASIO_CHECK(ids.size() == 10000);
+  int64_t prev = ids.next();
+  ASIO_CHECK(prev > last);
+  while (!ids.empty())
+  {
+    const int64_t id = ids.next();
+    ASIO_CHECK(id > prev);
+    ASIO_CHECK((id & 0xfff) < 4096);
+    prev = id;
+  }
+  ASIO_CHECK(gen.nextid() > prev);
+}
+
+void nextid_storm_test()
+{
+  generator gen;
+  gen.init(1, 1);
+  check_storm(storm([&gen]() { return gen.nextid(); }));
+}
+
+void nextid_local_storm_test()
+{
+  generator gen;
+  gen.init(1, 1);
+  check_storm(storm([&gen]() { return gen.nextid_local(64); }));
+}
+
+// a thread cache filled by one generator is never used for another
+void local_cache_owner_test()
+{
+  generator a;
+  a.init(1, 1);
+  generator b;
+  b.init(2, 1);
+  for (int i = 0; i < 100; ++i)
+  {
+    ASIO_CHECK(((a.nextid_local(16) >> 12) & 0x1f) == 1);
+    ASIO_CHECK(((b.nextid_local(16) >> 12) & 0x1f) == 2);
+  }
+}
+
+ASIO_TEST_SUITE
+(
+  "snowflake",
+  ASIO_TEST_CASE(node_bits_test)
+  ASIO_TEST_CASE(sequence_carry_test)
+  ASIO_TEST_CASE(nextid_storm_test)
+  ASIO_TEST_CASE(nextid_local_storm_test)
+  ASIO_TEST_CASE(local_cache_owner_test)
+)
@@ -0,0 +1,164 @@
+//
+// submit_queue.cpp
+// ~~~~~~~~~~~~~~~~
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include "asio/extend/submit_queue.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "unit_test.hpp"
+
+using asio::PayloadSlice;
+using asio::SubmitQueue;
+
+// slice whose bytes name the producer and its sequence number
+PayloadSlice make_slice(int producer, int seq)
+{
+  const int values[2] = { producer, seq };
+  return PayloadSlice(asio::Payload::Create(reinterpret_cast<const char*>(values), sizeof(values)));
+}
+
+void read_slice(const PayloadSlice& slice, int& producer, int& seq)
+{
+  int values[2];
+  std::memcpy(values, slice.data(), sizeof(values));
+  producer = values[0];
+  seq = values[1];
+}
+
+// only the push that finds the queue empty schedules a drain
+void first_push_schedules_test()
+{
+  SubmitQueue queue;
+  ASIO_CHECK(queue.empty());
+  ASIO_CHECK(queue.drain([](PayloadSlice&&) {}) == 0);
+  ASIO_CHECK(queue.push(make_slice(0, 0)));
+  ASIO_CHECK(!queue.empty());
+  for (int seq = 1; seq < 10; ++seq)
+    ASIO_CHECK(!queue.push(make_slice(0, seq)));
+
+  int next = 0;
+  ASIO_CHECK(queue.drain([&](PayloadSlice&& slice)
+    {
+      int producer, seq;
+      read_slice(slice, producer, seq);
+      ASIO_CHECK(producer == 0 && seq == next);
+      ++next;
+    }) == 10);
+  ASIO_CHECK(next == 10);
+  ASIO_CHECK(queue.empty());
+
+  // empty again, the next push schedules once more
+  ASIO_CHECK(queue.push(make_slice(0, 10)));
+  ASIO_CHECK(!queue.push(make_slice(0, 11)));
+
+  // slices a drain hands over run while the queue already takes new ones
+  std::size_t drained = queue.drain([&](PayloadSlice&&)
+    {
+      ASIO_CHECK(queue.empty());
+    });
+  ASIO_CHECK(drained == 2);
+}
+
+// Producers push from many threads and schedule a drain only when push()
+// says so, as the sessions do. Nothing is stranded, every producer's slices
+// arrive in its push order, and each scheduled drain finds work or was
+// overtaken by an earlier one.
+void multi_producer_test()
+{
+  const int producers = 8;
+  const int per_producer = 20000;
+  SubmitQueue queue;
+  std::mutex mutex;
+  std::condition_variable ready;
+  int scheduled = 0;
+  std::vector<int> next(producers, 0);
+  int received = 0;
+  int bad = 0;
+  int drains = 0;
+
+  std::thread consumer([&]()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (received < producers * per_producer)
+      {
+        if (!ready.wait_for(lock, std::chrono::seconds(10), [&] { return scheduled > 0; }))
+          break; // a slice was stranded without a drain scheduled
+        --scheduled;
+        lock.unlock();
+        int count = 0;
+        queue.drain([&](PayloadSlice&& slice)
+          {
+            int producer, seq;
+            read_slice(slice, producer, seq);
+            if (producer < 0 || producer >= producers || seq != next[producer])
+              ++bad;
+            else
+              ++next[producer];
+            ++count;
+          });
+        lock.lock();
+        received += count;
+        ++drains;
+      }
+    });
+
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; ++p)
+  {
+    threads.emplace_back([&, p]()
+      {
+        for (int seq = 0; seq < per_producer; ++seq)
+        {
+          if (queue.push(make_slice(p, seq)))
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++scheduled;
+            ready.notify_one();
+          }
+        }
+      });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  consumer.join();
+
+  ASIO_CHECK(bad == 0);
+  ASIO_CHECK(received == producers * per_producer);
+  for (int p = 0; p < producers; ++p)
+    ASIO_CHECK(next[p] == per_producer);
+  ASIO_CHECK(drains <= received);
+  ASIO_CHECK(queue.empty());
+}
+
+// the destructor releases slices nobody drained
+void destroy_pending_test()
+{
+  asio::PayloadPtr payload = asio::Payload::Create("abcd", 4);
+  {
+    SubmitQueue queue;
+    queue.push(PayloadSlice(payload));
+    queue.push(PayloadSlice(payload));
+    ASIO_CHECK(payload->use_count() == 3);
+  }
+  ASIO_CHECK(payload->use_count() == 1);
+}
+
+ASIO_TEST_SUITE
+(
+  "submit_queue",
+  ASIO_TEST_CASE(first_push_schedules_test)
+  ASIO_TEST_CASE(multi_producer_test)
+  ASIO_TEST_CASE(destroy_pending_test)
+)
@@ -0,0 +1,136 @@
+//
+// timer.cpp
+// ~~~~~~~~~
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include "asio/extend/timer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+#include "unit_test.hpp"
+
+using asio::AsioTimer;
+
+class test_timer : public AsioTimer
+{
+public:
+  ~test_timer()
+  {
+    this->Stop();
+  }
+
+  // runs the timer's context on the calling thread for d
+  void RunFor(std::chrono::milliseconds d)
+  {
+    this->Once(d, [this]() { this->GetContext().stop(); });
+    this->GetContext().run();
+  }
+
+protected:
+  void Init() override {}
+  void Exit() override {}
+};
+
+// A run that stalls for ten periods costs one late catch-up run, the lost
+// periods are skipped instead of fired back to back, so the rate never
+// goes above one run per interval.
+void fixed_rate_skip_test()
+{
+  test_timer timer;
+  const auto interval = std::chrono::milliseconds(10);
+  std::vector<AsioTimer::clock::time_point> runs;
+  timer.Every(interval, [&]()
+    {
+      runs.push_back(AsioTimer::clock::now());
+      if (runs.size() == 1)
+        std::this_thread::sleep_for(interval * 10);
+    });
+  const auto started = AsioTimer::clock::now();
+  timer.RunFor(std::chrono::milliseconds(200));
+  const auto window = AsioTimer::clock::now() - started;
+
+  // bunched, all twenty periods of the window would have run
+  ASIO_CHECK(runs.size() >= 3);
+  ASIO_CHECK(runs.size() <= static_cast<std::size_t>(window / interval) - 8);
+  ASIO_CHECK(timer.Active() == 1);
+}
+
+// a recurring task that cancels itself does not come back, and one task
+// may cancel or schedule others
+void cancel_from_task_test()
+{
+  test_timer timer;
+  int count = 0;
+  AsioTimer::TimerId self = 0;
+  self = timer.Every(std::chrono::milliseconds(5), [&]()
+    {
+      if (++count == 3)
+        timer.Cancel(self);
+    });
+  ASIO_CHECK(self != 0);
+
+  bool victim_ran = false;
+  bool scheduled_ran = false;
+  const AsioTimer::TimerId victim = timer.Once(std::chrono::milliseconds(60), [&]() { victim_ran = true; });
+  timer.Once(std::chrono::milliseconds(20), [&]()
+    {
+      timer.Cancel(victim);
+      timer.Once(std::chrono::milliseconds(10), [&]() { scheduled_ran = true; });
+    });
+  timer.RunFor(std::chrono::milliseconds(120));
+
+  ASIO_CHECK(count == 3);
+  ASIO_CHECK(!victim_ran);
+  ASIO_CHECK(scheduled_ran);
+  ASIO_CHECK(timer.Active() == 0);
+  timer.Cancel(self); // already gone
+  timer.Cancel(0);
+}
+
+// requests from other threads reach the timer thread
+void cross_thread_test()
+{
+  test_timer timer;
+  timer.Startup();
+  std::atomic<int> fired(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t)
+  {
+    threads.emplace_back([&]()
+      {
+        for (int i = 0; i < 100; ++i)
+        {
+          const AsioTimer::TimerId id = timer.Once(std::chrono::milliseconds(i % 10), [&]() { ++fired; });
+          if (i % 2)
+            timer.Cancel(id);
+        }
+      });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  std::promise<void> done;
+  timer.Once(std::chrono::milliseconds(50), [&]() { done.set_value(); });
+  ASIO_CHECK(done.get_future().wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+  // every uncancelled timer ran, a cancel may lose the race with a short delay
+  ASIO_CHECK(fired.load() >= 200 && fired.load() <= 400);
+  timer.Stop();
+  ASIO_CHECK(timer.Active() == 0);
+}
+
+ASIO_TEST_SUITE
+(
+  "timer",
+  ASIO_TEST_CASE(fixed_rate_skip_test)
+  ASIO_TEST_CASE(cancel_from_task_test)
+  ASIO_TEST_CASE(cross_thread_test)
+)
@@ -0,0 +1,178 @@
+//
+// timer_wheel.cpp
+// ~~~~~~~~~~~~~~~
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include "asio/extend/timer_wheel.hpp"
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include "unit_test.hpp"
+
+using asio::TimerWheel;
+using asio::WheelTimer;
+
+// records the tick it fired at
+class probe : public WheelTimer
+{
+public:
+  explicit probe(TimerWheel& wheel) : wheel_(wheel) {}
+
+  uint64 fired = 0;
+  int count = 0;
+  std::function<void()> on_expire;
+
+protected:
+  void expire() override
+  {
+    fired = wheel_.now();
+    ++count;
+    if (on_expire)
+      on_expire();
+  }
+
+private:
+  TimerWheel& wheel_;
+};
+
+const uint64 revolution = uint64(1) << (TimerWheel::level_bits * TimerWheel::levels);
+
+// a wheel whose clock only moves by fast_forward() while a test runs
+TimerWheel& steady_wheel(asio::io_context& context)
+{
+  TimerWheel& wheel = TimerWheel::of(context);
+  wheel.set_resolution(std::chrono::minutes(1));
+  return wheel;
+}
+
+// Deadlines on every level and past one revolution of the top level fire
+// exactly at their tick after cascading down, not before.
+void cascade_test()
+{
+  asio::io_context context;
+  TimerWheel& wheel = steady_wheel(context);
+  const uint64 deltas[] = { 1, 2, 63, 64, 65, 127, 4095, 4096, 4097, 10000,
+    262143, 262144, 262145, 1000000, revolution - 1, revolution, revolution + 1,
+    2 * revolution + 17 };
+  std::vector<std::unique_ptr<probe> > probes;
+  const uint64 start = wheel.now();
+  for (uint64 delta : deltas)
+  {
+    probes.emplace_back(new probe(wheel));
+    wheel.arm_at(*probes.back(), start + delta);
+  }
+  ASIO_CHECK(wheel.size() == probes.size());
+
+  // step to just before each deadline, then onto it
+  for (std::size_t i = 0; i < probes.size(); ++i)
+  {
+    const uint64 deadline = probes[i]->deadline();
+    ASIO_CHECK(deadline == start + deltas[i]);
+    if (wheel.now() + 1 < deadline)
+      wheel.fast_forward(deadline - 1 - wheel.now());
+    ASIO_CHECK(probes[i]->count == 0);
+    ASIO_CHECK(probes[i]->armed());
+    wheel.fast_forward(1);
+    ASIO_CHECK(probes[i]->count == 1);
+    ASIO_CHECK(probes[i]->fired == deadline);
+    ASIO_CHECK(!probes[i]->armed());
+    ASIO_CHECK(wheel.size() == probes.size() - i - 1);
+  }
+  ASIO_CHECK(wheel.size() == 0);
+}
+
+// many deadlines from an offset clock, run in one go
+void cascade_offset_test()
+{
+  asio::io_context context;
+  TimerWheel& wheel = steady_wheel(context);
+  probe anchor(wheel);
+  wheel.arm_at(anchor, 3 * revolution);
+  wheel.fast_forward(12345);
+  std::vector<std::unique_ptr<probe> > probes;
+  for (uint64 delta = 1; delta < 300000; delta = delta * 3 + 7)
+  {
+    probes.emplace_back(new probe(wheel));
+    wheel.arm(*probes.back(), std::chrono::milliseconds(delta * wheel.resolution().count()));
+  }
+  wheel.fast_forward(400000);
+  for (const auto& p : probes)
+  {
+    ASIO_CHECK(p->count == 1);
+    ASIO_CHECK(p->fired == p->deadline());
+  }
+  ASIO_CHECK(anchor.armed());
+  anchor.cancel();
+  ASIO_CHECK(wheel.size() == 0);
+}
+
+// expire() may re-arm itself and cancel or arm others due at the same tick
+void rearm_cancel_test()
+{
+  asio::io_context context;
+  TimerWheel& wheel = steady_wheel(context);
+  probe repeating(wheel);
+  probe victim(wheel);
+  probe late(wheel);
+  repeating.on_expire = [&]()
+    {
+      if (repeating.count < 5)
+        wheel.arm_at(repeating, wheel.now() + 70);
+      victim.cancel();
+      if (!late.armed() && late.count == 0)
+        wheel.arm_at(late, wheel.now());
+    };
+  wheel.arm_at(repeating, wheel.now() + 10);
+  wheel.arm_at(victim, wheel.now() + 10);
+  const uint64 start = wheel.now();
+  wheel.fast_forward(1000);
+  ASIO_CHECK(repeating.count == 5);
+  ASIO_CHECK(repeating.fired == start + 10 + 4 * 70);
+  // cancelled from the same due list before its turn
+  ASIO_CHECK(victim.count == 0);
+  ASIO_CHECK(late.count == 1 && late.fired == start + 11);
+  ASIO_CHECK(wheel.size() == 0);
+
+  // a destroyed entry leaves the wheel
+  {
+    probe gone(wheel);
+    wheel.arm_at(gone, wheel.now() + 5000);
+    ASIO_CHECK(wheel.size() == 1);
+  }
+  ASIO_CHECK(wheel.size() == 0);
+}
+
+// on real time the wheel fires and lets run() return once it is empty
+void run_test()
+{
+  asio::io_context context;
+  TimerWheel& wheel = TimerWheel::of(context);
+  wheel.set_resolution(std::chrono::milliseconds(1));
+  probe near(wheel);
+  probe cascaded(wheel);
+  wheel.arm(near, std::chrono::milliseconds(5));
+  wheel.arm(cascaded, std::chrono::milliseconds(150));
+  const auto started = std::chrono::steady_clock::now();
+  context.run();
+  const auto took = std::chrono::steady_clock::now() - started;
+  ASIO_CHECK(near.count == 1 && near.fired == near.deadline());
+  ASIO_CHECK(cascaded.count == 1 && cascaded.fired == cascaded.deadline());
+  ASIO_CHECK(took >= std::chrono::milliseconds(140));
+  ASIO_CHECK(wheel.size() == 0);
+}
+
+ASIO_TEST_SUITE
+(
+  "timer_wheel",
+  ASIO_TEST_CASE(cascade_test)
+  ASIO_TEST_CASE(cascade_offset_test)
+  ASIO_TEST_CASE(rearm_cancel_test)
+  ASIO_TEST_CASE(run_test)
+)